@@ -26,18 +26,43 @@
 
 #include "sdcard.h"
 
+#include <string.h>
+
 #define SDCARD_WAIT_RETRY    10
 #define SDCARD_MAX_RETRY     10
 
+// Timeouts used before the card registers are read
 #define SDCARD_TIMEOUT_WRITE 500 // [ms]
 #define SDCARD_TIMEOUT_READ  200 // [ms]
-#define SDCARD_TIMEOUT_ERASE 30000 // [ms]
+
+// Adaptive timeouts: lower bound, samples before use them and number of
+// mean deviations added to the mean
+#define SDCARD_TIMEOUT_MIN          10 // [ms]
+#define SDCARD_LATENCY_SAMPLES      16
+#define SDCARD_LATENCY_DEVIATIONS    4
+
+// Polling of ACMD41/CMD1: the delay starts from 1 ms and it is doubled
+#define SDCARD_INIT_MAX_DELAY       16 // [ms]
+#define SDCARD_INIT_TIMEOUT       1000 // [ms]
+
+#define SDCARD_CLOCK_INIT          400000 // [Hz]
+#define SDCARD_CLOCK_DEFAULT     25000000 // [Hz]
+#define SDCARD_CLOCK_HIGH_SPEED  50000000 // [Hz]
+#define SDCARD_TIMEOUT_ERASE 30000 // [ms], without the erase fields of SD Status
+
+static const SDCard_RetryPolicy SDCard_defaultRetryPolicy[SDCARD_RETRYCOMMAND_COUNT] =
+{
+    [SDCARD_RETRYCOMMAND_RESET] = {SDCARD_MAX_RETRY,  1, 16, 2},
+    [SDCARD_RETRYCOMMAND_READ]  = {SDCARD_MAX_RETRY,  1, 16, 2},
+    [SDCARD_RETRYCOMMAND_WRITE] = {SDCARD_MAX_RETRY,  1, 16, 2},
+};
 
 typedef enum _SDCard_Command
 {
     /* Basic command set */
     SDCARD_COMMAND_0  = 0x40,                  /**< Reset cards to idle state */
     SDCARD_COMMAND_1  = 0x41,  /**< Read the OCR (MMC mode, DNU for SD cards) */
+    SDCARD_COMMAND_6  = 0x46,        /**< Check and switch the card function */
     SDCARD_COMMAND_8  = 0x48,          /**< Send SD card interface conditions */
     SDCARD_COMMAND_9  = 0x49,                         /**< Card sends the CSD */
     SDCARD_COMMAND_10 = 0x4A,                             /**< Card sends CID */
@@ -73,6 +98,7 @@ typedef enum _SDCard_Command
     SDCARD_COMMAND_58 = 0x7A,               /**< Read the OCR (SPI mode only) */
     SDCARD_COMMAND_59 = 0x7B,                            /**< Turn CRC ON/OFF */
 
+    SDCARD_COMMAND_A13 = 0x4D,                    /**< Send the SD Status */
     SDCARD_COMMAND_A23 = 0x57,        /**< Set the number of erase block */
     SDCARD_COMMAND_A41 = 0x69,         /**< Get the card's OCR (SD mode) */
 
@@ -82,29 +108,264 @@ typedef enum _SDCard_Response
 {
     SDCARD_RESPONSE_OK    = 0x00,
     SDCARD_RESPONSE_IDLE  = 0x01,
-    SDCARD_RESPONSE_FAULT = 0x05
+    SDCARD_RESPONSE_FAULT = 0x05,
+    SDCARD_RESPONSE_CRC   = 0x0B,     /**< Data rejected due to a CRC error */
 } SDCard_Response;
 
+typedef enum _SDCard_AsyncState
+{
+    SDCARD_ASYNCSTATE_IDLE = 0,
+
+    SDCARD_ASYNCSTATE_INIT_WARM,
+    SDCARD_ASYNCSTATE_INIT_STOP,
+    SDCARD_ASYNCSTATE_INIT_RESET,
+    SDCARD_ASYNCSTATE_INIT_CRC_ON,
+    SDCARD_ASYNCSTATE_INIT_IF_COND,
+    SDCARD_ASYNCSTATE_INIT_OP_COND,
+    SDCARD_ASYNCSTATE_INIT_OP_COND_V1,
+    SDCARD_ASYNCSTATE_INIT_OCR,
+    SDCARD_ASYNCSTATE_INIT_BLOCK_LENGTH,
+    SDCARD_ASYNCSTATE_INIT_CSD,
+    SDCARD_ASYNCSTATE_INIT_CSD_TOKEN,
+    SDCARD_ASYNCSTATE_INIT_CID,
+    SDCARD_ASYNCSTATE_INIT_CID_TOKEN,
+    SDCARD_ASYNCSTATE_INIT_STATUS,
+    SDCARD_ASYNCSTATE_INIT_STATUS_TOKEN,
+    SDCARD_ASYNCSTATE_INIT_SWITCH,
+    SDCARD_ASYNCSTATE_INIT_SWITCH_TOKEN,
+    SDCARD_ASYNCSTATE_INIT_CLOCK,
+
+    SDCARD_ASYNCSTATE_READ_COMMAND,
+    SDCARD_ASYNCSTATE_READ_TOKEN,
+    SDCARD_ASYNCSTATE_READ_DATA,
+
+    SDCARD_ASYNCSTATE_WRITE_PRE_ERASE,
+    SDCARD_ASYNCSTATE_WRITE_COMMAND,
+    SDCARD_ASYNCSTATE_WRITE_BLOCK,
+    SDCARD_ASYNCSTATE_WRITE_DATA,
+    SDCARD_ASYNCSTATE_WRITE_BUSY,
+    SDCARD_ASYNCSTATE_WRITE_END,
+    SDCARD_ASYNCSTATE_WRITE_RESTART,
+    SDCARD_ASYNCSTATE_WRITE_STOP,
+
+    SDCARD_ASYNCSTATE_ERASE_COMMAND,
+    SDCARD_ASYNCSTATE_ERASE_BUSY,
+
+    SDCARD_ASYNCSTATE_CSD_COMMAND,
+    SDCARD_ASYNCSTATE_CSD_TOKEN,
+} SDCard_AsyncState;
+
+typedef enum _SDCard_Transfer
+{
+    SDCARD_TRANSFER_NONE = 0,
+    SDCARD_TRANSFER_READ,                                         /**< CMD18 */
+    SDCARD_TRANSFER_WRITE,                                        /**< CMD25 */
+} SDCard_Transfer;
+
+#ifdef WARCOMEB_SDCARD_CRC
+/**
+ * CRC7 of the commands (x^7 + x^3 + 1), indexed by (crc << 1) ^ byte.
+ */
+static const uint8_t SDCard_crc7Table[256] =
+{
+    0x00, 0x09, 0x12, 0x1B, 0x24, 0x2D, 0x36, 0x3F, 0x48, 0x41, 0x5A, 0x53, 0x6C, 0x65, 0x7E, 0x77,
+    0x19, 0x10, 0x0B, 0x02, 0x3D, 0x34, 0x2F, 0x26, 0x51, 0x58, 0x43, 0x4A, 0x75, 0x7C, 0x67, 0x6E,
+    0x32, 0x3B, 0x20, 0x29, 0x16, 0x1F, 0x04, 0x0D, 0x7A, 0x73, 0x68, 0x61, 0x5E, 0x57, 0x4C, 0x45,
+    0x2B, 0x22, 0x39, 0x30, 0x0F, 0x06, 0x1D, 0x14, 0x63, 0x6A, 0x71, 0x78, 0x47, 0x4E, 0x55, 0x5C,
+    0x64, 0x6D, 0x76, 0x7F, 0x40, 0x49, 0x52, 0x5B, 0x2C, 0x25, 0x3E, 0x37, 0x08, 0x01, 0x1A, 0x13,
+    0x7D, 0x74, 0x6F, 0x66, 0x59, 0x50, 0x4B, 0x42, 0x35, 0x3C, 0x27, 0x2E, 0x11, 0x18, 0x03, 0x0A,
+    0x56, 0x5F, 0x44, 0x4D, 0x72, 0x7B, 0x60, 0x69, 0x1E, 0x17, 0x0C, 0x05, 0x3A, 0x33, 0x28, 0x21,
+    0x4F, 0x46, 0x5D, 0x54, 0x6B, 0x62, 0x79, 0x70, 0x07, 0x0E, 0x15, 0x1C, 0x23, 0x2A, 0x31, 0x38,
+    0x41, 0x48, 0x53, 0x5A, 0x65, 0x6C, 0x77, 0x7E, 0x09, 0x00, 0x1B, 0x12, 0x2D, 0x24, 0x3F, 0x36,
+    0x58, 0x51, 0x4A, 0x43, 0x7C, 0x75, 0x6E, 0x67, 0x10, 0x19, 0x02, 0x0B, 0x34, 0x3D, 0x26, 0x2F,
+    0x73, 0x7A, 0x61, 0x68, 0x57, 0x5E, 0x45, 0x4C, 0x3B, 0x32, 0x29, 0x20, 0x1F, 0x16, 0x0D, 0x04,
+    0x6A, 0x63, 0x78, 0x71, 0x4E, 0x47, 0x5C, 0x55, 0x22, 0x2B, 0x30, 0x39, 0x06, 0x0F, 0x14, 0x1D,
+    0x25, 0x2C, 0x37, 0x3E, 0x01, 0x08, 0x13, 0x1A, 0x6D, 0x64, 0x7F, 0x76, 0x49, 0x40, 0x5B, 0x52,
+    0x3C, 0x35, 0x2E, 0x27, 0x18, 0x11, 0x0A, 0x03, 0x74, 0x7D, 0x66, 0x6F, 0x50, 0x59, 0x42, 0x4B,
+    0x17, 0x1E, 0x05, 0x0C, 0x33, 0x3A, 0x21, 0x28, 0x5F, 0x56, 0x4D, 0x44, 0x7B, 0x72, 0x69, 0x60,
+    0x0E, 0x07, 0x1C, 0x15, 0x2A, 0x23, 0x38, 0x31, 0x46, 0x4F, 0x54, 0x5D, 0x62, 0x6B, 0x70, 0x79,
+};
+
 /**
- * The function wait a maximum time configured by the user and check if the
- * SDCard is ready.
+ * The function computes the CRC7 of a command.
  *
- * @param[in] timeout Max timeout to wait for board is ready [ms]
- * @return SDCARD_ERRORS_OK if the card is ready, SDCARD_ERRORS_TIMEOUT
- *         otherwise.
+ * @param[in] data The command and its arguments
+ * @param[in] length The number of bytes
+ * @return The last byte of the command: CRC7 and end bit.
  */
-static SDCard_Errors SDCard_waitReady (SDCard_Device* dev, uint16_t timeout)
+static uint8_t SDCard_crc7 (const uint8_t* data, uint8_t length)
 {
-    uint8_t response;
-    uint32_t timer = dev->currentTime() + timeout;
+    uint8_t crc = 0;
 
-    do
+    while (length--)
+        crc = SDCard_crc7Table[(uint8_t)(crc << 1) ^ *data++];
+    return (crc << 1) | 0x01;
+}
+#endif
+
+#if defined(WARCOMEB_SDCARD_CRC) || defined(WARCOMEB_SDCARD_STORE_SEGMENTS)
+/**
+ * CRC16 of the data blocks (x^16 + x^12 + x^5 + 1), one byte for each step.
+ */
+static const uint16_t SDCard_crc16Table[256] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+/**
+ * The function computes the CRC16 of a data block, or of a part of it
+ * starting from the CRC of the previous bytes.
+ *
+ * @param[in] crc 0, or the CRC16 of the previous bytes
+ * @param[in] data The data block
+ * @param[in] length The number of bytes
+ * @return The CRC16, the high byte is sent first.
+ */
+static uint16_t SDCard_crc16 (uint16_t crc, const uint8_t* data, uint16_t length)
+{
+    while (length--)
+        crc = (crc << 8) ^ SDCard_crc16Table[(uint8_t)(crc >> 8) ^ *data++];
+    return crc;
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_METRICS
+/**
+ * The function returns the time used by the metrics.
+ *
+ * @param[in] dev An handle of the device
+ * @return The time, in units of metricsTime or of currentTime
+ */
+static uint32_t SDCard_metricsNow (SDCard_Device* dev)
+{
+    return (dev->metricsTime != 0) ? dev->metricsTime() : dev->currentTime();
+}
+
+/**
+ * The function adds a duration to a histogram.
+ *
+ * @param[in] histogram
+ * @param[in] duration
+ */
+static void SDCard_metricsAdd (SDCard_Histogram* histogram, uint32_t duration)
+{
+    uint8_t bin = 0;
+
+    // The bin is the number of significant bits
+    while ((bin < (SDCARD_METRICS_BINS - 1)) && ((duration >> bin) != 0))
+        bin++;
+
+    histogram->count++;
+    histogram->total += duration;
+    if (duration > histogram->max)
+        histogram->max = duration;
+    histogram->bins[bin]++;
+}
+
+/**
+ * The function adds the duration of the current phase to a histogram, and
+ * starts the next phase.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] histogram
+ */
+static void SDCard_metricsPhase (SDCard_Device* dev, SDCard_Histogram* histogram)
+{
+    uint32_t now = SDCard_metricsNow(dev);
+
+    SDCard_metricsAdd(histogram,now - dev->metricsStart);
+    dev->metricsStart = now;
+}
+
+/**
+ * The function returns the group of a command into the metrics.
+ *
+ * @param[in] cmd
+ * @return The group of the command
+ */
+static SDCard_MetricsCommand SDCard_metricsCommand (SDCard_Command cmd)
+{
+    switch (cmd)
     {
-        Spi_readByte(dev->device,&response);
-    } while ((response != 0xFF) && (response != 0x00) && (dev->currentTime() < timer));
+    case SDCARD_COMMAND_17:
+        return SDCARD_METRICSCOMMAND_READ_SINGLE;
+    case SDCARD_COMMAND_18:
+        return SDCARD_METRICSCOMMAND_READ_MULTIPLE;
+    case SDCARD_COMMAND_24:
+        return SDCARD_METRICSCOMMAND_WRITE_SINGLE;
+    case SDCARD_COMMAND_25:
+        return SDCARD_METRICSCOMMAND_WRITE_MULTIPLE;
+    case SDCARD_COMMAND_12:
+        return SDCARD_METRICSCOMMAND_STOP;
+    case SDCARD_COMMAND_32:
+    case SDCARD_COMMAND_33:
+    case SDCARD_COMMAND_38:
+        return SDCARD_METRICSCOMMAND_ERASE;
+    default:
+        return SDCARD_METRICSCOMMAND_OTHER;
+    }
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+#if (WARCOMEB_SDCARD_TRACE_EVENTS & (WARCOMEB_SDCARD_TRACE_EVENTS - 1)) != 0
+#error "WARCOMEB_SDCARD_TRACE_EVENTS must be a power of two"
+#endif
+
+/**
+ * The function records an event into the ring, overwriting the oldest one.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] type
+ * @param[in] code
+ * @param[in] value
+ */
+static void SDCard_trace (SDCard_Device* dev,
+                          SDCard_TraceType type,
+                          uint8_t code,
+                          uint16_t value)
+{
+    SDCard_TraceEvent* event = &dev->trace[dev->traceHead & (WARCOMEB_SDCARD_TRACE_EVENTS - 1)];
 
-    return ((response == 0xFF) || (response == 0x00)) ? SDCARD_ERRORS_OK : SDCARD_ERRORS_TIMEOUT;
+    event->time  = (dev->traceTime != 0) ? dev->traceTime() : dev->currentTime();
+    event->type  = (uint8_t) type;
+    event->code  = code;
+    event->value = value;
+    // The reader uses the event only after this
+    dev->traceHead++;
 }
+#endif
 
 /**
  * The function close the SPI communication with SDCard.
@@ -115,37 +376,73 @@ static void SDCard_deselect (SDCard_Device* dev)
 {
     uint8_t response;
     Gpio_set(dev->csPin);
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_DESELECT,0,0);
+#endif
     // Dummy cicle!
     Spi_readByte(dev->device,&response);
 }
 
 /**
  * The function enable the SPI communication and check if the SDCard is
- * available or not.
+ * available or not. The check is done only when a write was ended without
+ * wait the programming of the card (lazyBusy), reading one byte: the card
+ * keeps DO low while it is busy.
  *
  * @param[in] dev An handle of the device
- * @return TRUE if the device selection works, FALSE otherwise.
+ * @return TRUE if the card is ready, FALSE if it is still programming.
  */
 static bool SDCard_select (SDCard_Device* dev)
 {
     uint8_t response;
     Gpio_clear(dev->csPin);
 
-    // WARNING: There are a lot of problem with this code for Kingstone card!!
-#if 0
-    // Dummy cicle!
-    Spi_readByte(dev->device,&response);
-
-    // Wait for card ready
-    if (SDCard_waitReady(dev,500) == SDCARD_ERRORS_OK)
-    {
-        return TRUE;
-    }
-    else
+    // WARNING: There are a lot of problem with Kingstone cards when a dummy
+    // cicle is sent at each selection, so it is sent only when needed
+    if (dev->cardBusy == TRUE)
     {
-        SDCard_deselect(dev);
-        return FALSE;
+        Spi_readByte(dev->device,&response);
+        if (response != 0xFF)
+            return FALSE;
+        dev->cardBusy = FALSE;
+#ifdef WARCOMEB_SDCARD_METRICS
+        SDCard_metricsAdd(&dev->metrics.busyWait,SDCard_metricsNow(dev) - dev->metricsBusy);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_END,0,0);
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+        if (dev->discardBusy == TRUE)
+        {
+            // The end is seen by the first check after it, and it is not
+            // later than the timeout of the erase
+            uint32_t end = dev->currentTime();
+
+            if (end > dev->busyTimer)
+                end = dev->busyTimer;
+            dev->discardStats.eraseTime += end - dev->discardStart;
+            dev->discardBusy = FALSE;
+        }
+#endif
     }
+    return TRUE;
+}
+
+/**
+ * The function leaves the card programming at the end of a write: the wait
+ * is done by the next operation, or by SDCard_isBusy.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_setBusy (SDCard_Device* dev)
+{
+    dev->cardBusy  = TRUE;
+    dev->busyTimer = dev->currentTime() + dev->writeLatency.limit;
+#ifdef WARCOMEB_SDCARD_METRICS
+    dev->metricsBusy = SDCard_metricsNow(dev);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_START,0,0);
 #endif
 }
 
@@ -159,6 +456,13 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
                                          uint8_t* response)
 {
     uint8_t retry = 0, currentResponse = 0;
+#ifdef WARCOMEB_SDCARD_CRC
+    uint8_t frame[5];
+#endif
+#ifdef WARCOMEB_SDCARD_METRICS
+    uint32_t start = SDCard_metricsNow(dev);
+    SDCard_MetricsCommand group;
+#endif
 
     if (dev->isSDHC == FALSE)
     {
@@ -176,6 +480,9 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
     // Select sd card
     SDCard_select(dev);
 
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_COMMAND,cmd & 0x3F,(uint16_t) arguments);
+#endif
     // Send command
     Spi_writeByte(dev->device,cmd);
 
@@ -185,6 +492,14 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
     Spi_writeByte(dev->device,(uint8_t) (arguments>>8));
     Spi_writeByte(dev->device,(uint8_t) arguments);
 
+#ifdef WARCOMEB_SDCARD_CRC
+    frame[0] = cmd;
+    frame[1] = (uint8_t) (arguments>>24);
+    frame[2] = (uint8_t) (arguments>>16);
+    frame[3] = (uint8_t) (arguments>>8);
+    frame[4] = (uint8_t) arguments;
+    Spi_writeByte(dev->device,SDCard_crc7(frame,5));
+#else
     // Send CRC: for CMD8 must be 0X87, indeed for CMD0 must be 0x95.
     if (cmd == SDCARD_COMMAND_8)
         Spi_writeByte(dev->device,0x87);
@@ -192,6 +507,7 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
         Spi_writeByte(dev->device,0x95);
     else
         Spi_writeByte(dev->device,0x01);
+#endif
 
     // Discard following 1 byte - ONLY IN THIS CASE!
     if (cmd == SDCARD_COMMAND_12)
@@ -205,6 +521,17 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
         retry--;
     } while ((currentResponse == 0xFF) && (retry > 0));
 
+#ifdef WARCOMEB_SDCARD_METRICS
+    group = SDCard_metricsCommand(cmd);
+    SDCard_metricsAdd(&dev->metrics.command[group],SDCard_metricsNow(dev) - start);
+    // The idle bit is not an error
+    if ((retry == 0) || ((currentResponse & 0xFE) != 0))
+        dev->metrics.errors[group]++;
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_RESPONSE,currentResponse,SDCARD_WAIT_RETRY - retry);
+#endif
+
     if (retry == 0)
     {
         *response = 0xFF;
@@ -215,6 +542,10 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
     *response = currentResponse;
 
     if ((cmd != SDCARD_COMMAND_58) &&
+        (cmd != SDCARD_COMMAND_6)  &&
+        (cmd != SDCARD_COMMAND_9)  &&
+        (cmd != SDCARD_COMMAND_10) &&
+        (cmd != SDCARD_COMMAND_A13) &&
         (cmd != SDCARD_COMMAND_17) &&
         (cmd != SDCARD_COMMAND_18) &&
         (cmd != SDCARD_COMMAND_24) &&
@@ -223,536 +554,5075 @@ static SDCard_Errors SDCard_sendCommand (SDCard_Device* dev,
     return SDCARD_ERRORS_OK;
 }
 
-SDCard_Errors SDCard_init (SDCard_Device* dev)
+/**
+ * The function sends a buffer to the SDCard, using the board function
+ * when available.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] data The buffer to be sent
+ * @param[in] length The number of bytes to be sent
+ */
+static void SDCard_writeBuffer (SDCard_Device* dev,
+                                const uint8_t* data,
+                                uint16_t length)
 {
-    uint8_t i;
-    uint8_t response, retry = 0;
-    SDCard_Command command = 0;
-    uint8_t ocr[4];
-    uint32_t time;
-
-    dev->isInit = FALSE;
-
-    Gpio_config(dev->csPin,GPIO_PINS_OUTPUT);
-    Gpio_set(dev->csPin);
-    Gpio_config(dev->cpPin,GPIO_PINS_INPUT);
+    uint16_t i;
 
-    if (Gpio_get(dev->cpPin) != dev->cpType)
+    if (dev->writeBuffer != 0)
     {
-#ifdef WARCOMEB_SDCARD_DEBUG
-    	Cli_sendMessage("SDCARD","Card not present",CLI_MESSAGETYPE_ERROR);
-#endif
-		return SDCARD_ERRORS_CARD_NOT_PRESENT;
+        dev->writeBuffer(dev->device,data,length);
+    }
+    else
+    {
+        for (i = 0; i < length; ++i)
+            Spi_writeByte(dev->device,data[i]);
     }
+}
 
-    // Send 120 dummy clocks
-    for (i = 0; i < 15; ++i)
-        Spi_writeByte(dev->device,0xFF);
+/**
+ * The function receives a buffer from the SDCard, using the board function
+ * when available.
+ *
+ * @param[in] dev An handle of the device
+ * @param[out] data The buffer where store the received bytes
+ * @param[in] length The number of bytes to be received
+ */
+static void SDCard_readBuffer (SDCard_Device* dev,
+                               uint8_t* data,
+                               uint16_t length)
+{
+    uint16_t i;
 
-    // Reset the card
-    retry = 0;
-    do
+    if (dev->readBuffer != 0)
     {
-		SDCard_sendCommand(dev,SDCARD_COMMAND_0,0,&response);
-		retry++;
-		if (retry > SDCARD_MAX_RETRY)
-		{
-			break;
-		}
-    	dev->delayTime(10);
-    } while (response != SDCARD_RESPONSE_IDLE);
+        dev->readBuffer(dev->device,data,length);
+    }
+    else
+    {
+        for (i = 0; i < length; ++i)
+            Spi_readByte(dev->device,&data[i]);
+    }
+}
 
-    // Try to understand the sdcard version and init
-    SDCard_sendCommand(dev,SDCARD_COMMAND_8,0x000001AA,&response);
+/**
+ * The function computes the number of sectors of the card from the CSD.
+ *
+ * @param[in] csd The CSD register
+ * @return The number of sectors of the card
+ */
+static uint32_t SDCard_getCsdSectorCount (const uint8_t* csd)
+{
+    uint8_t i;
+    uint32_t tempSize = 0;
 
-    if (response != SDCARD_RESPONSE_IDLE)
+    // !! The first byte read is the last one!
+    if ((csd[0] >> 6) == 1) // SDCARD v.2
     {
-        dev->cardVersion  = 1;
-
-        SDCard_sendCommand(dev,SDCARD_COMMAND_A41,0x40000000,&response);
+        // See page 87 of "Physical Layer Simplified Specification Version 2.00"
+        tempSize = csd[9] + ((uint32_t)csd[8] << 8) + ((uint32_t)(csd[7] & 63) << 16) + 1;
+        return tempSize << 10;
+    }
+    else // SDCARD v.1 or MMC v.3
+    {
+        // See page 81 of "Physical Layer Simplified Specification Version 2.00"
+        i = (csd[5] & 0x0F) + ((csd[10] & 0x80) >> 7) + ((csd[9] & 0x03) << 1) + 2;
+        tempSize = (csd[8] >> 6) + ((uint32_t)csd[7] << 2) + ((uint32_t)(csd[6] & 3) << 10) + 1;
+        return tempSize << (i - 9);
+    }
+}
 
-        // Select the correct command
-        if (response <= 1)
-        {
-            // SDCARD v1
-            dev->cardType = 1;
-            command = SDCARD_COMMAND_A41;
-        }
-        else
-        {
-            // MMC v3
-            dev->cardType = 3;
-            command = SDCARD_COMMAND_1;
-        }
+// See page 83 of "Physical Layer Simplified Specification Version 2.00",
+// the time values of TAAC and TRAN_SPEED multiplied by 10
+static const uint8_t SDCard_timeValue[16] = {0,10,12,13,15,20,25,30,35,40,45,50,55,60,70,80};
 
-        // Polling for command
-        time = dev->currentTime() + 1000;
-        do
-        {
-            SDCard_sendCommand(dev,command,0,&response);
-        } while ((response != SDCARD_RESPONSE_OK) && (dev->currentTime() < time));
+/**
+ * The function fills the fields of info from its CSD register.
+ *
+ * @param[in,out] info The card registers
+ */
+static void SDCard_parseCsd (SDCard_Info* info)
+{
+    const uint8_t* csd = info->csd;
+    uint8_t unit;
 
-        if ((time < dev->currentTime()) || (response != SDCARD_RESPONSE_OK))
-        {
-            SDCard_deselect(dev);
-            return SDCARD_ERRORS_INIT_FAILED;
-        }
+    info->sectorCount = SDCard_getCsdSectorCount(csd);
 
-        SDCard_sendCommand(dev,SDCARD_COMMAND_16,0X00000200,&response);
-        if (response != SDCARD_RESPONSE_OK)
-        {
-            SDCard_deselect(dev);
-            return SDCARD_ERRORS_INIT_FAILED;
-        }
-    }
-    else
-    {
-        dev->cardVersion = 2;
+    // TAAC, unit from 1 ns to 10 ms
+    info->taac = SDCard_timeValue[(csd[1] >> 3) & 0x0F];
+    for (unit = csd[1] & 0x07; unit > 0; --unit)
+        info->taac *= 10;
+    info->taac /= 10;
+    info->nsac = csd[2];
 
-        // Polling card with CMD55 and ACMD41 until reply 0x00
-        time = dev->currentTime() + 1000;
-        do
-        {
-            SDCard_sendCommand(dev,SDCARD_COMMAND_55,0,&response);
-            SDCard_sendCommand(dev,SDCARD_COMMAND_A41,0x40000000,&response);
-            dev->delayTime(100);
-        } while ((response != SDCARD_RESPONSE_OK) && (dev->currentTime() < time));
+    // TRAN_SPEED, unit from 100 kbit/s to 100 Mbit/s (the others are reserved)
+    info->tranSpeed = SDCard_timeValue[(csd[3] >> 3) & 0x0F] * 10000UL;
+    for (unit = csd[3] & 0x07; (unit > 0) && (unit < 4); --unit)
+        info->tranSpeed *= 10;
 
-        if ((time < dev->currentTime()) || (response != SDCARD_RESPONSE_OK))
-        {
-            SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD55/ACMD41 wrong reply or timeout",CLI_MESSAGETYPE_ERROR);
-            Cli_sendMessage("SDCARD","initialization fail",CLI_MESSAGETYPE_ERROR);
-#endif
-            return SDCARD_ERRORS_INIT_FAILED;
-        }
+    info->commandClasses = ((uint16_t)csd[4] << 4) | (csd[5] >> 4);
+    info->r2wFactor = (csd[12] >> 2) & 0x07;
+}
 
-        // Check CCS bit into OCR of CMD58
-        SDCard_sendCommand(dev,SDCARD_COMMAND_58,0,&response);
-        if (response == SDCARD_RESPONSE_OK)
-        {
-            for (i = 0; i < 4; ++i) Spi_readByte(dev->device,&ocr[i]);
-            if (ocr[0] & 0x40)
-            {
-                dev->isSDHC = TRUE;
-            }
-            else
-            {
-                // Close CMD58
-                SDCard_deselect(dev);
-                SDCard_sendCommand(dev,SDCARD_COMMAND_16,0X00000200,&response);
-                if (response != SDCARD_RESPONSE_OK)
-                {
-
-                    return SDCARD_ERRORS_INIT_FAILED;
-                }
-            }
-        }
-        else
-        {
-            // Close CMD58
-            SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD58 wrong reply",CLI_MESSAGETYPE_ERROR);
-            Cli_sendMessage("SDCARD","initialization fail",CLI_MESSAGETYPE_ERROR);
-#endif
-            return SDCARD_ERRORS_INIT_FAILED;
-        }
-    }
+/**
+ * The function fills the fields of info from the SD Status.
+ *
+ * @param[in,out] info The card registers
+ * @param[in] status The SD Status (ACMD13)
+ */
+static void SDCard_parseStatus (SDCard_Info* info, const uint8_t* status)
+{
+    // See page 69 of "Physical Layer Simplified Specification Version 3.01"
+    static const uint8_t speedClass[5] = {0,2,4,6,10};
+    static const uint8_t auSize[6] = {8,12,16,24,32,64}; // From 0xA [MB]
+    uint8_t au = status[10] >> 4;
 
-    dev->isInit = TRUE;
-    // Must be just closed
-    SDCard_deselect(dev);
+    info->speedClass = (status[8] < 5) ? speedClass[status[8]] : 0;
 
-#ifdef WARCOMEB_SDCARD_DEBUG
-    Cli_sendMessage("SDCARD","card initialized!",CLI_MESSAGETYPE_INFO);
-#endif
+    // 16 KB (32 sectors) doubled until 4 MB, then the table
+    if (au == 0)
+        info->auSize = 0;
+    else if (au < 0x0A)
+        info->auSize = 32UL << (au - 1);
+    else
+        info->auSize = (uint32_t)auSize[au - 0x0A] << 11;
 
-    return SDCARD_ERRORS_OK;
+    info->eraseSize    = ((uint16_t)status[11] << 8) | status[12];
+    info->eraseTimeout = status[13] >> 2;
+    info->eraseOffset  = status[13] & 0x03;
 }
 
-SDCard_Errors SDCard_writeBlock (SDCard_Device* dev,
-                                 uint32_t blockAddress,
-                                 const uint8_t* data)
+/**
+ * The function clears the samples of a latency estimate and sets its
+ * timeout to the limit.
+ *
+ * @param[out] latency The estimate
+ * @param[in] limit The timeout of the card [ms]
+ */
+static void SDCard_resetLatency (SDCard_Latency* latency, uint32_t limit)
 {
-    uint8_t response;
-    uint8_t retry = 0;
-    uint16_t i;
-
-    // Send starting block with writing block command
-    do
-	{
-        SDCard_sendCommand(dev,SDCARD_COMMAND_24,blockAddress,&response);
-		retry++;
-		if (retry > SDCARD_MAX_RETRY)
-		{
-		    // Close CMD24
-	        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD24 write block fail",CLI_MESSAGETYPE_ERROR);
-#endif
-			return SDCARD_ERRORS_WRITE_BLOCK_FAILED;
-		}
-		dev->delayTime(10);
-	} while (response != SDCARD_RESPONSE_OK);
+    latency->mean      = 0;
+    latency->deviation = 0;
+    latency->samples   = 0;
+    latency->timeout   = limit;
+    latency->limit     = limit;
+}
 
-    // Send TOKEN
-    Spi_writeByte(dev->device,0xFE);
+/**
+ * The function computes the read and write timeouts of the card from its
+ * registers, see page 102 of "Physical Layer Simplified Specification
+ * Version 3.01".
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_initLatency (SDCard_Device* dev)
+{
+    uint32_t read, write;
+    uint32_t clock = (dev->clock != 0) ? dev->clock : SDCARD_CLOCK_INIT;
 
-    // Send DATA
-    for (i = 0; i < 512; ++i)
+    if (dev->isSDHC == TRUE)
     {
-        Spi_writeByte(dev->device,data[i]);
+        // Fixed values, the SDXC cards can be busy up to 500 ms
+        read  = 100;
+        write = (dev->info.sectorCount > 0x04000000UL) ? 500 : 250;
     }
-
-    // Send dummy CRC
-    Spi_writeByte(dev->device,0xFF);
-    Spi_writeByte(dev->device,0xFF);
-
-    // Read card reply
-    // Every data block written to the card will be acknoledged by a
-    // data response token. It is one byte long and has the following format:
-    // X X X 0 STATUS 1, where status bits is defined as
-    // 010 - Data accepted
-    // 101 - Data rejected due to a CRC error
-    // 110 - Data rejected due to a write error
-    Spi_readByte(dev->device,&response);
-    if ((response & 0x0F) != SDCARD_RESPONSE_FAULT)
+    else
     {
-        // Close CMD24
-        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-        Cli_sendMessage("SDCARD","write block response fault",CLI_MESSAGETYPE_ERROR);
-#endif
-		return SDCARD_ERRORS_WRITE_BLOCK_FAILED;
+        // 100 times the typical access time, TAAC plus NSAC*100 clock cycles
+        read = dev->info.taac / 10000 +
+               ((uint32_t)dev->info.nsac * 10000000UL) / clock + 1;
+        if (read > 100)
+            read = 100;
+        write = read << dev->info.r2wFactor;
+        if (write > 250)
+            write = 250;
     }
 
-    SDCard_waitReady(dev,SDCARD_TIMEOUT_WRITE);
-
-    // Close CMD24
-    SDCard_deselect(dev);
-    return SDCARD_ERRORS_OK;
+    SDCard_resetLatency(&dev->readLatency,read);
+    SDCard_resetLatency(&dev->writeLatency,write);
 }
 
-SDCard_Errors SDCard_writeBlocks (SDCard_Device* dev,
-                                  uint32_t blockAddress,
-                                  const uint8_t* data,
-                                  uint8_t count)
-{
-    uint8_t response, retry = 0;
-    uint16_t i;
+/**
+ * The function adds a measured time to a latency estimate and updates its
+ * timeout, in the same way of the retransmission timeout of TCP.
+ *
+ * @param[in,out] latency The estimate
+ * @param[in] sample The time measured [ms]
+ */
+static void SDCard_updateLatency (SDCard_Latency* latency, uint32_t sample)
+{
+    int32_t diff;
+    uint32_t timeout;
+
+    // Fixed point, 4 bits of fraction
+    sample <<= 4;
+    if (latency->samples == 0)
+    {
+        latency->mean      = sample;
+        latency->deviation = sample / 2;
+    }
+    else
+    {
+        // Gains of 1/8 for the mean and 1/4 for the deviation
+        diff = (int32_t) (sample - latency->mean);
+        latency->mean = (uint32_t) ((int32_t) latency->mean + diff / 8);
+        if (diff < 0)
+            diff = -diff;
+        latency->deviation = (uint32_t) ((int32_t) latency->deviation +
+                                         (diff - (int32_t) latency->deviation) / 4);
+    }
+
+    if (latency->samples < SDCARD_LATENCY_SAMPLES)
+    {
+        latency->samples++;
+        if (latency->samples < SDCARD_LATENCY_SAMPLES)
+            return;
+    }
+
+    // Round up, one more millisecond for the resolution of the timer
+    timeout = ((latency->mean + SDCARD_LATENCY_DEVIATIONS * latency->deviation + 15) >> 4) + 1;
+    if (timeout < SDCARD_TIMEOUT_MIN)
+        timeout = SDCARD_TIMEOUT_MIN;
+    if (timeout > latency->limit)
+        timeout = latency->limit;
+    latency->timeout = timeout;
+}
+
+/**
+ * The function computes the timeout of an erase from the erase fields of
+ * the SD Status: ERASE_TIMEOUT/ERASE_SIZE seconds for each AU touched, plus
+ * ERASE_OFFSET seconds.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] count The number of blocks
+ * @return The timeout [ms]
+ */
+static uint32_t SDCard_getEraseTimeout (SDCard_Device* dev,
+                                        uint32_t blockAddress,
+                                        uint32_t count)
+{
+    uint32_t au, timeout;
+
+    if ((dev->info.eraseSize == 0) ||
+        (dev->info.eraseTimeout == 0) ||
+        (dev->info.auSize == 0))
+    {
+        return SDCARD_TIMEOUT_ERASE;
+    }
+
+    au = (blockAddress + count - 1) / dev->info.auSize -
+         blockAddress / dev->info.auSize + 1;
+    timeout = ((uint32_t)dev->info.eraseTimeout * 1000UL * au) / dev->info.eraseSize +
+              (uint32_t)dev->info.eraseOffset * 1000UL;
+
+    // A piece of AU is programmed like a write
+    if (timeout < dev->writeLatency.limit)
+        timeout = dev->writeLatency.limit;
+    return timeout;
+}
+
+/**
+ * The function waits the start token of a register, one byte for each call,
+ * and then reads the register.
+ *
+ * @param[in] dev An handle of the device
+ * @param[out] data The register
+ * @param[in] length The length of the register
+ * @return SDCARD_ERRORS_BUSY while the token is waited, SDCARD_ERRORS_OK
+ *         when the register is read, SDCARD_ERRORS_READ_BLOCK_FAILED at
+ *         timeout or with a wrong CRC.
+ */
+static SDCard_Errors SDCard_readRegister (SDCard_Device* dev,
+                                          uint8_t* data,
+                                          uint8_t length)
+{
+    uint8_t response;
+    uint8_t crc[2];
+
+    Spi_readByte(dev->device,&response);
+    if (response == 0xFE)
+    {
+        SDCard_readBuffer(dev,data,length);
+        SDCard_readBuffer(dev,crc,2);
+#ifdef WARCOMEB_SDCARD_CRC
+        if ((((uint16_t)crc[0] << 8) | crc[1]) != SDCard_crc16(0,data,length))
+        {
+            dev->crcErrors++;
+            return SDCARD_ERRORS_READ_BLOCK_FAILED;
+        }
+#endif
+        return SDCARD_ERRORS_OK;
+    }
+    else if (dev->currentTime() > dev->asyncTimer)
+    {
+        return SDCARD_ERRORS_READ_BLOCK_FAILED;
+    }
+    return SDCARD_ERRORS_BUSY;
+}
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+/**
+ * The function invalidates the cached blocks of a range.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the range
+ * @param[in] count The number of blocks of the range
+ */
+static void SDCard_cacheInvalidate (SDCard_Device* dev,
+                                    uint32_t blockAddress,
+                                    uint32_t count)
+{
+    uint16_t i;
+
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if ((dev->cache[i].blockAddress - blockAddress) < count)
+            dev->cache[i].isValid = FALSE;
+    }
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+/**
+ * The function drops the read-ahead buffer when it overlaps a range.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the range
+ * @param[in] count The number of blocks of the range
+ */
+static void SDCard_readAheadInvalidate (SDCard_Device* dev,
+                                        uint32_t blockAddress,
+                                        uint32_t count)
+{
+    if ((dev->readAheadCount > 0) &&
+        (blockAddress < (dev->readAheadAddress + dev->readAheadCount)) &&
+        (dev->readAheadAddress < (blockAddress + count)))
+    {
+        dev->readAheadCount = 0;
+    }
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+/**
+ * The function removes a range from the discard queue, because it is
+ * written or erased. When a queued range must be split and the queue is
+ * full, its smaller part is forgotten.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the range
+ * @param[in] count The number of blocks of the range
+ */
+static void SDCard_discardRemove (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  uint32_t count)
+{
+    SDCard_DiscardRange* range;
+    uint32_t end = blockAddress + count;
+    uint32_t head, tail;
+    uint8_t i = 0;
+
+    while (i < dev->discardCount)
+    {
+        range = &dev->discard[i];
+        if ((blockAddress >= (range->blockAddress + range->count)) ||
+            (range->blockAddress >= end))
+        {
+            ++i;
+            continue;
+        }
+
+        head = (blockAddress > range->blockAddress) ?
+                (blockAddress - range->blockAddress) : 0;
+        tail = ((range->blockAddress + range->count) > end) ?
+                (range->blockAddress + range->count - end) : 0;
+
+        if ((head == 0) && (tail == 0))
+        {
+            // The last range takes this place, it is checked next
+            *range = dev->discard[--dev->discardCount];
+            continue;
+        }
+
+        if (head == 0)
+        {
+            range->blockAddress = end;
+            range->count        = tail;
+        }
+        else
+        {
+            range->count = head;
+            if ((tail != 0) && (dev->discardCount < WARCOMEB_SDCARD_DISCARD_RANGES))
+            {
+                dev->discard[dev->discardCount].blockAddress = end;
+                dev->discard[dev->discardCount].count        = tail;
+                dev->discardCount++;
+            }
+            else if (tail > head)
+            {
+                dev->discardStats.dropped += head;
+                range->blockAddress = end;
+                range->count        = tail;
+            }
+            else
+            {
+                dev->discardStats.dropped += tail;
+            }
+        }
+        ++i;
+    }
+}
+#endif
+
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+/**
+ * The function copies the part of a buffered block that falls into a byte
+ * range just read.
+ *
+ * @param[in] block The block, relative to the first block of the range
+ * @param[in] source The data of the block
+ * @param[in] offset The offset of the range into its first block
+ * @param[in] length The length of the range
+ * @param[out] data The range
+ */
+static void SDCard_rangeMerge (uint32_t block,
+                               const uint8_t* source,
+                               uint16_t offset,
+                               uint32_t length,
+                               uint8_t* data)
+{
+    uint32_t start = block * 512;
+    uint32_t end = start + 512;
+
+    if (block >= (offset + length + 511) / 512)
+        return;
+
+    if (start < offset)
+        start = offset;
+    if (end > offset + length)
+        end = offset + length;
+    memcpy(&data[start - offset],&source[start - block * 512],end - start);
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+/**
+ * The function copies the blocks of the staging buffer into a buffer of
+ * consecutive blocks just read.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the buffer
+ * @param[out] data The buffer
+ * @param[in] count The number of blocks of the buffer
+ */
+static void SDCard_coalesceMerge (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  uint8_t* data,
+                                  uint32_t count)
+{
+    uint16_t i;
+    uint32_t offset;
+
+    for (i = 0; i < dev->coalesceCount; ++i)
+    {
+        offset = (dev->coalesceAddress + i) - blockAddress;
+        if (offset < count)
+            memcpy(&data[offset * 512],dev->coalesce[i],512);
+    }
+}
+
+/**
+ * The function copies the blocks of the staging buffer into the buffers of
+ * the asynchronous read just ended: they are newer than the card.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_coalesceReadEnd (SDCard_Device* dev)
+{
+    const SDCard_Segment* segments = dev->coalesceRead;
+    uint32_t blockAddress = dev->coalesceReadAddress;
+    uint32_t i;
+
+    if (dev->coalesceReadLength > 0)
+    {
+        // A byte range, into the buffer of its only segment
+        for (i = 0; i < dev->coalesceCount; ++i)
+            SDCard_rangeMerge((dev->coalesceAddress + i) - blockAddress,
+                              dev->coalesce[i],
+                              (uint16_t) dev->coalesceReadOffset,
+                              dev->coalesceReadLength,
+                              segments->data);
+        return;
+    }
+
+    for (i = 0; i < dev->coalesceReadCount; ++i)
+    {
+        SDCard_coalesceMerge(dev,blockAddress,segments[i].data,segments[i].count);
+        blockAddress += segments[i].count;
+    }
+}
+
+/**
+ * The function drops the blocks of the staging buffer that an asynchronous
+ * write overwrites, because they are older. When the write falls inside the
+ * run of the buffer, the buffered blocks take the new data instead.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the write
+ * @param[in] segments The data of the write
+ * @param[in] count The number of blocks of the write
+ */
+static void SDCard_coalesceDrop (SDCard_Device* dev,
+                                 uint32_t blockAddress,
+                                 const SDCard_Segment* segments,
+                                 uint32_t count)
+{
+    uint32_t end = dev->coalesceAddress + dev->coalesceCount;
+    uint32_t offset, i;
+
+    if ((dev->coalesceCount == 0) ||
+        (blockAddress >= end) ||
+        (dev->coalesceAddress >= (blockAddress + count)))
+        return;
+
+    if ((blockAddress + count) >= end)
+    {
+        // The tail of the run
+        dev->coalesceCount = (blockAddress > dev->coalesceAddress) ?
+                (uint16_t)(blockAddress - dev->coalesceAddress) : 0;
+    }
+    else if (blockAddress <= dev->coalesceAddress)
+    {
+        // The head of the run
+        offset = blockAddress + count - dev->coalesceAddress;
+        memmove(dev->coalesce[0],dev->coalesce[offset],(dev->coalesceCount - offset) * 512);
+        dev->coalesceAddress += offset;
+        dev->coalesceCount   -= (uint16_t) offset;
+    }
+    else
+    {
+        for (offset = blockAddress - dev->coalesceAddress; count > 0; ++segments)
+        {
+            for (i = 0; (i < segments->count) && (count > 0); ++i, ++offset, --count)
+                memcpy(dev->coalesce[offset],&segments->data[i * 512],512);
+        }
+    }
+}
+#endif
+
+/**
+ * The function applies the retry policy after a failed attempt of a
+ * command and schedules the next attempt.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] command The command that failed
+ * @return TRUE if a new attempt is scheduled, FALSE if the command failed.
+ */
+static bool SDCard_retry (SDCard_Device* dev, SDCard_RetryCommand command)
+{
+    const SDCard_RetryPolicy* policy = (dev->retryPolicy != 0) ?
+            &dev->retryPolicy[command] : &SDCard_defaultRetryPolicy[command];
+    SDCard_RetryStats* stats = &dev->retryStats[command];
+    uint32_t delay;
+
+    if (dev->asyncRetry >= policy->maxRetry)
+    {
+        stats->commands++;
+        stats->failures++;
+        return FALSE;
+    }
+
+    // Exponential backoff up to the max delay
+    if (dev->asyncRetry == 0)
+        delay = policy->firstDelay;
+    else
+        delay = (uint32_t)dev->asyncDelay * policy->factor;
+    if (delay > policy->maxDelay)
+        delay = policy->maxDelay;
+
+    dev->asyncRetry++;
+    dev->asyncDelay = (uint16_t) delay;
+    dev->asyncWait  = dev->currentTime() + delay;
+
+    stats->retries++;
+    stats->delay += delay;
+#ifdef WARCOMEB_SDCARD_METRICS
+    dev->metrics.retries++;
+#endif
+    if (dev->asyncRetry > stats->maxRetry)
+        stats->maxRetry = dev->asyncRetry;
+
+    return TRUE;
+}
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+/**
+ * The function takes the bus for the user when it is free, or when it was
+ * passed to the user by the last owner.
+ *
+ * @param[in] bus The shared bus
+ * @param[in] user The identifier of the user
+ * @param[in] wait When it is TRUE the user is queued if the bus is held
+ * @return TRUE if the user holds the bus, FALSE otherwise.
+ */
+static bool SDCard_busTake (SDCard_Bus* bus, uint8_t user, bool wait)
+{
+    bool result = TRUE;
+
+    if (bus->lock != 0)
+        bus->lock(bus);
+
+    if (bus->owner == 0)
+    {
+        bus->owner = user;
+    }
+    else if (bus->owner != user)
+    {
+        if (wait == TRUE)
+            bus->waiting |= (1 << (user - 1));
+        result = FALSE;
+    }
+
+    if (bus->unlock != 0)
+        bus->unlock(bus);
+    return result;
+}
+
+/**
+ * The function takes the bus for the card and, when another user has
+ * changed them, sets again the mode and the clock of the card.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] wait When it is TRUE the card is queued if the bus is held
+ * @return TRUE if the card holds the bus, FALSE otherwise.
+ */
+static bool SDCard_busOwn (SDCard_Device* dev, bool wait)
+{
+    SDCard_Bus* bus = dev->bus;
+
+    if (bus == 0)
+        return TRUE;
+    if (SDCard_busTake(bus,dev->busUser,wait) == FALSE)
+        return FALSE;
+
+    if (bus->configured != dev->busUser)
+    {
+        if (bus->setMode != 0)
+            bus->setMode(dev->device);
+        if ((dev->setClock != 0) && (dev->clock != 0))
+            dev->clock = dev->setClock(dev->device,dev->clock);
+        bus->configured = dev->busUser;
+    }
+    return TRUE;
+}
+#endif
+
+/**
+ * The function stops the CMD18 left open.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_stopRead (SDCard_Device* dev)
+{
+    uint8_t response;
+
+    if (dev->asyncOpen == SDCARD_TRANSFER_READ)
+    {
+        dev->asyncOpen = SDCARD_TRANSFER_NONE;
+        SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+    }
+}
+
+/**
+ * The function does the first accesses to the bus of the operation: the
+ * card goes on with the CMD18/CMD25 left open, or the CMD18 is stopped,
+ * or the initialization sends the dummy clocks.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_asyncSelect (SDCard_Device* dev)
+{
+    uint8_t i;
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_INIT_WARM:
+    case SDCARD_ASYNCSTATE_INIT_RESET:
+        // The identification must run at 400 kHz at most
+        if (dev->setClock != 0)
+            dev->clock = dev->setClock(dev->device,SDCARD_CLOCK_INIT);
+
+        // Send 120 dummy clocks
+        for (i = 0; i < 15; ++i)
+            Spi_writeByte(dev->device,0xFF);
+
+        // Start of the first phase
+        dev->asyncTime = dev->currentTime();
+        break;
+
+    case SDCARD_ASYNCSTATE_READ_TOKEN:
+        // The card goes on with the data blocks
+        SDCard_select(dev);
+        dev->asyncTime  = dev->currentTime();
+        dev->asyncTimer = dev->asyncTime + dev->readLatency.timeout;
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_BLOCK:
+    case SDCARD_ASYNCSTATE_WRITE_END:
+        // The card waits for the next data token, or the stop token
+        SDCard_select(dev);
+        break;
+
+    default:
+        SDCard_stopRead(dev);
+        break;
+    }
+    dev->asyncOpen = SDCARD_TRANSFER_NONE;
+}
+
+/**
+ * The function starts a new operation. A CMD18 left open is stopped before,
+ * while a CMD25 left open accepts only its next block or its end.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] state The first state of the operation
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if a CMD25 is still open.
+ */
+static SDCard_Errors SDCard_asyncStart (SDCard_Device* dev,
+                                        SDCard_AsyncState state,
+                                        SDCard_Callback callback,
+                                        void* context)
+{
+    if ((dev->asyncOpen == SDCARD_TRANSFER_WRITE) &&
+        (state != SDCARD_ASYNCSTATE_WRITE_BLOCK) &&
+        (state != SDCARD_ASYNCSTATE_WRITE_END))
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncKeepOpen = FALSE;
+    dev->asyncLength   = 0;
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    dev->coalesceRead  = 0;
+#endif
+    dev->asyncCallback = callback;
+    dev->asyncContext  = context;
+    dev->asyncRetry    = 0;
+    dev->asyncWait     = dev->currentTime();
+    dev->asyncState    = state;
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_START,state,0);
+#endif
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    // The operation starts into SDCard_poll when the bus passes to the card
+    if (SDCard_busOwn(dev,TRUE) == FALSE)
+    {
+        dev->busPending = TRUE;
+        return SDCARD_ERRORS_OK;
+    }
+#endif
+    SDCard_asyncSelect(dev);
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function closes the operation and calls the user callback.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] error The result of the operation
+ * @return The result of the operation
+ */
+static SDCard_Errors SDCard_asyncEnd (SDCard_Device* dev, SDCard_Errors error)
+{
+    uint8_t response;
+
+    if (((dev->asyncState == SDCARD_ASYNCSTATE_READ_TOKEN) ||
+         (dev->asyncState == SDCARD_ASYNCSTATE_READ_DATA)) &&
+        (dev->asyncMultiple == TRUE))
+    {
+        // Close CMD18
+        SDCard_deselect(dev);
+        if ((error == SDCARD_ERRORS_OK) && (dev->asyncKeepOpen == TRUE))
+        {
+            // The card goes on when it is selected again
+            dev->asyncOpen = SDCARD_TRANSFER_READ;
+        }
+        else
+        {
+            // Send STOP command
+            SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+        }
+    }
+    else if ((dev->asyncState >= SDCARD_ASYNCSTATE_WRITE_BLOCK) &&
+             (dev->asyncState <= SDCARD_ASYNCSTATE_WRITE_BUSY) &&
+             (dev->asyncMultiple == TRUE) &&
+             (error != SDCARD_ERRORS_OK))
+    {
+        // Send TOKEN for STOP TRANS and skip the stuff byte, the card drops
+        // the CMD25 and programs the blocks already accepted: the next
+        // command waits for its end
+        Spi_writeByte(dev->device,0xFD);
+        Spi_readByte(dev->device,&response);
+        SDCard_setBusy(dev);
+        SDCard_deselect(dev);
+    }
+    else
+    {
+        SDCard_deselect(dev);
+    }
+
+#ifdef WARCOMEB_SDCARD_DEBUG
+    if (error != SDCARD_ERRORS_OK)
+        Cli_sendMessage("SDCARD","operation fail",CLI_MESSAGETYPE_ERROR);
+#endif
+
+    dev->asyncState = SDCARD_ASYNCSTATE_IDLE;
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    dev->discardLast = dev->currentTime();
+#endif
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    if ((error == SDCARD_ERRORS_OK) && (dev->coalesceRead != 0))
+        SDCard_coalesceReadEnd(dev);
+    dev->coalesceRead = 0;
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_END,error,0);
+#endif
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    // The callback can start another operation, that waits its turn
+    if (dev->bus != 0)
+        SDCard_busRelease(dev->bus,dev->busUser);
+#endif
+    if (dev->asyncCallback != 0)
+        dev->asyncCallback(dev,error,dev->asyncContext);
+
+    return error;
+}
+
+/**
+ * The function prepares the device and the bus, and starts the
+ * initialization sequence from the state requested.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] state The first state of the sequence
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, an error otherwise.
+ */
+static SDCard_Errors SDCard_initStart (SDCard_Device* dev,
+                                       SDCard_AsyncState state,
+                                       SDCard_Callback callback,
+                                       void* context)
+{
+    dev->isInit = FALSE;
+    dev->isSDHC = FALSE;
+    // A card just inserted is not programming
+    if (state == SDCARD_ASYNCSTATE_INIT_RESET)
+    {
+        dev->cardBusy = FALSE;
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+        dev->discardBusy = FALSE;
+#endif
+    }
+    memset(&dev->initStats,0,sizeof(SDCard_InitStats));
+    dev->initStats.warm = (state == SDCARD_ASYNCSTATE_INIT_WARM);
+    SDCard_resetLatency(&dev->readLatency,SDCARD_TIMEOUT_READ);
+    SDCard_resetLatency(&dev->writeLatency,SDCARD_TIMEOUT_WRITE);
+    // The card is reset, the CMD18/CMD25 doesn't exist anymore
+    dev->asyncOpen  = SDCARD_TRANSFER_NONE;
+    dev->streamMode = SDCARD_TRANSFER_NONE;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    // The card can be changed
+    SDCard_cacheInvalidate(dev,0,0xFFFFFFFF);
+#endif
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    dev->readAheadCount = 0;
+#endif
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    dev->coalesceCount = 0;
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    dev->discardCount = 0;
+#endif
+
+    Gpio_config(dev->csPin,GPIO_PINS_OUTPUT);
+    Gpio_set(dev->csPin);
+    Gpio_config(dev->cpPin,GPIO_PINS_INPUT);
+
+    if (Gpio_get(dev->cpPin) != dev->cpType)
+    {
+#ifdef WARCOMEB_SDCARD_DEBUG
+        Cli_sendMessage("SDCARD","Card not present",CLI_MESSAGETYPE_ERROR);
+#endif
+        return SDCARD_ERRORS_CARD_NOT_PRESENT;
+    }
+
+    // The clock and the dummy clocks are sent by SDCard_asyncSelect
+    return SDCard_asyncStart(dev,state,callback,context);
+}
+
+SDCard_Errors SDCard_initAsync (SDCard_Device* dev,
+                                SDCard_Callback callback,
+                                void* context)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    memset(&dev->info,0,sizeof(SDCard_Info));
+    return SDCard_initStart(dev,SDCARD_ASYNCSTATE_INIT_RESET,callback,context);
+}
+
+SDCard_Errors SDCard_reinitAsync (SDCard_Device* dev,
+                                  SDCard_Callback callback,
+                                  void* context)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    return SDCard_initStart(dev,SDCARD_ASYNCSTATE_INIT_WARM,callback,context);
+}
+
+/**
+ * The function starts the reading of blocks, the buffer must be just set.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] count The number of blocks
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK
+ */
+static SDCard_Errors SDCard_startRead (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       uint32_t count,
+                                       SDCard_Callback callback,
+                                       void* context)
+{
+    dev->asyncMultiple = (count > 1) ? TRUE : FALSE;
+    dev->asyncAddress  = blockAddress;
+    dev->asyncCount    = count;
+    return SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_READ_COMMAND,callback,context);
+}
+
+/**
+ * The function starts the writing of blocks, the buffer must be just set.
+ * The caller checks before that no CMD25 is left open.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] count The number of blocks
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK
+ */
+static SDCard_Errors SDCard_startWrite (SDCard_Device* dev,
+                                        uint32_t blockAddress,
+                                        uint32_t count,
+                                        SDCard_Callback callback,
+                                        void* context)
+{
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    SDCard_readAheadInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    SDCard_discardRemove(dev,blockAddress,count);
+#endif
+
+    dev->asyncMultiple = (count > 1) ? TRUE : FALSE;
+    dev->asyncAddress  = blockAddress;
+    dev->asyncCount    = count;
+    dev->asyncPreErase = count;
+    return SDCard_asyncStart(dev,
+                             (((dev->asyncMultiple == TRUE) && dev->isSDHC) ?
+                                     SDCARD_ASYNCSTATE_WRITE_PRE_ERASE :
+                                     SDCARD_ASYNCSTATE_WRITE_COMMAND),
+                             callback,
+                             context);
+}
+
+/**
+ * The function moves the data pointer to the next block of the operation.
+ * It must be called only when there are other blocks to move.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_nextBlock (SDCard_Device* dev)
+{
+    if ((dev->asyncSegment != 0) && (--dev->asyncSegmentCount == 0))
+    {
+        dev->asyncSegment++;
+        dev->asyncData = dev->asyncSegment->data;
+        dev->asyncSegmentCount = dev->asyncSegment->count;
+    }
+    else
+    {
+        dev->asyncData += 512;
+    }
+}
+
+SDCard_Errors SDCard_readBlocksAsync (SDCard_Device* dev,
+                                      uint32_t blockAddress,
+                                      uint8_t* data,
+                                      uint8_t count,
+                                      SDCard_Callback callback,
+                                      void* context)
+{
+    SDCard_Errors error;
+
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncSegment = 0;
+    dev->asyncData    = data;
+    error = SDCard_startRead(dev,blockAddress,count,callback,context);
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The blocks still buffered are copied at the end
+    if (error == SDCARD_ERRORS_OK)
+    {
+        dev->coalesceReadBlocks.data  = data;
+        dev->coalesceReadBlocks.count = count;
+        dev->coalesceRead        = &dev->coalesceReadBlocks;
+        dev->coalesceReadCount   = 1;
+        dev->coalesceReadAddress = blockAddress;
+        dev->coalesceReadLength  = 0;
+    }
+#endif
+    return error;
+}
+
+SDCard_Errors SDCard_writeBlocksAsync (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       const uint8_t* data,
+                                       uint8_t count,
+                                       SDCard_Callback callback,
+                                       void* context)
+{
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    SDCard_Segment segment;
+#endif
+
+    // A CMD25 left open refuses the new write: nothing is changed before
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_cacheInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    segment.data  = (uint8_t*) data;
+    segment.count = count;
+    SDCard_coalesceDrop(dev,blockAddress,&segment,count);
+#endif
+
+    dev->asyncSegment = 0;
+    dev->asyncData    = (uint8_t*) data;
+    return SDCard_startWrite(dev,blockAddress,count,callback,context);
+}
+
+/**
+ * The function starts the writing of consecutive blocks stored into a
+ * list of segments.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list of segments, valid until the end of operation
+ * @param[in] count The total number of blocks of the segments
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+static SDCard_Errors SDCard_writeSegmentsAsync (SDCard_Device* dev,
+                                                uint32_t blockAddress,
+                                                const SDCard_Segment* segments,
+                                                uint32_t count,
+                                                SDCard_Callback callback,
+                                                void* context)
+{
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncSegment      = segments;
+    dev->asyncSegmentCount = segments->count;
+    dev->asyncData         = segments->data;
+    return SDCard_startWrite(dev,blockAddress,count,callback,context);
+}
+
+/**
+ * The function starts the reading of consecutive blocks into a list of
+ * segments.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list of segments, valid until the end of operation
+ * @param[in] count The total number of blocks of the segments
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+static SDCard_Errors SDCard_readSegmentsAsync (SDCard_Device* dev,
+                                               uint32_t blockAddress,
+                                               const SDCard_Segment* segments,
+                                               uint32_t count,
+                                               SDCard_Callback callback,
+                                               void* context)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncSegment      = segments;
+    dev->asyncSegmentCount = segments->count;
+    dev->asyncData         = segments->data;
+    return SDCard_startRead(dev,blockAddress,count,callback,context);
+}
+
+/**
+ * The function counts the blocks of a list of segments.
+ *
+ * @param[in] segments The list of segments
+ * @param[in] segmentCount The number of segments
+ * @return The total number of blocks, 0 when a segment is empty.
+ */
+static uint32_t SDCard_countSegments (const SDCard_Segment* segments,
+                                      uint32_t segmentCount)
+{
+    uint32_t i, count = 0;
+
+    for (i = 0; i < segmentCount; ++i)
+    {
+        if (segments[i].count == 0)
+            return 0;
+        count += segments[i].count;
+    }
+    return count;
+}
+
+SDCard_Errors SDCard_readvAsync (SDCard_Device* dev,
+                                 uint32_t blockAddress,
+                                 const SDCard_Segment* segments,
+                                 uint32_t segmentCount,
+                                 SDCard_Callback callback,
+                                 void* context)
+{
+    uint32_t count = SDCard_countSegments(segments,segmentCount);
+    SDCard_Errors error;
+
+    if (count == 0)
+        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+    error = SDCard_readSegmentsAsync(dev,blockAddress,segments,count,callback,context);
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The blocks still buffered are copied at the end
+    if (error == SDCARD_ERRORS_OK)
+    {
+        dev->coalesceRead        = segments;
+        dev->coalesceReadCount   = segmentCount;
+        dev->coalesceReadAddress = blockAddress;
+        dev->coalesceReadLength  = 0;
+    }
+#endif
+    return error;
+}
+
+SDCard_Errors SDCard_readRangeAsync (SDCard_Device* dev,
+                                     uint32_t blockAddress,
+                                     uint32_t offset,
+                                     uint32_t length,
+                                     uint8_t* data,
+                                     SDCard_Callback callback,
+                                     void* context)
+{
+    if (length == 0)
+        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    blockAddress += offset / 512;
+    offset       %= 512;
+
+    dev->asyncSegment = 0;
+    dev->asyncData    = data;
+    if (SDCard_startRead(dev,blockAddress,(offset + length + 511) / 512,callback,context) != SDCARD_ERRORS_OK)
+        return SDCARD_ERRORS_BUSY;
+
+    // Always CMD18, it can be stopped inside a block
+    dev->asyncMultiple = TRUE;
+    dev->asyncSkip     = (uint16_t) offset;
+    dev->asyncLength   = length;
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The blocks still buffered are copied at the end
+    dev->coalesceReadBlocks.data = data;
+    dev->coalesceRead        = &dev->coalesceReadBlocks;
+    dev->coalesceReadAddress = blockAddress;
+    dev->coalesceReadOffset  = offset;
+    dev->coalesceReadLength  = length;
+#endif
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_writevAsync (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  const SDCard_Segment* segments,
+                                  uint32_t segmentCount,
+                                  SDCard_Callback callback,
+                                  void* context)
+{
+    uint32_t count = SDCard_countSegments(segments,segmentCount);
+
+    if (count == 0)
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+    // A CMD25 left open refuses the new write: nothing is changed before
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_cacheInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    SDCard_coalesceDrop(dev,blockAddress,segments,count);
+#endif
+    return SDCard_writeSegmentsAsync(dev,blockAddress,segments,count,callback,context);
+}
+
+/**
+ * The function goes on with the CMD18 left open, reading the next blocks
+ * into a list of segments. The CMD18 is left open again at the end.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] segments The list of segments, valid until the end of operation
+ * @param[in] count The total number of blocks of the segments
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+static SDCard_Errors SDCard_continueReadAsync (SDCard_Device* dev,
+                                               const SDCard_Segment* segments,
+                                               uint32_t count)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncSegment      = segments;
+    dev->asyncSegmentCount = segments->count;
+    dev->asyncData         = segments->data;
+    dev->asyncMultiple     = TRUE;
+    dev->asyncCount        = count;
+    if (SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_READ_TOKEN,0,0) != SDCARD_ERRORS_OK)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncKeepOpen = TRUE;
+    dev->asyncAddress  = dev->asyncNext;
+    dev->asyncNext    += count;
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function opens a CMD25 that is left open at the end, writing the
+ * first blocks. The length of the transfer is usually unknown, so the
+ * pre-erase is sent only when the caller knows it.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block
+ * @param[in] data The blocks, valid until the end of operation
+ * @param[in] count The number of blocks
+ * @param[in] preErase The blocks pre-erased with ACMD23 (SDHC only), 0 for
+ *            none
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+static SDCard_Errors SDCard_openWriteAsync (SDCard_Device* dev,
+                                            uint32_t blockAddress,
+                                            const uint8_t* data,
+                                            uint32_t count,
+                                            uint32_t preErase,
+                                            SDCard_Callback callback,
+                                            void* context)
+{
+    // A CMD25 left open refuses the new one: nothing is changed before
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    SDCard_readAheadInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    SDCard_discardRemove(dev,blockAddress,count);
+#endif
+
+    dev->asyncSegment  = 0;
+    dev->asyncData     = (uint8_t*) data;
+    dev->asyncMultiple = TRUE;
+    dev->asyncAddress  = blockAddress;
+    dev->asyncCount    = count;
+    dev->asyncPreErase = preErase;
+    if (SDCard_asyncStart(dev,
+                          (((preErase > 0) && dev->isSDHC) ?
+                                  SDCARD_ASYNCSTATE_WRITE_PRE_ERASE :
+                                  SDCARD_ASYNCSTATE_WRITE_COMMAND),
+                          callback,
+                          context) != SDCARD_ERRORS_OK)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->asyncKeepOpen = TRUE;
+    dev->asyncNext     = blockAddress + count;
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function goes on with the CMD25 left open, writing the next blocks.
+ * The CMD25 is left open again at the end.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] data The blocks, valid until the end of operation
+ * @param[in] count The number of blocks
+ * @param[in] callback Function called at the end of operation
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+static SDCard_Errors SDCard_continueWriteAsync (SDCard_Device* dev,
+                                                const uint8_t* data,
+                                                uint32_t count,
+                                                SDCard_Callback callback,
+                                                void* context)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    SDCard_readAheadInvalidate(dev,dev->asyncNext,count);
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    SDCard_discardRemove(dev,dev->asyncNext,count);
+#endif
+
+    dev->asyncSegment  = 0;
+    dev->asyncData     = (uint8_t*) data;
+    dev->asyncMultiple = TRUE;
+    dev->asyncCount    = count;
+    SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_WRITE_BLOCK,callback,context);
+
+    dev->asyncKeepOpen = TRUE;
+    dev->asyncAddress  = dev->asyncNext;
+    dev->asyncNext    += count;
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_eraseBlocksAsync (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       uint32_t count,
+                                       SDCard_Callback callback,
+                                       void* context)
+{
+    // A CMD25 left open refuses the erase: nothing is changed before
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_cacheInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    SDCard_readAheadInvalidate(dev,blockAddress,count);
+#endif
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    SDCard_discardRemove(dev,blockAddress,count);
+#endif
+
+    dev->asyncAddress = blockAddress;
+    dev->asyncCount   = count;
+    return SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_ERASE_COMMAND,callback,context);
+}
+
+SDCard_Errors SDCard_getSectorCountAsync (SDCard_Device* dev,
+                                          uint32_t* size,
+                                          SDCard_Callback callback,
+                                          void* context)
+{
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    *size = 0;
+    dev->asyncResult = size;
+    return SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_CSD_COMMAND,callback,context);
+}
+
+/**
+ * The function adds the time from the start of the current phase of the
+ * initialization to its counter, and starts the next phase.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in,out] phase The counter of the phase ended [ms]
+ */
+static void SDCard_initPhase (SDCard_Device* dev, uint32_t* phase)
+{
+    uint32_t now = dev->currentTime();
+
+    *phase        += now - dev->asyncTime;
+    dev->asyncTime = now;
+}
+
+/**
+ * The function delays the next polling of ACMD41/CMD1, the delay is
+ * doubled up to SDCARD_INIT_MAX_DELAY.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_initBackoff (SDCard_Device* dev)
+{
+    dev->asyncWait = dev->currentTime() + dev->asyncDelay;
+    if (dev->asyncDelay < SDCARD_INIT_MAX_DELAY)
+        dev->asyncDelay *= 2;
+}
+
+/**
+ * The function executes one step of the initialization sequence.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the sequence
+ */
+static SDCard_Errors SDCard_pollInit (SDCard_Device* dev)
+{
+    uint8_t response;
+    uint8_t ocr[4];
+    SDCard_Errors error;
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_INIT_WARM:
+        // Stop a transfer left open before the reset: the stop token ends a
+        // CMD25, the CMD12 a CMD18 (otherwise it is an illegal command)
+        SDCard_select(dev);
+        Spi_writeByte(dev->device,0xFD);
+        Spi_readByte(dev->device,&response);
+        SDCard_deselect(dev);
+        // The card programs the last blocks after the stop token: the next
+        // command waits for its end
+        SDCard_setBusy(dev);
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_STOP;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_STOP:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+        SDCard_deselect(dev);
+        // The CMD58 checks that the card is still initialized
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_OCR;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_RESET:
+        // Reset the card
+        SDCard_sendCommand(dev,SDCARD_COMMAND_0,0,&response);
+        if (response == SDCARD_RESPONSE_IDLE)
+        {
+            dev->retryStats[SDCARD_RETRYCOMMAND_RESET].commands++;
+        }
+        else if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_RESET) == TRUE)
+        {
+            break;
+        }
+
+        // Go on anyway when the retries are over, the next command checks the card
+        dev->asyncRetry = 0;
+        SDCard_initPhase(dev,&dev->initStats.reset);
+#ifdef WARCOMEB_SDCARD_CRC
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CRC_ON;
+#else
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_IF_COND;
+#endif
+        break;
+
+#ifdef WARCOMEB_SDCARD_CRC
+    case SDCARD_ASYNCSTATE_INIT_CRC_ON:
+        // From now on the card checks the CRC of commands and data blocks
+        SDCard_sendCommand(dev,SDCARD_COMMAND_59,0x00000001,&response);
+        if (response != SDCARD_RESPONSE_IDLE)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","CMD59 wrong reply",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        }
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_IF_COND;
+        break;
+#endif
+
+    case SDCARD_ASYNCSTATE_INIT_IF_COND:
+        // Try to understand the sdcard version and init
+        SDCard_sendCommand(dev,SDCARD_COMMAND_8,0x000001AA,&response);
+        if (response != SDCARD_RESPONSE_IDLE)
+        {
+            dev->cardVersion = 1;
+
+            SDCard_sendCommand(dev,SDCARD_COMMAND_A41,0x40000000,&response);
+            // Select the correct command: SDCARD v1 with ACMD41, MMC v3 with CMD1
+            dev->cardType = (response <= 1) ? 1 : 3;
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_OP_COND_V1;
+        }
+        else
+        {
+            dev->cardVersion = 2;
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_OP_COND;
+        }
+        SDCard_initPhase(dev,&dev->initStats.ifCond);
+        dev->asyncTimer = dev->currentTime() + SDCARD_INIT_TIMEOUT;
+        dev->asyncDelay = 1;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_OP_COND_V1:
+        // Polling for command
+        SDCard_sendCommand(dev,
+                           ((dev->cardType == 1) ? SDCARD_COMMAND_A41 : SDCARD_COMMAND_1),
+                           0,
+                           &response);
+        dev->initStats.opCondPolls++;
+        if (response == SDCARD_RESPONSE_OK)
+        {
+            SDCard_initPhase(dev,&dev->initStats.opCond);
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_BLOCK_LENGTH;
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        }
+        else
+        {
+            SDCard_initBackoff(dev);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_OP_COND:
+        // Polling card with CMD55 and ACMD41 until reply 0x00
+        SDCard_sendCommand(dev,SDCARD_COMMAND_55,0,&response);
+        SDCard_sendCommand(dev,SDCARD_COMMAND_A41,0x40000000,&response);
+        dev->initStats.opCondPolls++;
+        if (response == SDCARD_RESPONSE_OK)
+        {
+            SDCard_initPhase(dev,&dev->initStats.opCond);
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_OCR;
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","CMD55/ACMD41 wrong reply or timeout",CLI_MESSAGETYPE_ERROR);
+            Cli_sendMessage("SDCARD","initialization fail",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        }
+        else
+        {
+            SDCard_initBackoff(dev);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_OCR:
+        // Check CCS bit into OCR of CMD58
+        SDCard_sendCommand(dev,SDCARD_COMMAND_58,0,&response);
+        if ((response != SDCARD_RESPONSE_OK) && (dev->initStats.warm == TRUE))
+        {
+            // The card was reset or changed: full initialization
+            SDCard_deselect(dev);
+            memset(&dev->info,0,sizeof(SDCard_Info));
+            dev->initStats.warm = FALSE;
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_RESET;
+            break;
+        }
+        else if (response != SDCARD_RESPONSE_OK)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","CMD58 wrong reply",CLI_MESSAGETYPE_ERROR);
+            Cli_sendMessage("SDCARD","initialization fail",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        }
+
+        SDCard_readBuffer(dev,ocr,4);
+        // Close CMD58
+        SDCard_deselect(dev);
+        dev->info.ocr = ((uint32_t)ocr[0] << 24) | ((uint32_t)ocr[1] << 16) |
+                        ((uint32_t)ocr[2] << 8)  | ocr[3];
+        SDCard_initPhase(dev,&dev->initStats.ocr);
+
+        if (ocr[0] & 0x40)
+            dev->isSDHC = TRUE;
+
+        // The card keeps block length, High-Speed mode and registers
+        if ((dev->initStats.warm == TRUE) && (dev->info.sectorCount != 0))
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_CLOCK;
+        else if (dev->isSDHC == TRUE)
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_CSD;
+        else
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_BLOCK_LENGTH;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_BLOCK_LENGTH:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_16,0X00000200,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        }
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CSD;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_CSD:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_9,0,&response);
+        if (response == SDCARD_RESPONSE_OK)
+        {
+            dev->asyncTimer = dev->currentTime() + SDCARD_TIMEOUT_READ;
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_CSD_TOKEN;
+            break;
+        }
+
+        // Close CMD9 and retry later
+        SDCard_deselect(dev);
+        if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_CSD_TOKEN:
+        error = SDCard_readRegister(dev,dev->info.csd,16);
+        if (error == SDCARD_ERRORS_BUSY)
+            break;
+
+        // Close CMD9
+        SDCard_deselect(dev);
+        if (error != SDCARD_ERRORS_OK)
+        {
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_CSD;
+            if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+                return SDCard_asyncEnd(dev,SDCARD_ERRORS_INIT_FAILED);
+            break;
+        }
+        SDCard_parseCsd(&dev->info);
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CID;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_CID:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_10,0,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            // The CID is only informative
+            SDCard_deselect(dev);
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_STATUS;
+            break;
+        }
+        dev->asyncTimer = dev->currentTime() + SDCARD_TIMEOUT_READ;
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CID_TOKEN;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_CID_TOKEN:
+        if (SDCard_readRegister(dev,dev->info.cid,16) == SDCARD_ERRORS_BUSY)
+            break;
+
+        // Close CMD10
+        SDCard_deselect(dev);
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_STATUS;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_STATUS:
+        // MMC cards don't have the SD Status
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_SWITCH;
+        if ((dev->cardVersion == 1) && (dev->cardType == 3))
+            break;
+
+        SDCard_sendCommand(dev,SDCARD_COMMAND_55,0,&response);
+        SDCard_sendCommand(dev,SDCARD_COMMAND_A13,0,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            SDCard_deselect(dev);
+            break;
+        }
+        // Skip the second byte of R2
+        Spi_readByte(dev->device,&response);
+        dev->asyncTimer = dev->currentTime() + SDCARD_TIMEOUT_READ;
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_STATUS_TOKEN;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_STATUS_TOKEN:
+        error = SDCard_readRegister(dev,dev->asyncRegister,64);
+        if (error == SDCARD_ERRORS_BUSY)
+            break;
+
+        // Close ACMD13
+        SDCard_deselect(dev);
+        if (error == SDCARD_ERRORS_OK)
+            SDCard_parseStatus(&dev->info,dev->asyncRegister);
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_SWITCH;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_SWITCH:
+        // The TRAN_SPEED of the CSD, the default speed when it isn't valid
+        dev->cardClock = dev->info.tranSpeed;
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CLOCK;
+        if (dev->cardClock == 0)
+            dev->cardClock = SDCARD_CLOCK_DEFAULT;
+
+        // Without the hook the clock can't be changed, the switch function is
+        // available with the command class 10 only
+        if ((dev->setClock == 0) || (dev->highSpeed == FALSE) ||
+            (dev->cardVersion != 2) || ((dev->info.commandClasses & 0x0400) == 0))
+            break;
+
+        // Set the function 1 (High-Speed) of group 1, keep the others
+        SDCard_sendCommand(dev,SDCARD_COMMAND_6,0x80FFFFF1,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            SDCard_deselect(dev);
+            dev->asyncState = SDCARD_ASYNCSTATE_INIT_CLOCK;
+            break;
+        }
+        dev->asyncTimer = dev->currentTime() + SDCARD_TIMEOUT_READ;
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_SWITCH_TOKEN;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_SWITCH_TOKEN:
+        error = SDCard_readRegister(dev,dev->asyncRegister,64);
+        if (error == SDCARD_ERRORS_BUSY)
+            break;
+
+        // Close CMD6
+        SDCard_deselect(dev);
+        // The selected function of group 1 is into bits 379:376
+        if ((error == SDCARD_ERRORS_OK) && ((dev->asyncRegister[16] & 0x0F) == 0x01))
+        {
+            dev->cardClock = SDCARD_CLOCK_HIGH_SPEED;
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","High-Speed mode",CLI_MESSAGETYPE_INFO);
+#endif
+        }
+        dev->asyncState = SDCARD_ASYNCSTATE_INIT_CLOCK;
+        break;
+
+    case SDCARD_ASYNCSTATE_INIT_CLOCK:
+        if (dev->setClock != 0)
+        {
+            dev->clock = dev->cardClock;
+            if ((dev->maxClock != 0) && (dev->clock > dev->maxClock))
+                dev->clock = dev->maxClock;
+            dev->clock = dev->setClock(dev->device,dev->clock);
+        }
+        SDCard_initLatency(dev);
+
+        SDCard_initPhase(dev,&dev->initStats.registers);
+        dev->initStats.total = dev->initStats.reset + dev->initStats.ifCond +
+                               dev->initStats.opCond + dev->initStats.ocr +
+                               dev->initStats.registers;
+        dev->isInit = TRUE;
+#ifdef WARCOMEB_SDCARD_DEBUG
+        Cli_sendMessage("SDCARD","card initialized!",CLI_MESSAGETYPE_INFO);
+#endif
+        return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+
+    default:
+        break;
+    }
+
+    return SDCARD_ERRORS_BUSY;
+}
+
+/**
+ * The function receives the bytes of a data block that are not requested,
+ * in small pieces.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] length The number of bytes
+ * @param[in,out] crc The CRC16 of the block, updated with these bytes
+ */
+static void SDCard_discard (SDCard_Device* dev, uint16_t length, uint16_t* crc)
+{
+    uint8_t scratch[16];
+    uint16_t size;
+
+    while (length > 0)
+    {
+        size = (length > sizeof(scratch)) ? sizeof(scratch) : length;
+        SDCard_readBuffer(dev,scratch,size);
+#ifdef WARCOMEB_SDCARD_CRC
+        *crc = SDCard_crc16(*crc,scratch,size);
+#else
+        (void) crc;
+#endif
+        length -= size;
+    }
+}
+
+/**
+ * The function reads the current block of a byte range, just after its data
+ * token: the leading bytes are discarded, the requested ones are stored
+ * and the rest is discarded too. Without CRC check, when the range ends
+ * inside the block, the CMD18 is stopped without receive the rest.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the range
+ */
+static SDCard_Errors SDCard_readRangeBlock (SDCard_Device* dev)
+{
+#ifdef WARCOMEB_SDCARD_CRC
+    uint8_t response;
+#endif
+    uint8_t crc[2];
+    uint16_t crc16 = 0;
+    uint16_t length = 512 - dev->asyncSkip;
+
+    if (length > dev->asyncLength)
+        length = (uint16_t) dev->asyncLength;
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_DATA_START,0,dev->asyncSkip + length);
+#endif
+    SDCard_discard(dev,dev->asyncSkip,&crc16);
+    SDCard_readBuffer(dev,dev->asyncData,length);
+#ifdef WARCOMEB_SDCARD_METRICS
+    SDCard_metricsPhase(dev,&dev->metrics.transfer);
+    dev->metrics.bytesRead += length;
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    SDCard_trace(dev,SDCARD_TRACETYPE_DATA_END,0,length);
+#endif
+#ifdef WARCOMEB_SDCARD_CRC
+    crc16 = SDCard_crc16(crc16,dev->asyncData,length);
+#else
+    // The CMD12 stops the transmission also inside a block
+    if ((length == dev->asyncLength) && (dev->asyncSkip + length < 512))
+        return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+#endif
+    SDCard_discard(dev,512 - dev->asyncSkip - length,&crc16);
+    SDCard_readBuffer(dev,crc,2);
+
+#ifdef WARCOMEB_SDCARD_CRC
+    if ((((uint16_t)crc[0] << 8) | crc[1]) != crc16)
+    {
+        dev->crcErrors++;
+        // Read again only this block: the command starts from it
+        SDCard_deselect(dev);
+        SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+        dev->asyncState = SDCARD_ASYNCSTATE_READ_COMMAND;
+        if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_READ_BLOCKS_FAILED);
+        return SDCARD_ERRORS_BUSY;
+    }
+#endif
+
+    // The retries are counted for each block
+    dev->asyncData   += length;
+    dev->asyncLength -= length;
+    dev->asyncSkip    = 0;
+    dev->asyncAddress++;
+    dev->asyncRetry   = 0;
+
+    if (--dev->asyncCount == 0)
+        return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+
+    dev->asyncTime  = dev->currentTime();
+    dev->asyncTimer = dev->asyncTime + dev->readLatency.timeout;
+    dev->asyncState = SDCARD_ASYNCSTATE_READ_TOKEN;
+#ifdef WARCOMEB_SDCARD_METRICS
+    dev->metricsStart = SDCard_metricsNow(dev);
+#endif
+    return SDCARD_ERRORS_BUSY;
+}
+
+/**
+ * The function executes one step of the reading of blocks.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the reading
+ */
+static SDCard_Errors SDCard_pollRead (SDCard_Device* dev)
+{
+    uint8_t response;
+    uint8_t crc[2];
+    SDCard_Errors error = (dev->asyncMultiple ? SDCARD_ERRORS_READ_BLOCKS_FAILED :
+                                                SDCARD_ERRORS_READ_BLOCK_FAILED);
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_READ_COMMAND:
+        // Send starting block with reading command
+        SDCard_sendCommand(dev,
+                           (dev->asyncMultiple ? SDCARD_COMMAND_18 : SDCARD_COMMAND_17),
+                           dev->asyncAddress,
+                           &response);
+        if (response == SDCARD_RESPONSE_OK)
+        {
+            dev->retryStats[SDCARD_RETRYCOMMAND_READ].commands++;
+            dev->asyncTime  = dev->currentTime();
+            dev->asyncTimer = dev->asyncTime + dev->readLatency.timeout;
+            dev->asyncState = SDCARD_ASYNCSTATE_READ_TOKEN;
+#ifdef WARCOMEB_SDCARD_METRICS
+            dev->metricsStart = SDCard_metricsNow(dev);
+#endif
+            break;
+        }
+
+        // Close CMD17/CMD18 and retry later
+        SDCard_deselect(dev);
+        if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","CMD17/CMD18 read fail",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,error);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_READ_TOKEN:
+        // Wait for datastart token, one byte for each call
+        Spi_readByte(dev->device,&response);
+        if (response == 0xFE)
+        {
+            SDCard_updateLatency(&dev->readLatency,dev->currentTime() - dev->asyncTime);
+#ifdef WARCOMEB_SDCARD_METRICS
+            SDCard_metricsPhase(dev,&dev->metrics.tokenWait);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+            SDCard_trace(dev,SDCARD_TRACETYPE_TOKEN,response,0);
+#endif
+
+            // A byte range is moved by the CPU
+            if (dev->asyncLength != 0)
+                return SDCard_readRangeBlock(dev);
+
+            // The transfer can be completed before the function returns
+            dev->asyncTransferDone = FALSE;
+            dev->asyncState = SDCARD_ASYNCSTATE_READ_DATA;
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+            SDCard_trace(dev,SDCARD_TRACETYPE_DATA_START,0,512);
+#endif
+            if (dev->transferAsync != 0)
+            {
+                dev->transferAsync(dev->device,0,dev->asyncData,512);
+            }
+            else
+            {
+                SDCard_readBuffer(dev,dev->asyncData,512);
+                dev->asyncTransferDone = TRUE;
+            }
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            // Use the timeout of the card until new samples, and send the
+            // command again from this block
+            SDCard_resetLatency(&dev->readLatency,dev->readLatency.limit);
+            dev->readLatency.late++;
+            SDCard_deselect(dev);
+            if (dev->asyncMultiple == TRUE)
+                SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+            dev->asyncState = SDCARD_ASYNCSTATE_READ_COMMAND;
+            if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+                return SDCard_asyncEnd(dev,error);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_READ_DATA:
+        if (dev->asyncTransferDone == FALSE)
+            break;
+
+        SDCard_readBuffer(dev,crc,2);
+#ifdef WARCOMEB_SDCARD_METRICS
+        SDCard_metricsPhase(dev,&dev->metrics.transfer);
+        dev->metrics.bytesRead += 512;
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_DATA_END,0,512);
+#endif
+#ifdef WARCOMEB_SDCARD_CRC
+        if ((((uint16_t)crc[0] << 8) | crc[1]) != SDCard_crc16(0,dev->asyncData,512))
+        {
+            dev->crcErrors++;
+            // Read again only this block: the command starts from it
+            SDCard_deselect(dev);
+            if (dev->asyncMultiple == TRUE)
+                SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+            dev->asyncState = SDCARD_ASYNCSTATE_READ_COMMAND;
+            if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+                return SDCard_asyncEnd(dev,error);
+            break;
+        }
+#endif
+        // The retries are counted for each block
+        dev->asyncAddress++;
+        dev->asyncRetry = 0;
+
+        if (--dev->asyncCount == 0)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+        // Move forward the data pointer
+        SDCard_nextBlock(dev);
+        dev->asyncTime  = dev->currentTime();
+        dev->asyncTimer = dev->asyncTime + dev->readLatency.timeout;
+        dev->asyncState = SDCARD_ASYNCSTATE_READ_TOKEN;
+#ifdef WARCOMEB_SDCARD_METRICS
+        dev->metricsStart = SDCard_metricsNow(dev);
+#endif
+        break;
+
+    default:
+        break;
+    }
+
+    return SDCARD_ERRORS_BUSY;
+}
+
+/**
+ * The function executes one step of the writing of blocks.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the writing
+ */
+static SDCard_Errors SDCard_pollWrite (SDCard_Device* dev)
+{
+    uint8_t response;
+    uint8_t crc[2] = {0xFF, 0xFF};
+#ifdef WARCOMEB_SDCARD_CRC
+    uint16_t crc16;
+#endif
+    SDCard_Errors error = (dev->asyncMultiple ? SDCARD_ERRORS_WRITE_BLOCKS_FAILED :
+                                                SDCARD_ERRORS_WRITE_BLOCK_FAILED);
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_WRITE_PRE_ERASE:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_55,0,&response);
+        SDCard_sendCommand(dev,SDCARD_COMMAND_A23,dev->asyncPreErase,&response);
+        dev->asyncState = SDCARD_ASYNCSTATE_WRITE_COMMAND;
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_COMMAND:
+        // Send starting block with writing command
+        SDCard_sendCommand(dev,
+                           (dev->asyncMultiple ? SDCARD_COMMAND_25 : SDCARD_COMMAND_24),
+                           dev->asyncAddress,
+                           &response);
+        if (response == SDCARD_RESPONSE_OK)
+        {
+            dev->retryStats[SDCARD_RETRYCOMMAND_WRITE].commands++;
+            dev->asyncState = SDCARD_ASYNCSTATE_WRITE_BLOCK;
+            break;
+        }
+
+        // Close CMD24/CMD25 and retry later
+        SDCard_deselect(dev);
+        if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_WRITE) == FALSE)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","CMD24/CMD25 write fail",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,error);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_BLOCK:
+#ifdef WARCOMEB_SDCARD_METRICS
+        dev->metricsStart = SDCard_metricsNow(dev);
+#endif
+        // Send TOKEN
+        Spi_writeByte(dev->device,(dev->asyncMultiple ? 0xFC : 0xFE));
+
+        // The transfer can be completed before the function returns
+        dev->asyncTransferDone = FALSE;
+        dev->asyncState = SDCARD_ASYNCSTATE_WRITE_DATA;
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_DATA_START,(dev->asyncMultiple ? 0xFC : 0xFE),512);
+#endif
+        if (dev->transferAsync != 0)
+        {
+            dev->transferAsync(dev->device,dev->asyncData,0,512);
+        }
+        else
+        {
+            SDCard_writeBuffer(dev,dev->asyncData,512);
+            dev->asyncTransferDone = TRUE;
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_DATA:
+        if (dev->asyncTransferDone == FALSE)
+            break;
+
+#ifdef WARCOMEB_SDCARD_CRC
+        crc16 = SDCard_crc16(0,dev->asyncData,512);
+        crc[0] = (uint8_t) (crc16 >> 8);
+        crc[1] = (uint8_t) crc16;
+#endif
+        // Send CRC, dummy when the card doesn't check it
+        SDCard_writeBuffer(dev,crc,2);
+
+        // Read card reply
+        // Every data block written to the card will be acknoledged by a
+        // data response token. It is one byte long and has the following format:
+        // X X X 0 STATUS 1, where status bits is defined as
+        // 010 - Data accepted
+        // 101 - Data rejected due to a CRC error
+        // 110 - Data rejected due to a write error
+        Spi_readByte(dev->device,&response);
+#ifdef WARCOMEB_SDCARD_METRICS
+        SDCard_metricsPhase(dev,&dev->metrics.transfer);
+        dev->metrics.bytesWritten += 512;
+        dev->metricsBusy = dev->metricsStart;
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_DATA_END,response,512);
+#endif
+#ifdef WARCOMEB_SDCARD_CRC
+        if ((response & 0x1F) == SDCARD_RESPONSE_CRC)
+        {
+            dev->crcErrors++;
+            // Write again only this block: stop the CMD25 and wait the
+            // programming of the blocks already accepted
+            if (dev->asyncMultiple == TRUE)
+            {
+                Spi_writeByte(dev->device,0xFD);
+                Spi_readByte(dev->device,&response);
+            }
+            dev->asyncTimer = dev->currentTime() + dev->writeLatency.limit;
+            dev->asyncState = SDCARD_ASYNCSTATE_WRITE_RESTART;
+            break;
+        }
+#endif
+        if ((response & 0x1F) != SDCARD_RESPONSE_FAULT)
+        {
+#ifdef WARCOMEB_SDCARD_DEBUG
+            Cli_sendMessage("SDCARD","write block response fault",CLI_MESSAGETYPE_ERROR);
+#endif
+            return SDCard_asyncEnd(dev,error);
+        }
+
+        // Move forward the data pointer, the retries are counted for each block
+        dev->asyncAddress++;
+        dev->asyncRetry = 0;
+        if (dev->asyncCount > 1)
+            SDCard_nextBlock(dev);
+        dev->asyncTime  = dev->currentTime();
+        dev->asyncTimer = dev->asyncTime + dev->writeLatency.timeout;
+        dev->asyncState = SDCARD_ASYNCSTATE_WRITE_BUSY;
+
+        // The last block of CMD24, or of a CMD25 left open, is programmed
+        // while the host goes on: the next operation waits for it
+        if ((dev->lazyBusy == TRUE) &&
+            (dev->asyncCount == 1) &&
+            ((dev->asyncMultiple == FALSE) || (dev->asyncKeepOpen == TRUE)))
+        {
+            dev->asyncCount = 0;
+            SDCard_setBusy(dev);
+            if (dev->asyncKeepOpen == TRUE)
+                dev->asyncOpen = SDCARD_TRANSFER_WRITE;
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_START,0,0);
+#endif
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_BUSY:
+        // The card keeps DO low while it is programming
+        Spi_readByte(dev->device,&response);
+        if (response == 0xFF)
+        {
+            SDCard_updateLatency(&dev->writeLatency,dev->currentTime() - dev->asyncTime);
+#ifdef WARCOMEB_SDCARD_METRICS
+            SDCard_metricsAdd(&dev->metrics.busyWait,SDCard_metricsNow(dev) - dev->metricsBusy);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+            SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_END,0,0);
+#endif
+
+            if (--dev->asyncCount > 0)
+            {
+                dev->asyncState = SDCARD_ASYNCSTATE_WRITE_BLOCK;
+            }
+            else if (dev->asyncKeepOpen == TRUE)
+            {
+                // The card waits for the next data token
+                dev->asyncOpen = SDCARD_TRANSFER_WRITE;
+                return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+            }
+            else if (dev->asyncMultiple == TRUE)
+            {
+                dev->asyncState = SDCARD_ASYNCSTATE_WRITE_END;
+            }
+            else
+            {
+                return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+            }
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            // A block can be longer than usual (garbage collection of the
+            // card): the wait goes on until the timeout of the card, and
+            // the sample raises the estimate
+            if (dev->asyncTimer - dev->asyncTime >= dev->writeLatency.limit)
+                return SDCard_asyncEnd(dev,SDCARD_ERRORS_TIMEOUT);
+            dev->writeLatency.late++;
+            dev->asyncTimer = dev->asyncTime + dev->writeLatency.limit;
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_END:
+        // Send TOKEN for STOP TRANS and skip the stuff byte
+        Spi_writeByte(dev->device,0xFD);
+        Spi_readByte(dev->device,&response);
+        dev->asyncTimer = dev->currentTime() + dev->writeLatency.limit;
+        dev->asyncState = SDCARD_ASYNCSTATE_WRITE_STOP;
+#ifdef WARCOMEB_SDCARD_METRICS
+        dev->metricsBusy = SDCard_metricsNow(dev);
+#endif
+
+        if (dev->lazyBusy == TRUE)
+        {
+            SDCard_setBusy(dev);
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_START,0,0);
+#endif
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_RESTART:
+        Spi_readByte(dev->device,&response);
+        if (response == 0xFF)
+        {
+            // Send the command again from the rejected block
+            SDCard_deselect(dev);
+            dev->asyncState = SDCARD_ASYNCSTATE_WRITE_COMMAND;
+            if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_WRITE) == FALSE)
+                return SDCard_asyncEnd(dev,error);
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_TIMEOUT);
+        }
+        break;
+
+    case SDCARD_ASYNCSTATE_WRITE_STOP:
+        Spi_readByte(dev->device,&response);
+        if (response == 0xFF)
+        {
+#ifdef WARCOMEB_SDCARD_METRICS
+            SDCard_metricsAdd(&dev->metrics.busyWait,SDCard_metricsNow(dev) - dev->metricsBusy);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+            SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_END,0,0);
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_TIMEOUT);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return SDCARD_ERRORS_BUSY;
+}
+
+/**
+ * The function executes one step of the erasing of blocks.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the erasing
+ */
+static SDCard_Errors SDCard_pollErase (SDCard_Device* dev)
+{
+    uint8_t response;
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_ERASE_COMMAND:
+        // Send starting block
+        SDCard_sendCommand(dev,SDCARD_COMMAND_32,dev->asyncAddress,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_ERASE_BLOCKS_FAILED);
+        }
+
+        // Send ending block
+        SDCard_sendCommand(dev,SDCARD_COMMAND_33,(dev->asyncAddress+dev->asyncCount-1),&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_ERASE_BLOCKS_FAILED);
+        }
+
+        // Send erase command
+        SDCard_sendCommand(dev,SDCARD_COMMAND_38,0,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_ERASE_BLOCKS_FAILED);
+        }
+#ifdef WARCOMEB_SDCARD_METRICS
+        dev->metricsBusy = SDCard_metricsNow(dev);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+        SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_START,0,0);
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+        if (dev->discardBusy == TRUE)
+        {
+            // The erase of the discard queue is waited by the next operation
+            dev->discardStart = dev->currentTime();
+            dev->cardBusy     = TRUE;
+            dev->busyTimer    = dev->discardStart +
+                                SDCard_getEraseTimeout(dev,dev->asyncAddress,dev->asyncCount);
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+#endif
+
+        // The card drives DO only when it is selected
+        SDCard_select(dev);
+        dev->asyncTimer = dev->currentTime() +
+                          SDCard_getEraseTimeout(dev,dev->asyncAddress,dev->asyncCount);
+        dev->asyncState = SDCARD_ASYNCSTATE_ERASE_BUSY;
+        break;
+
+    case SDCARD_ASYNCSTATE_ERASE_BUSY:
+        Spi_readByte(dev->device,&response);
+        if (response == 0xFF)
+        {
+#ifdef WARCOMEB_SDCARD_METRICS
+            SDCard_metricsAdd(&dev->metrics.busyWait,SDCard_metricsNow(dev) - dev->metricsBusy);
+#endif
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+            SDCard_trace(dev,SDCARD_TRACETYPE_BUSY_END,0,0);
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+        else if (dev->currentTime() > dev->asyncTimer)
+        {
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_TIMEOUT);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return SDCARD_ERRORS_BUSY;
+}
+
+/**
+ * The function executes one step of the reading of the CSD.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_BUSY until the end of the reading
+ */
+static SDCard_Errors SDCard_pollCsd (SDCard_Device* dev)
+{
+    uint8_t response;
+    SDCard_Errors error;
+
+    switch (dev->asyncState)
+    {
+    case SDCARD_ASYNCSTATE_CSD_COMMAND:
+        SDCard_sendCommand(dev,SDCARD_COMMAND_9,0,&response);
+        if (response != SDCARD_RESPONSE_OK)
+        {
+            // Close CMD9
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_COMMAND_FAILED);
+        }
+        dev->asyncTimer = dev->currentTime() + SDCARD_TIMEOUT_READ;
+        dev->asyncState = SDCARD_ASYNCSTATE_CSD_TOKEN;
+        break;
+
+    case SDCARD_ASYNCSTATE_CSD_TOKEN:
+        error = SDCard_readRegister(dev,dev->asyncRegister,16);
+        if (error == SDCARD_ERRORS_BUSY)
+            break;
+
+        if (error == SDCARD_ERRORS_OK)
+        {
+            memcpy(dev->info.csd,dev->asyncRegister,16);
+            SDCard_parseCsd(&dev->info);
+            *dev->asyncResult = dev->info.sectorCount;
+            // Close CMD9
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_OK);
+        }
+
+        // Close CMD9 and read again the register
+        SDCard_deselect(dev);
+        dev->asyncState = SDCARD_ASYNCSTATE_CSD_COMMAND;
+        if (SDCard_retry(dev,SDCARD_RETRYCOMMAND_READ) == FALSE)
+            return SDCard_asyncEnd(dev,error);
+        break;
+
+    default:
+        break;
+    }
+
+    return SDCARD_ERRORS_BUSY;
+}
+
+SDCard_Errors SDCard_poll (SDCard_Device* dev)
+{
+    if (dev->asyncState == SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_OK;
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    // The operation waits for its turn on the bus
+    if (dev->busPending == TRUE)
+    {
+        if (SDCard_busOwn(dev,TRUE) == FALSE)
+            return SDCARD_ERRORS_BUSY;
+        dev->busPending = FALSE;
+        // The first accesses are already done when the bus was released
+        // during the programming of the card
+        if (dev->busYielded == FALSE)
+            SDCard_asyncSelect(dev);
+        dev->busYielded = FALSE;
+    }
+#endif
+
+    // The operation is waiting before retry
+    if (dev->currentTime() < dev->asyncWait)
+        return SDCARD_ERRORS_BUSY;
+
+    // The card is still programming the last block written
+    if ((dev->cardBusy == TRUE) && (SDCard_select(dev) == FALSE))
+    {
+        if (dev->currentTime() > dev->busyTimer)
+        {
+            dev->cardBusy = FALSE;
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+            dev->discardBusy = FALSE;
+#endif
+            return SDCard_asyncEnd(dev,SDCARD_ERRORS_TIMEOUT);
+        }
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+        // The programming doesn't need the bus: the other users go on
+        // until the next check
+        if (dev->bus != 0)
+        {
+            SDCard_deselect(dev);
+            SDCard_busRelease(dev->bus,dev->busUser);
+            dev->busPending = TRUE;
+            dev->busYielded = TRUE;
+        }
+#endif
+        return SDCARD_ERRORS_BUSY;
+    }
+
+    if (dev->asyncState <= SDCARD_ASYNCSTATE_INIT_CLOCK)
+        return SDCard_pollInit(dev);
+    else if (dev->asyncState <= SDCARD_ASYNCSTATE_READ_DATA)
+        return SDCard_pollRead(dev);
+    else if (dev->asyncState <= SDCARD_ASYNCSTATE_WRITE_STOP)
+        return SDCard_pollWrite(dev);
+    else if (dev->asyncState <= SDCARD_ASYNCSTATE_ERASE_BUSY)
+        return SDCard_pollErase(dev);
+    else
+        return SDCard_pollCsd(dev);
+}
+
+/**
+ * The function runs the operation just started until its end.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] error The result of the start function
+ * @return The result of the operation
+ */
+static SDCard_Errors SDCard_waitOperation (SDCard_Device* dev,
+                                           SDCard_Errors error)
+{
+    // The operation was not started
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    do
+    {
+        error = SDCard_poll(dev);
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+        // Without lock functions all users of the bus run into this task,
+        // so the operation of the card that holds the bus goes on here
+        if ((dev->busPending == TRUE) &&
+            (dev->bus->lock == 0) &&
+            (dev->bus->owner != 0) &&
+            (dev->bus->cards[dev->bus->owner - 1] != 0))
+            SDCard_poll(dev->bus->cards[dev->bus->owner - 1]);
+#endif
+    } while (error == SDCARD_ERRORS_BUSY);
+
+    return error;
+}
+
+/**
+ * The function stops the CMD25 left open, if any, and waits the end of
+ * programming.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_OK if the CMD25 is stopped, an error otherwise.
+ */
+static SDCard_Errors SDCard_closeWrite (SDCard_Device* dev)
+{
+    SDCard_Errors error;
+
+    if (dev->asyncOpen != SDCARD_TRANSFER_WRITE)
+        return SDCARD_ERRORS_OK;
+
+    dev->asyncMultiple = TRUE;
+    error = SDCard_asyncStart(dev,SDCARD_ASYNCSTATE_WRITE_END,0,0);
+    return SDCard_waitOperation(dev,error);
+}
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+
+/**
+ * The function fills the free part of the read-ahead buffer from the CMD18
+ * left open.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_OK if the buffer is full, an error otherwise.
+ */
+static SDCard_Errors SDCard_readAheadFill (SDCard_Device* dev)
+{
+    SDCard_Errors error;
+    SDCard_Segment segments[2];
+    uint16_t tail = (dev->readAheadHead + dev->readAheadCount) % WARCOMEB_SDCARD_READAHEAD_SECTORS;
+    uint16_t space = WARCOMEB_SDCARD_READAHEAD_SECTORS - dev->readAheadCount;
+    uint32_t next = dev->readAheadAddress + dev->readAheadCount;
+
+    // The CMD18 left open must be the one of the buffer
+    if ((dev->asyncOpen != SDCARD_TRANSFER_READ) || (dev->asyncNext != next))
+        return SDCARD_ERRORS_OK;
+    // Don't read beyond the end of the card
+    if (next >= dev->info.sectorCount)
+        return SDCARD_ERRORS_OK;
+    if (space > (dev->info.sectorCount - next))
+        space = dev->info.sectorCount - next;
+
+    if (space == 0)
+        return SDCARD_ERRORS_OK;
+
+    // The free part of the ring can wrap around the end of the buffer
+    segments[0].data  = dev->readAhead[tail];
+    segments[0].count = WARCOMEB_SDCARD_READAHEAD_SECTORS - tail;
+    if (segments[0].count > space)
+        segments[0].count = space;
+    segments[1].data  = dev->readAhead[0];
+    segments[1].count = space - segments[0].count;
+
+    error = SDCard_waitOperation(dev,SDCard_continueReadAsync(dev,segments,space));
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    dev->readAheadCount += space;
+    dev->readAheadStats.prefetched += space;
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function reads a block through the read-ahead buffer.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to read
+ * @param[out] data
+ * @return SDCARD_ERRORS_OK if the block is read, an error otherwise.
+ */
+static SDCard_Errors SDCard_readAheadRead (SDCard_Device* dev,
+                                           uint32_t blockAddress,
+                                           uint8_t* data)
+{
+    SDCard_Errors error;
+    SDCard_Segment segments[2];
+    uint32_t count = WARCOMEB_SDCARD_READAHEAD_SECTORS;
+    uint32_t offset = blockAddress - dev->readAheadAddress;
+    bool isSequential = (blockAddress == (dev->readAheadLast + 1)) ? TRUE : FALSE;
+
+    dev->readAheadLast = blockAddress;
+
+    if (offset < dev->readAheadCount)
+    {
+        dev->readAheadStats.hits++;
+
+        // The sectors skipped are dropped with the requested one
+        dev->readAheadHead = (dev->readAheadHead + offset) % WARCOMEB_SDCARD_READAHEAD_SECTORS;
+        memcpy(data,dev->readAhead[dev->readAheadHead],512);
+        dev->readAheadHead = (dev->readAheadHead + 1) % WARCOMEB_SDCARD_READAHEAD_SECTORS;
+        dev->readAheadCount -= (offset + 1);
+        dev->readAheadAddress = blockAddress + 1;
+
+        // Keep the buffer full while the CMD18 is open
+        if (SDCard_readAheadFill(dev) != SDCARD_ERRORS_OK)
+            dev->readAheadCount = 0;
+        return SDCARD_ERRORS_OK;
+    }
+
+    dev->readAheadStats.misses++;
+    dev->readAheadCount = 0;
+
+    // Stop the read-ahead at the end of the card
+    if ((blockAddress + count) >= dev->info.sectorCount)
+        count = (blockAddress < dev->info.sectorCount) ? (dev->info.sectorCount - blockAddress - 1) : 0;
+
+    if (isSequential && (count > 0))
+    {
+        // Open a new CMD18: the requested block and then the buffer
+        segments[0].data  = data;
+        segments[0].count = 1;
+        segments[1].data  = dev->readAhead[0];
+        segments[1].count = count;
+
+        error = SDCard_readSegmentsAsync(dev,blockAddress,segments,count + 1,0,0);
+        if (error == SDCARD_ERRORS_OK)
+        {
+            dev->asyncKeepOpen = TRUE;
+            dev->asyncNext     = blockAddress + count + 1;
+            error = SDCard_waitOperation(dev,error);
+        }
+
+        if (error == SDCARD_ERRORS_OK)
+        {
+            dev->readAheadStats.streams++;
+            dev->readAheadStats.prefetched += count;
+            dev->readAheadAddress = blockAddress + 1;
+            dev->readAheadHead    = 0;
+            dev->readAheadCount   = count;
+            return SDCARD_ERRORS_OK;
+        }
+        // Try the block alone
+    }
+
+    return SDCard_waitOperation(dev,SDCard_readBlocksAsync(dev,blockAddress,data,1,0,0));
+}
+
+void SDCard_getReadAheadStats (SDCard_Device* dev,
+                               SDCard_ReadAheadStats* stats)
+{
+    *stats = dev->readAheadStats;
+}
+
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+
+/**
+ * The function writes the staging buffer with one command.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_OK if the buffer is written, an error otherwise.
+ */
+static SDCard_Errors SDCard_coalesceFlush (SDCard_Device* dev)
+{
+    SDCard_Errors error;
+    SDCard_Segment segment;
+
+    if (dev->coalesceCount == 0)
+        return SDCARD_ERRORS_OK;
+
+    segment.data  = dev->coalesce[0];
+    segment.count = dev->coalesceCount;
+    error = SDCard_waitOperation(dev,SDCard_writeSegmentsAsync(dev,dev->coalesceAddress,&segment,dev->coalesceCount,0,0));
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    dev->coalesceStats.bursts++;
+    dev->coalesceCount = 0;
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function writes the staging buffer when it overlaps a range or when
+ * its timeout is elapsed.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the range
+ * @param[in] count The number of blocks of the range, 0 to check the timeout
+ *                  only
+ * @return SDCARD_ERRORS_OK if the buffer can be used, an error otherwise.
+ */
+static SDCard_Errors SDCard_coalesceCheck (SDCard_Device* dev,
+                                           uint32_t blockAddress,
+                                           uint32_t count)
+{
+    if (dev->coalesceCount == 0)
+        return SDCARD_ERRORS_OK;
+
+    if ((blockAddress < (dev->coalesceAddress + dev->coalesceCount)) &&
+        (dev->coalesceAddress < (blockAddress + count)))
+        return SDCard_coalesceFlush(dev);
+
+    if ((dev->coalesceTimeout > 0) &&
+        ((dev->currentTime() - dev->coalesceStart) >= dev->coalesceTimeout))
+        return SDCard_coalesceFlush(dev);
+
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_coalesceService (SDCard_Device* dev)
+{
+    if ((dev->coalesceCount == 0) || (dev->coalesceTimeout == 0) ||
+        ((dev->currentTime() - dev->coalesceStart) < dev->coalesceTimeout))
+        return SDCARD_ERRORS_OK;
+
+    // Another operation uses the card, the buffer waits the next call
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+    return SDCard_coalesceFlush(dev);
+}
+
+void SDCard_getCoalesceStats (SDCard_Device* dev,
+                              SDCard_CoalesceStats* stats)
+{
+    *stats = dev->coalesceStats;
+}
+
+#endif
+
+/**
+ * The function writes one block, through the staging buffer when it is
+ * enabled.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to write
+ * @param[in] data
+ * @return SDCARD_ERRORS_OK if the block is written, an error otherwise.
+ */
+static SDCard_Errors SDCard_writeSector (SDCard_Device* dev,
+                                         uint32_t blockAddress,
+                                         const uint8_t* data)
+{
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    SDCard_Errors error;
+    uint32_t offset = blockAddress - dev->coalesceAddress;
+
+    error = SDCard_coalesceCheck(dev,blockAddress,0);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    // Start a new run when the block is neither into the buffer nor the next one
+    if ((offset > dev->coalesceCount) || (dev->coalesceCount == 0) ||
+        ((offset == dev->coalesceCount) && (dev->coalesceCount == WARCOMEB_SDCARD_COALESCE_SECTORS)))
+    {
+        error = SDCard_coalesceFlush(dev);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        dev->coalesceAddress = blockAddress;
+        dev->coalesceStart   = dev->currentTime();
+        offset = 0;
+    }
+
+    memcpy(dev->coalesce[offset],data,512);
+    if (offset == dev->coalesceCount)
+        dev->coalesceCount++;
+    dev->coalesceStats.writes++;
+
+    if (dev->coalesceCount == WARCOMEB_SDCARD_COALESCE_SECTORS)
+        return SDCard_coalesceFlush(dev);
+    return SDCARD_ERRORS_OK;
+#else
+    SDCard_Segment segment;
+
+    segment.data  = (uint8_t*) data;
+    segment.count = 1;
+    return SDCard_waitOperation(dev,SDCard_writeSegmentsAsync(dev,blockAddress,&segment,1,0,0));
+#endif
+}
+
+/**
+ * The function reads one block, through the staging buffer and the
+ * read-ahead buffer when they are enabled.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to read
+ * @param[out] data
+ * @return SDCARD_ERRORS_OK if the block is read, an error otherwise.
+ */
+static SDCard_Errors SDCard_readSector (SDCard_Device* dev,
+                                        uint32_t blockAddress,
+                                        uint8_t* data)
+{
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    SDCard_Errors error;
+    uint32_t offset;
+
+    error = SDCard_coalesceCheck(dev,blockAddress,0);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    offset = blockAddress - dev->coalesceAddress;
+    if (offset < dev->coalesceCount)
+    {
+        dev->coalesceStats.hits++;
+        memcpy(data,dev->coalesce[offset],512);
+        return SDCARD_ERRORS_OK;
+    }
+#endif
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    return SDCard_readAheadRead(dev,blockAddress,data);
+#else
+    return SDCard_waitOperation(dev,SDCard_readBlocksAsync(dev,blockAddress,data,1,0,0));
+#endif
+}
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+
+/**
+ * The function searches a block into the cache.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to search
+ * @return The cache line of the block, NULL if it is not cached.
+ */
+static SDCard_CacheLine* SDCard_cacheFind (SDCard_Device* dev,
+                                           uint32_t blockAddress)
+{
+    uint16_t i;
+
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if (dev->cache[i].isValid && (dev->cache[i].blockAddress == blockAddress))
+            return &dev->cache[i];
+    }
+    return 0;
+}
+
+/**
+ * The function frees a cache line, the least recently used one when the
+ * cache is full. A dirty line is written before to be evicted.
+ *
+ * @param[in] dev An handle of the device
+ * @param[out] line The free cache line
+ * @return SDCARD_ERRORS_OK if the line is free, an error otherwise.
+ */
+static SDCard_Errors SDCard_cacheEvict (SDCard_Device* dev,
+                                        SDCard_CacheLine** line)
+{
+    uint16_t i;
+    SDCard_Errors error;
+    SDCard_CacheLine* victim = &dev->cache[0];
+
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if (dev->cache[i].isValid == FALSE)
+        {
+            victim = &dev->cache[i];
+            break;
+        }
+        if (dev->cache[i].lastUse < victim->lastUse)
+            victim = &dev->cache[i];
+    }
+
+    if (victim->isValid)
+    {
+        dev->cacheStats.evictions++;
+        if (victim->isDirty)
+        {
+            error = SDCard_writeSector(dev,victim->blockAddress,victim->data);
+            if (error != SDCARD_ERRORS_OK)
+                return error;
+            dev->cacheStats.writeBacks++;
+        }
+    }
+
+    victim->isValid = FALSE;
+    victim->isDirty = FALSE;
+    *line = victim;
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function reads a block through the cache.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to read
+ * @param[out] data
+ * @return SDCARD_ERRORS_OK if the block is read, an error otherwise.
+ */
+static SDCard_Errors SDCard_cacheRead (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       uint8_t* data)
+{
+    SDCard_Errors error;
+    SDCard_CacheLine* line = SDCard_cacheFind(dev,blockAddress);
+
+    if (line != 0)
+    {
+        dev->cacheStats.hits++;
+    }
+    else
+    {
+        dev->cacheStats.misses++;
+        error = SDCard_cacheEvict(dev,&line);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        error = SDCard_readSector(dev,blockAddress,line->data);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        line->blockAddress = blockAddress;
+        line->isValid = TRUE;
+    }
+
+    line->lastUse = ++dev->cacheClock;
+    memcpy(data,line->data,512);
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function writes a block through the cache.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The block to write
+ * @param[in] data
+ * @return SDCARD_ERRORS_OK if the block is written, an error otherwise.
+ */
+static SDCard_Errors SDCard_cacheWrite (SDCard_Device* dev,
+                                        uint32_t blockAddress,
+                                        const uint8_t* data)
+{
+    SDCard_Errors error;
+    SDCard_CacheLine* line = SDCard_cacheFind(dev,blockAddress);
+
+    if (line == 0)
+    {
+        error = SDCard_cacheEvict(dev,&line);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+        line->blockAddress = blockAddress;
+    }
+
+    memcpy(line->data,data,512);
+    line->isValid = TRUE;
+    line->lastUse = ++dev->cacheClock;
+
+    if (dev->cacheMode == SDCARD_CACHEMODE_WRITE_BACK)
+    {
+        line->isDirty = TRUE;
+        return SDCARD_ERRORS_OK;
+    }
+
+    error = SDCard_writeSector(dev,blockAddress,line->data);
+    if (error != SDCARD_ERRORS_OK)
+        line->isValid = FALSE;
+    return error;
+}
+
+/**
+ * The function aligns the cache and a buffer of consecutive blocks just
+ * moved: after a read the dirty blocks are copied into the buffer, after
+ * a write the cached blocks are updated.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] blockAddress The first block of the buffer
+ * @param[in] data The buffer
+ * @param[in] count The number of blocks of the buffer
+ * @param[in] isWrite TRUE when the buffer was written to the card
+ */
+static void SDCard_cacheMerge (SDCard_Device* dev,
+                               uint32_t blockAddress,
+                               uint8_t* data,
+                               uint32_t count,
+                               bool isWrite)
+{
+    uint16_t i;
+    uint32_t offset;
+
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        offset = dev->cache[i].blockAddress - blockAddress;
+        if ((dev->cache[i].isValid == FALSE) || (offset >= count))
+            continue;
+
+        if (isWrite)
+        {
+            memcpy(dev->cache[i].data,&data[offset * 512],512);
+            dev->cache[i].isDirty = FALSE;
+        }
+        else if (dev->cache[i].isDirty)
+        {
+            memcpy(&data[offset * 512],dev->cache[i].data,512);
+        }
+    }
+}
+
+/**
+ * The function writes all dirty lines of the cache, the consecutive ones
+ * with one command.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_OK if all lines are written, an error otherwise.
+ */
+static SDCard_Errors SDCard_cacheFlush (SDCard_Device* dev)
+{
+    SDCard_CacheLine* dirty[WARCOMEB_SDCARD_CACHE_SECTORS];
+    SDCard_CacheLine* line;
+    SDCard_Segment segments[WARCOMEB_SDCARD_CACHE_SECTORS];
+    SDCard_Errors error;
+    uint16_t i, j, k, count = 0;
+
+    // Collect the dirty lines sorted by block address
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if ((dev->cache[i].isValid == FALSE) || (dev->cache[i].isDirty == FALSE))
+            continue;
+
+        line = &dev->cache[i];
+        for (j = count; (j > 0) && (dirty[j - 1]->blockAddress > line->blockAddress); --j)
+            dirty[j] = dirty[j - 1];
+        dirty[j] = line;
+        count++;
+    }
+
+    // Write each run of consecutive blocks with one command
+    for (i = 0; i < count; i = j)
+    {
+        for (j = i; (j < count) && (dirty[j]->blockAddress == (dirty[i]->blockAddress + (j - i))); ++j)
+        {
+            segments[j - i].data  = dirty[j]->data;
+            segments[j - i].count = 1;
+        }
+
+        error = SDCard_waitOperation(dev,SDCard_writeSegmentsAsync(dev,dirty[i]->blockAddress,segments,(j - i),0,0));
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        for (k = i; k < j; ++k)
+            dirty[k]->isDirty = FALSE;
+        dev->cacheStats.writeBacks += (j - i);
+    }
+
+    return SDCARD_ERRORS_OK;
+}
+
+void SDCard_getCacheStats (SDCard_Device* dev, SDCard_CacheStats* stats)
+{
+    *stats = dev->cacheStats;
+}
+
+void SDCard_resetCacheStats (SDCard_Device* dev)
+{
+    dev->cacheStats.hits       = 0;
+    dev->cacheStats.misses     = 0;
+    dev->cacheStats.evictions  = 0;
+    dev->cacheStats.writeBacks = 0;
+}
+
+#endif
+
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+SDCard_Errors SDCard_flush (SDCard_Device* dev)
+{
+    SDCard_Errors error = SDCARD_ERRORS_OK;
+
+    // The cache lines are newer than the staging buffer: they are written after
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    error = SDCard_coalesceFlush(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    error = SDCard_cacheFlush(dev);
+#endif
+    return error;
+}
+#endif
+
+SDCard_Errors SDCard_init (SDCard_Device* dev)
+{
+    return SDCard_waitOperation(dev,SDCard_initAsync(dev,0,0));
+}
+
+SDCard_Errors SDCard_reinit (SDCard_Device* dev)
+{
+    return SDCard_waitOperation(dev,SDCard_reinitAsync(dev,0,0));
+}
+
+SDCard_Errors SDCard_writeBlock (SDCard_Device* dev,
+                                 uint32_t blockAddress,
+                                 const uint8_t* data)
+{
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    return SDCard_cacheWrite(dev,blockAddress,data);
+#else
+    return SDCard_writeSector(dev,blockAddress,data);
+#endif
+}
+
+SDCard_Errors SDCard_writeBlocks (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  const uint8_t* data,
+                                  uint8_t count)
+{
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    SDCard_Errors error;
+#endif
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_Segment segment;
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The buffered blocks are older, they are written before
+    error = SDCard_coalesceCheck(dev,blockAddress,count);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    segment.data  = (uint8_t*) data;
+    segment.count = count;
+    error = SDCard_waitOperation(dev,SDCard_writeSegmentsAsync(dev,blockAddress,&segment,count,0,0));
+    if (error == SDCARD_ERRORS_OK)
+        SDCard_cacheMerge(dev,blockAddress,(uint8_t*) data,count,TRUE);
+    return error;
+#else
+    return SDCard_waitOperation(dev,SDCard_writeBlocksAsync(dev,blockAddress,data,count,0,0));
+#endif
+}
+
+SDCard_Errors SDCard_readBlock (SDCard_Device* dev,
+                                uint32_t blockAddress,
+                                uint8_t* data)
+{
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    return SDCard_cacheRead(dev,blockAddress,data);
+#else
+    return SDCard_readSector(dev,blockAddress,data);
+#endif
+}
+
+SDCard_Errors SDCard_readBlocks (SDCard_Device* dev,
+                                 uint32_t blockAddress,
+                                 uint8_t* data,
+                                 uint8_t count)
+{
+    SDCard_Errors error;
+
+    error = SDCard_waitOperation(dev,SDCard_readBlocksAsync(dev,blockAddress,data,count,0,0));
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    if (error == SDCARD_ERRORS_OK)
+        SDCard_cacheMerge(dev,blockAddress,data,count,FALSE);
+#endif
+    return error;
+}
+
+SDCard_Errors SDCard_readRange (SDCard_Device* dev,
+                                uint32_t blockAddress,
+                                uint32_t offset,
+                                uint32_t length,
+                                uint8_t* data)
+{
+    SDCard_Errors error;
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    uint16_t i;
+#endif
+
+    // The staging buffer is merged at the end of the asynchronous read
+    error = SDCard_waitOperation(dev,SDCard_readRangeAsync(dev,blockAddress,offset,length,data,0,0));
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    // The blocks not written yet are newer than the card
+    blockAddress += offset / 512;
+    offset       %= 512;
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if ((dev->cache[i].isValid == TRUE) && (dev->cache[i].isDirty == TRUE))
+            SDCard_rangeMerge(dev->cache[i].blockAddress - blockAddress,dev->cache[i].data,offset,length,data);
+    }
+#endif
+    return error;
+}
+
+SDCard_Errors SDCard_readv (SDCard_Device* dev,
+                            uint32_t blockAddress,
+                            const SDCard_Segment* segments,
+                            uint32_t segmentCount)
+{
+    SDCard_Errors error;
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    uint32_t i;
+#endif
+
+    // The staging buffer is merged at the end of the asynchronous read
+    error = SDCard_waitOperation(dev,SDCard_readvAsync(dev,blockAddress,segments,segmentCount,0,0));
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    for (i = 0; i < segmentCount; ++i)
+    {
+        SDCard_cacheMerge(dev,blockAddress,segments[i].data,segments[i].count,FALSE);
+        blockAddress += segments[i].count;
+    }
+#endif
+    return error;
+}
+
+SDCard_Errors SDCard_writev (SDCard_Device* dev,
+                             uint32_t blockAddress,
+                             const SDCard_Segment* segments,
+                             uint32_t segmentCount)
+{
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    SDCard_Errors error;
+    uint32_t count = SDCard_countSegments(segments,segmentCount);
+#endif
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    uint32_t i;
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The buffered blocks are older, they are written before
+    error = SDCard_coalesceCheck(dev,blockAddress,count);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    if (count == 0)
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+    error = SDCard_waitOperation(dev,SDCard_writeSegmentsAsync(dev,blockAddress,segments,count,0,0));
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    // The cache lines of these blocks take the new data
+    for (i = 0; i < segmentCount; ++i)
+    {
+        SDCard_cacheMerge(dev,blockAddress,segments[i].data,segments[i].count,TRUE);
+        blockAddress += segments[i].count;
+    }
+    return error;
+#else
+    return SDCard_waitOperation(dev,SDCard_writevAsync(dev,blockAddress,segments,segmentCount,0,0));
+#endif
+}
+
+SDCard_Errors SDCard_eraseBlocks (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  uint32_t count)
+{
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    SDCard_Errors error = SDCard_coalesceCheck(dev,blockAddress,count);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+    return SDCard_waitOperation(dev,SDCard_eraseBlocksAsync(dev,blockAddress,count,0,0));
+}
+
+SDCard_Errors SDCard_getSectorCount (SDCard_Device* dev,
+                                     uint32_t* size)
+{
+    // The CSD is read by the initialization
+    if (dev->isInit == TRUE)
+    {
+        *size = dev->info.sectorCount;
+        return SDCARD_ERRORS_OK;
+    }
+
+    return SDCard_waitOperation(dev,SDCard_getSectorCountAsync(dev,size,0,0));
+}
+
+SDCard_Errors SDCard_beginRead (SDCard_Device* dev,
+                                uint32_t blockAddress)
+{
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    // The session reads the card directly
+    SDCard_Errors error = SDCard_flush(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+    // The CMD18 is sent with the first block
+    dev->streamMode    = SDCARD_TRANSFER_READ;
+    dev->streamAddress = blockAddress;
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_readNext (SDCard_Device* dev,
+                               uint8_t* data)
+{
+    SDCard_Errors error;
+    SDCard_Segment segment;
+
+    if (dev->streamMode != SDCARD_TRANSFER_READ)
+        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    segment.data  = data;
+    segment.count = 1;
+    if ((dev->asyncOpen == SDCARD_TRANSFER_READ) && (dev->asyncNext == dev->streamAddress))
+    {
+        error = SDCard_continueReadAsync(dev,&segment,1);
+    }
+    else
+    {
+        // The CMD18 of the session is opened again when another operation
+        // has stopped it
+        dev->asyncSegment = 0;
+        dev->asyncData    = data;
+        error = SDCard_startRead(dev,dev->streamAddress,1,0,0);
+        if (error == SDCARD_ERRORS_OK)
+        {
+            dev->asyncMultiple = TRUE;
+            dev->asyncKeepOpen = TRUE;
+            dev->asyncNext     = dev->streamAddress + 1;
+        }
+    }
+
+    error = SDCard_waitOperation(dev,error);
+    if (error == SDCARD_ERRORS_OK)
+        dev->streamAddress++;
+    return error;
+}
+
+SDCard_Errors SDCard_endRead (SDCard_Device* dev)
+{
+    if (dev->streamMode != SDCARD_TRANSFER_READ)
+        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->streamMode = SDCARD_TRANSFER_NONE;
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    // Otherwise the CMD18 is stopped by the next operation of the card
+    if (SDCard_busOwn(dev,FALSE) == FALSE)
+        return SDCARD_ERRORS_OK;
+#endif
+    if (dev->asyncNext == dev->streamAddress)
+        SDCard_stopRead(dev);
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    if (dev->bus != 0)
+        SDCard_busRelease(dev->bus,dev->busUser);
+#endif
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_beginWrite (SDCard_Device* dev,
+                                 uint32_t blockAddress)
+{
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    // The buffered and dirty cached blocks are older, they are written
+    // before: an eviction would fail while the CMD25 is open
+    SDCard_Errors error = SDCard_flush(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+        return SDCARD_ERRORS_BUSY;
+
+    // The CMD25 is sent with the first block
+    dev->streamMode    = SDCARD_TRANSFER_WRITE;
+    dev->streamAddress = blockAddress;
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_writeNext (SDCard_Device* dev,
+                                const uint8_t* data)
+{
+    SDCard_Errors error;
+
+    if (dev->streamMode != SDCARD_TRANSFER_WRITE)
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_cacheInvalidate(dev,dev->streamAddress,1);
+#endif
+
+    // The first block opens the CMD25
+    if (dev->asyncOpen == SDCARD_TRANSFER_WRITE)
+        error = SDCard_continueWriteAsync(dev,data,1,0,0);
+    else
+        error = SDCard_openWriteAsync(dev,dev->streamAddress,data,1,0,0,0);
+
+    error = SDCard_waitOperation(dev,error);
+    if (error == SDCARD_ERRORS_OK)
+        dev->streamAddress++;
+    return error;
+}
+
+SDCard_Errors SDCard_endWrite (SDCard_Device* dev)
+{
+    if (dev->streamMode != SDCARD_TRANSFER_WRITE)
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return SDCARD_ERRORS_BUSY;
+
+    dev->streamMode = SDCARD_TRANSFER_NONE;
+    return SDCard_closeWrite(dev);
+}
+
+#ifdef WARCOMEB_SDCARD_LOGGER_BUFFERS
+
+#define SDCARD_LOGGER_SIZE (WARCOMEB_SDCARD_LOGGER_SECTORS * 512)
+
+SDCard_Errors SDCard_startLogger (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  uint32_t count)
+{
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    SDCard_Errors error;
+#endif
+
+    // The area must be inside the card
+    if ((blockAddress >= dev->info.sectorCount) ||
+        (count > (dev->info.sectorCount - blockAddress)))
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+    // The sectors buffered are older, they are written before
+    error = SDCard_flush(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+#endif
+
+    if ((dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE) ||
+        (dev->loggerRunning == TRUE))
+        return SDCARD_ERRORS_BUSY;
+
+    if (count == 0)
+        count = dev->info.sectorCount - blockAddress;
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_cacheInvalidate(dev,blockAddress,count);
+#endif
+
+    memset(&dev->loggerStats,0,sizeof(SDCard_LoggerStats));
+    dev->loggerFilled  = 0;
+    dev->loggerWritten = 0;
+    dev->loggerLength  = 0;
+    dev->loggerAddress = blockAddress;
+    dev->loggerEnd     = blockAddress + count;
+    dev->loggerError   = SDCARD_ERRORS_OK;
+    dev->loggerRunning = TRUE;
+    return SDCARD_ERRORS_OK;
+}
+
+uint32_t SDCard_loggerPut (SDCard_Device* dev,
+                           const uint8_t* data,
+                           uint32_t length)
+{
+    uint32_t done = 0, space;
+    uint8_t* buffer;
+
+    if (dev->loggerRunning == FALSE)
+        return 0;
+
+    // Only the producer changes loggerFilled and only the service changes
+    // loggerWritten: the difference is the number of buffers full
+    while (done < length)
+    {
+        if ((dev->loggerFilled - dev->loggerWritten) >= WARCOMEB_SDCARD_LOGGER_BUFFERS)
+        {
+            dev->loggerStats.overruns++;
+            dev->loggerStats.lost += length - done;
+            break;
+        }
+
+        buffer = dev->logger[dev->loggerFilled % WARCOMEB_SDCARD_LOGGER_BUFFERS];
+        space = SDCARD_LOGGER_SIZE - dev->loggerLength;
+        if (space > length - done)
+            space = length - done;
+        memcpy(&buffer[dev->loggerLength],&data[done],space);
+        dev->loggerLength += space;
+        done += space;
+
+        if (dev->loggerLength == SDCARD_LOGGER_SIZE)
+        {
+            // The buffer is given to the service
+            dev->loggerLength = 0;
+            dev->loggerFilled++;
+            if ((dev->loggerFilled - dev->loggerWritten) > dev->loggerStats.maxUsed)
+                dev->loggerStats.maxUsed = (uint8_t) (dev->loggerFilled - dev->loggerWritten);
+        }
+    }
+    return done;
+}
+
+/**
+ * The function is called at the end of the writing of a buffer.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] error The result of the writing
+ * @param[in] context Not used
+ */
+static void SDCard_loggerDone (SDCard_Device* dev,
+                               SDCard_Errors error,
+                               void* context)
+{
+    uint32_t duration = dev->currentTime() - dev->loggerStart;
+
+    (void) context;
+    if (error != SDCARD_ERRORS_OK)
+    {
+        dev->loggerError = error;
+        return;
+    }
+
+    dev->loggerAddress += WARCOMEB_SDCARD_LOGGER_SECTORS;
+    dev->loggerStats.blocks += WARCOMEB_SDCARD_LOGGER_SECTORS;
+    dev->loggerStats.buffers++;
+    if (duration > dev->loggerStats.maxWrite)
+        dev->loggerStats.maxWrite = duration;
+    // The buffer is free for the producer
+    dev->loggerWritten++;
+}
+
+SDCard_Errors SDCard_loggerService (SDCard_Device* dev)
+{
+    const uint8_t* buffer;
+    SDCard_Errors error;
+
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+    {
+        SDCard_poll(dev);
+        return (dev->loggerError != SDCARD_ERRORS_OK) ? dev->loggerError :
+                                                         SDCARD_ERRORS_BUSY;
+    }
+
+    if (dev->loggerError != SDCARD_ERRORS_OK)
+        return dev->loggerError;
+    if (dev->loggerFilled == dev->loggerWritten)
+        return SDCARD_ERRORS_OK;
+    if (dev->loggerAddress + WARCOMEB_SDCARD_LOGGER_SECTORS > dev->loggerEnd)
+    {
+        dev->loggerError = SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+        return dev->loggerError;
+    }
+
+    buffer = dev->logger[dev->loggerWritten % WARCOMEB_SDCARD_LOGGER_BUFFERS];
+    dev->loggerStart = dev->currentTime();
+    if (dev->asyncOpen == SDCARD_TRANSFER_WRITE)
+        error = SDCard_continueWriteAsync(dev,buffer,WARCOMEB_SDCARD_LOGGER_SECTORS,SDCard_loggerDone,0);
+    else
+        error = SDCard_openWriteAsync(dev,dev->loggerAddress,buffer,WARCOMEB_SDCARD_LOGGER_SECTORS,0,SDCard_loggerDone,0);
+
+    return (error == SDCARD_ERRORS_OK) ? SDCARD_ERRORS_BUSY : error;
+}
+
+SDCard_Errors SDCard_stopLogger (SDCard_Device* dev, uint32_t* blocks)
+{
+    SDCard_Errors error;
+    uint8_t* buffer;
+    uint32_t count;
+
+    if (dev->loggerRunning == FALSE)
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+    dev->loggerRunning = FALSE;
+
+    // The buffers full are written first
+    do
+    {
+        error = SDCard_loggerService(dev);
+    }
+    while ((error == SDCARD_ERRORS_BUSY) ||
+           ((error == SDCARD_ERRORS_OK) && (dev->loggerFilled != dev->loggerWritten)));
+
+    // Then the sectors used of the last buffer
+    count = (dev->loggerLength + 511) / 512;
+    if ((error == SDCARD_ERRORS_OK) && (count > 0))
+    {
+        if (dev->loggerAddress + count > dev->loggerEnd)
+        {
+            error = SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+        }
+        else
+        {
+            buffer = dev->logger[dev->loggerFilled % WARCOMEB_SDCARD_LOGGER_BUFFERS];
+            memset(&buffer[dev->loggerLength],0,count * 512 - dev->loggerLength);
+            if (dev->asyncOpen == SDCARD_TRANSFER_WRITE)
+                error = SDCard_continueWriteAsync(dev,buffer,count,0,0);
+            else
+                error = SDCard_openWriteAsync(dev,dev->loggerAddress,buffer,count,0,0,0);
+            error = SDCard_waitOperation(dev,error);
+            if (error == SDCARD_ERRORS_OK)
+            {
+                dev->loggerAddress += count;
+                dev->loggerStats.blocks += count;
+            }
+        }
+    }
+    dev->loggerLength = 0;
+
+    // Close the CMD25 also after an error
+    if ((SDCard_closeWrite(dev) != SDCARD_ERRORS_OK) && (error == SDCARD_ERRORS_OK))
+        error = SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+
+    if (blocks != 0)
+        *blocks = dev->loggerStats.blocks;
+    return error;
+}
+
+void SDCard_getLoggerStats (SDCard_Device* dev,
+                            SDCard_LoggerStats* stats)
+{
+    *stats = dev->loggerStats;
+}
+
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+
+#define SDCARD_DISCARD_UNIT 8192 // [sectors], without the AU size of SD Status
+
+/**
+ * The function is called at the end of the erase command of the discard
+ * queue, the card is still erasing.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] error The result of the command
+ * @param[in] context Not used
+ */
+static void SDCard_discardDone (SDCard_Device* dev,
+                                SDCard_Errors error,
+                                void* context)
+{
+    (void) context;
+
+    if (error != SDCARD_ERRORS_OK)
+    {
+        // The range is already out of the queue
+        dev->discardBusy = FALSE;
+        dev->discardStats.dropped += dev->asyncCount;
+        return;
+    }
+
+    dev->discardStats.erases++;
+    dev->discardStats.erased += dev->asyncCount;
+}
+
+SDCard_Errors SDCard_discardBlocks (SDCard_Device* dev,
+                                    uint32_t blockAddress,
+                                    uint32_t count)
+{
+    SDCard_DiscardRange* range;
+    uint32_t end = blockAddress + count;
+    uint8_t i = 0, smallest;
+
+    if (count == 0)
+        return SDCARD_ERRORS_OK;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    // The data of these blocks isn't needed anymore, also when dirty
+    SDCard_cacheInvalidate(dev,blockAddress,count);
+#endif
+
+    dev->discardStats.queued += count;
+    while (i < dev->discardCount)
+    {
+        range = &dev->discard[i];
+        if ((range->blockAddress <= end) &&
+            (blockAddress <= (range->blockAddress + range->count)))
+        {
+            // Adjacent or overlapping, the new range takes it
+            if (range->blockAddress < blockAddress)
+                blockAddress = range->blockAddress;
+            if ((range->blockAddress + range->count) > end)
+                end = range->blockAddress + range->count;
+            *range = dev->discard[--dev->discardCount];
+            dev->discardStats.merged++;
+        }
+        else
+        {
+            ++i;
+        }
+    }
+
+    if (dev->discardCount < WARCOMEB_SDCARD_DISCARD_RANGES)
+    {
+        range = &dev->discard[dev->discardCount++];
+    }
+    else
+    {
+        // The queue is full, the smallest range is forgotten
+        smallest = 0;
+        for (i = 1; i < dev->discardCount; ++i)
+        {
+            if (dev->discard[i].count < dev->discard[smallest].count)
+                smallest = i;
+        }
+        if (dev->discard[smallest].count >= (end - blockAddress))
+        {
+            dev->discardStats.dropped += end - blockAddress;
+            return SDCARD_ERRORS_OK;
+        }
+        range = &dev->discard[smallest];
+        dev->discardStats.dropped += range->count;
+    }
+
+    range->blockAddress = blockAddress;
+    range->count        = end - blockAddress;
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_discardService (SDCard_Device* dev)
+{
+    SDCard_DiscardRange* range;
+    uint32_t unit = (dev->info.auSize != 0) ? dev->info.auSize : SDCARD_DISCARD_UNIT;
+    uint32_t first;
+    uint8_t i;
+
+    // Each call looks for the end of the last erase, for its eraseTime
+    if (dev->discardBusy == TRUE)
+        SDCard_isBusy(dev);
 
-    if (dev->isSDHC)
+    if (dev->discardCount == 0)
+        return SDCARD_ERRORS_OK;
+
+    // Only when the device is idle since discardIdle and the card is ready
+    if ((dev->isInit == FALSE) ||
+        (dev->asyncState != SDCARD_ASYNCSTATE_IDLE) ||
+        (dev->asyncOpen == SDCARD_TRANSFER_WRITE) ||
+        (SDCard_isBusy(dev) == TRUE) ||
+        ((dev->currentTime() - dev->discardLast) < dev->discardIdle))
     {
-        SDCard_sendCommand(dev,SDCARD_COMMAND_55,0,&response);
-        SDCard_sendCommand(dev,SDCARD_COMMAND_A23,count,&response);
+        dev->discardStats.deferred++;
+        return SDCARD_ERRORS_BUSY;
+    }
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    // The blocks not written yet are newer than their discard
+    if (dev->coalesceCount > 0)
+        SDCard_discardRemove(dev,dev->coalesceAddress,dev->coalesceCount);
+#endif
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    for (i = 0; i < WARCOMEB_SDCARD_CACHE_SECTORS; ++i)
+    {
+        if ((dev->cache[i].isValid == TRUE) && (dev->cache[i].isDirty == TRUE))
+            SDCard_discardRemove(dev,dev->cache[i].blockAddress,1);
+    }
+#endif
+
+    // Only whole units are erased, the other blocks wait for a merge
+    for (i = 0; i < dev->discardCount; ++i)
+    {
+        range = &dev->discard[i];
+        first = ((range->blockAddress + unit - 1) / unit) * unit;
+        if ((first + unit) <= (range->blockAddress + range->count))
+        {
+            dev->discardBusy = TRUE;
+            return SDCard_eraseBlocksAsync(dev,first,unit,SDCard_discardDone,0);
+        }
+    }
+
+    return SDCARD_ERRORS_OK;
+}
+
+void SDCard_getDiscardStats (SDCard_Device* dev,
+                             SDCard_DiscardStats* stats)
+{
+    *stats = dev->discardStats;
+}
+
+#endif
+
+#ifdef WARCOMEB_SDCARD_QUEUE_CLIENTS
+
+/**
+ * The function takes the exclusive access to the pending requests.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_queueLock (SDCard_Device* dev)
+{
+    if (dev->lock != 0)
+        dev->lock(dev);
+}
+
+/**
+ * The function releases the exclusive access to the pending requests.
+ *
+ * @param[in] dev An handle of the device
+ */
+static void SDCard_queueUnlock (SDCard_Device* dev)
+{
+    if (dev->unlock != 0)
+        dev->unlock(dev);
+}
+
+/**
+ * The function checks if a pending request must wait an older one: they
+ * overlap and at least one of them is a write.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] request The pending request
+ * @return TRUE if the request can't be moved before the older ones.
+ */
+static bool SDCard_queueIsBlocked (SDCard_Device* dev,
+                                   const SDCard_Request* request)
+{
+    const SDCard_Request* older;
+
+    for (older = dev->queuePending; older != request; older = older->next)
+    {
+        if (((older->isWrite == TRUE) || (request->isWrite == TRUE)) &&
+            (older->blockAddress < (request->blockAddress + request->count)) &&
+            (request->blockAddress < (older->blockAddress + older->count)))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * The function removes a request from the pending list.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] request The pending request
+ */
+static void SDCard_queueUnlink (SDCard_Device* dev, SDCard_Request* request)
+{
+    SDCard_Request** link = &dev->queuePending;
+
+    while (*link != request)
+        link = &(*link)->next;
+    *link = request->next;
+    request->next = 0;
+}
+
+/**
+ * The function chooses the next pending request: the oldest one when it
+ * waits since queueDeadline, otherwise the first one from queueHead in
+ * ascending order of block, starting again from the lowest block at the
+ * end of the card.
+ *
+ * @param[in] dev An handle of the device
+ * @return The request, out of the pending list, or 0 when it is empty.
+ */
+static SDCard_Request* SDCard_queuePick (SDCard_Device* dev)
+{
+    SDCard_Request* request = dev->queuePending;
+    SDCard_Request* next = 0;
+    SDCard_Request* lowest = 0;
+
+    if (request == 0)
+        return 0;
+
+    if ((dev->queueDeadline != 0) &&
+        ((dev->currentTime() - request->submitTime) >= dev->queueDeadline))
+    {
+        next = request;
+    }
+    else
+    {
+        for (; request != 0; request = request->next)
+        {
+            if (SDCard_queueIsBlocked(dev,request) == TRUE)
+                continue;
+
+            if ((request->blockAddress >= dev->queueHead) &&
+                ((next == 0) || (request->blockAddress < next->blockAddress)))
+                next = request;
+            if ((lowest == 0) || (request->blockAddress < lowest->blockAddress))
+                lowest = request;
+        }
+        // The oldest request is never blocked, so lowest exists
+        if (next == 0)
+            next = lowest;
+    }
+
+    SDCard_queueUnlink(dev,next);
+    return next;
+}
+
+/**
+ * The function is called at the end of the command of the requests
+ * running, it ends all of them with the same result.
+ *
+ * @param[in] dev An handle of the device
+ * @param[in] error The result of the command
+ * @param[in] context Not used
+ */
+static void SDCard_queueDone (SDCard_Device* dev,
+                              SDCard_Errors error,
+                              void* context)
+{
+    SDCard_Request* request = dev->queueActive;
+    SDCard_Request* next;
+    SDCard_QueueStats* stats;
+    SDCard_Callback callback;
+    uint32_t latency;
+    uint32_t now = dev->currentTime();
+    bool merged = (request->next != 0) ? TRUE : FALSE;
+
+    (void) context;
+    dev->queueActive = 0;
+    while (request != 0)
+    {
+        latency = now - request->submitTime;
+        stats = &dev->queueStats[request->client];
+        stats->requests++;
+        stats->blocks += request->count;
+        if (merged == TRUE)
+            stats->merged++;
+        stats->totalLatency += latency;
+        if (latency > stats->maxLatency)
+            stats->maxLatency = latency;
+
+        // The client can use the request again as soon as the result is set
+        next     = request->next;
+        callback = request->callback;
+        context  = request->context;
+        request->result = error;
+        if (callback != 0)
+            callback(dev,error,context);
+        request = next;
+    }
+}
+
+SDCard_Errors SDCard_submit (SDCard_Device* dev, SDCard_Request* request)
+{
+    SDCard_Request** link = &dev->queuePending;
+
+    if ((request->count == 0) || (request->client >= WARCOMEB_SDCARD_QUEUE_CLIENTS))
+        return (request->isWrite == TRUE) ? SDCARD_ERRORS_WRITE_BLOCKS_FAILED :
+                                            SDCARD_ERRORS_READ_BLOCKS_FAILED;
+
+    request->result     = SDCARD_ERRORS_BUSY;
+    request->submitTime = dev->currentTime();
+    request->next       = 0;
+
+    SDCard_queueLock(dev);
+    while (*link != 0)
+        link = &(*link)->next;
+    *link = request;
+    SDCard_queueUnlock(dev);
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_queueService (SDCard_Device* dev)
+{
+    SDCard_Request* request;
+    SDCard_Request* last;
+    SDCard_Request* next;
+    SDCard_Errors error;
+    uint32_t end;
+    uint8_t count;
+
+    // The requests running, or an operation started out of the queue
+    if ((dev->queueActive != 0) || (dev->asyncState != SDCARD_ASYNCSTATE_IDLE))
+    {
+        SDCard_poll(dev);
+        return SDCARD_ERRORS_BUSY;
+    }
+
+    // The list is read under the lock too, a client can be adding to it.
+    // The logger, or a session, holds the card
+    SDCard_queueLock(dev);
+    if ((dev->queuePending == 0) || (dev->asyncOpen == SDCARD_TRANSFER_WRITE))
+    {
+        error = (dev->queuePending == 0) ? SDCARD_ERRORS_OK : SDCARD_ERRORS_BUSY;
+        SDCard_queueUnlock(dev);
+        return error;
+    }
+
+    request = SDCard_queuePick(dev);
+    dev->queueSegments[0].data  = request->data;
+    dev->queueSegments[0].count = request->count;
+    end   = request->blockAddress + request->count;
+    last  = request;
+    count = 1;
+
+    // The requests that follow go with the same command
+    next = dev->queuePending;
+    while ((next != 0) && (count < WARCOMEB_SDCARD_QUEUE_MERGE))
+    {
+        if ((next->blockAddress == end) &&
+            (next->isWrite == request->isWrite) &&
+            (SDCard_queueIsBlocked(dev,next) == FALSE))
+        {
+            SDCard_queueUnlink(dev,next);
+            last->next = next;
+            last = next;
+            dev->queueSegments[count].data  = next->data;
+            dev->queueSegments[count].count = next->count;
+            end += next->count;
+            count++;
+            // The next one can be anywhere in the list
+            next = dev->queuePending;
+        }
+        else
+        {
+            next = next->next;
+        }
+    }
+    SDCard_queueUnlock(dev);
+
+    dev->queueActive = request;
+    dev->queueHead   = end;
+    dev->queueTransfers++;
+    if (request->isWrite == TRUE)
+        error = SDCard_writevAsync(dev,request->blockAddress,dev->queueSegments,count,SDCard_queueDone,0);
+    else
+        error = SDCard_readvAsync(dev,request->blockAddress,dev->queueSegments,count,SDCard_queueDone,0);
+
+    if (error != SDCARD_ERRORS_OK)
+        SDCard_queueDone(dev,error,0);
+    return SDCARD_ERRORS_BUSY;
+}
+
+void SDCard_getQueueStats (SDCard_Device* dev,
+                           uint8_t client,
+                           SDCard_QueueStats* stats)
+{
+    *stats = dev->queueStats[client];
+}
+
+#endif
+
+#ifdef WARCOMEB_SDCARD_METRICS
+void SDCard_getMetrics (SDCard_Device* dev, SDCard_Metrics* metrics)
+{
+    *metrics = dev->metrics;
+}
+
+void SDCard_resetMetrics (SDCard_Device* dev)
+{
+    memset(&dev->metrics,0,sizeof(SDCard_Metrics));
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+uint32_t SDCard_traceRead (SDCard_Device* dev,
+                           SDCard_TraceEvent* events,
+                           uint32_t count)
+{
+    uint32_t head = dev->traceHead;
+    uint32_t tail = dev->traceTail;
+    uint32_t overwritten;
+    uint32_t i;
+
+    // The oldest events are lost, the slot of the next one can be under
+    // writing
+    if ((head - tail) >= WARCOMEB_SDCARD_TRACE_EVENTS)
+    {
+        dev->traceLost += head - tail - WARCOMEB_SDCARD_TRACE_EVENTS + 1;
+        tail = head - WARCOMEB_SDCARD_TRACE_EVENTS + 1;
     }
+    if (count > (head - tail))
+        count = head - tail;
+
+    for (i = 0; i < count; ++i)
+        events[i] = dev->trace[(tail + i) & (WARCOMEB_SDCARD_TRACE_EVENTS - 1)];
+
+    // The events overwritten while they were copied are not valid
+    head = dev->traceHead;
+    overwritten = 0;
+    if ((head - tail) >= WARCOMEB_SDCARD_TRACE_EVENTS)
+    {
+        overwritten = head - tail - WARCOMEB_SDCARD_TRACE_EVENTS + 1;
+        if (overwritten > count)
+            overwritten = count;
+        memmove(events,&events[overwritten],(count - overwritten) * sizeof(SDCard_TraceEvent));
+        dev->traceLost += overwritten;
+    }
+
+    dev->traceTail = tail + count;
+    return count - overwritten;
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+bool SDCard_busAttach (SDCard_Device* dev, SDCard_Bus* bus)
+{
+    uint8_t user = SDCard_busAddUser(bus);
+
+    if (user == 0)
+        return FALSE;
+
+    bus->cards[user - 1] = dev;
+    dev->bus        = bus;
+    dev->busUser    = user;
+    dev->busPending = FALSE;
+    dev->busYielded = FALSE;
+    dev->device     = bus->device;
+    // The card must not answer to the other users
+    Gpio_config(dev->csPin,GPIO_PINS_OUTPUT);
+    Gpio_set(dev->csPin);
+    return TRUE;
+}
+
+uint8_t SDCard_busAddUser (SDCard_Bus* bus)
+{
+    if (bus->users >= SDCARD_BUS_USERS)
+        return 0;
+
+    bus->users++;
+    bus->cards[bus->users - 1] = 0;
+    return bus->users;
+}
+
+bool SDCard_busAcquire (SDCard_Bus* bus, uint8_t user)
+{
+    return SDCard_busTake(bus,user,TRUE);
+}
+
+void SDCard_busRelease (SDCard_Bus* bus, uint8_t user)
+{
+    uint8_t i, next;
+
+    if (bus->lock != 0)
+        bus->lock(bus);
+
+    if (bus->owner == user)
+    {
+        bus->owner = 0;
+        // The bus passes to the first user waiting after this one
+        for (i = 0; i < SDCARD_BUS_USERS; ++i)
+        {
+            next = (user + i) % SDCARD_BUS_USERS;
+            if ((bus->waiting & (1 << next)) != 0)
+            {
+                bus->waiting &= ~(1 << next);
+                bus->owner = next + 1;
+                bus->handovers++;
+                break;
+            }
+        }
+    }
+
+    if (bus->unlock != 0)
+        bus->unlock(bus);
+}
+#endif
+
+#ifdef WARCOMEB_SDCARD_ARRAY_CARDS
+/**
+ * The function starts the commands of the cards with at least one segment,
+ * and polls them together until all are ended. Each card is started also
+ * when another one fails, so every card used has its own result.
+ *
+ * @param[in] array An handle of the array
+ * @param[in] isWrite TRUE for write the segments, FALSE for read them
+ * @param[in] address The first block of each card
+ * @param[in] used The segments of each card
+ * @param[out] results The result of each card, OK for a card not used
+ * @return SDCARD_ERRORS_OK if all commands are ended without error, the
+ *         first error otherwise.
+ */
+static SDCard_Errors SDCard_arrayRun (SDCard_Array* array,
+                                      bool isWrite,
+                                      const uint32_t* address,
+                                      const uint8_t* used,
+                                      SDCard_Errors* results)
+{
+    SDCard_Errors error = SDCARD_ERRORS_OK;
+    bool started[WARCOMEB_SDCARD_ARRAY_CARDS];
+    bool running;
+    uint8_t i;
+
+    for (i = 0; i < array->count; ++i)
+    {
+        started[i] = FALSE;
+        results[i] = SDCARD_ERRORS_OK;
+        if (used[i] == 0)
+            continue;
+
+        if (isWrite == TRUE)
+            results[i] = SDCard_writevAsync(array->cards[i],address[i],array->segments[i],used[i],0,0);
+        else
+            results[i] = SDCard_readvAsync(array->cards[i],address[i],array->segments[i],used[i],0,0);
+        // A card refused keeps its error, also SDCARD_ERRORS_BUSY
+        if (results[i] == SDCARD_ERRORS_OK)
+        {
+            started[i] = TRUE;
+            array->stats.transfers++;
+        }
+        else if (error == SDCARD_ERRORS_OK)
+        {
+            error = results[i];
+        }
+    }
+
+    // The commands already started are waited also after an error
+    do
+    {
+        running = FALSE;
+        for (i = 0; i < array->count; ++i)
+        {
+            if (started[i] == FALSE)
+                continue;
+
+            results[i] = SDCard_poll(array->cards[i]);
+            if (results[i] == SDCARD_ERRORS_BUSY)
+            {
+                running = TRUE;
+                continue;
+            }
+            started[i] = FALSE;
+            if (error == SDCARD_ERRORS_OK)
+                error = results[i];
+        }
+    } while (running == TRUE);
+
+    return error;
+}
+
+/**
+ * The function moves the blocks of the striped array: each round gives to
+ * every card its chunks, up to WARCOMEB_SDCARD_ARRAY_SEGMENTS, that are
+ * consecutive on the card.
+ *
+ * @param[in] array An handle of the array
+ * @param[in] isWrite TRUE for write the blocks, FALSE for read them
+ * @param[in] blockAddress The first block of the array
+ * @param[in] data The buffer of count sectors
+ * @param[in] count The number of blocks
+ * @return SDCARD_ERRORS_OK if the blocks are moved, an error otherwise.
+ */
+static SDCard_Errors SDCard_arrayStripe (SDCard_Array* array,
+                                         bool isWrite,
+                                         uint32_t blockAddress,
+                                         uint8_t* data,
+                                         uint32_t count)
+{
+    SDCard_Errors error;
+    SDCard_Errors results[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t address[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t blocks[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint8_t used[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t stripe, offset, length;
+    uint8_t card;
+
+    while (count > 0)
+    {
+        memset(used,0,sizeof(used));
+        memset(blocks,0,sizeof(blocks));
+        while (count > 0)
+        {
+            stripe = blockAddress / array->chunk;
+            offset = blockAddress % array->chunk;
+            card   = stripe % array->count;
+            if (used[card] == WARCOMEB_SDCARD_ARRAY_SEGMENTS)
+                break;
+
+            length = array->chunk - offset;
+            if (length > count)
+                length = count;
+            if (used[card] == 0)
+                address[card] = (stripe / array->count) * array->chunk + offset;
+            array->segments[card][used[card]].data  = data;
+            array->segments[card][used[card]].count = length;
+            used[card]++;
+            blocks[card] += length;
+
+            blockAddress += length;
+            data         += length * 512;
+            count        -= length;
+        }
+
+        error = SDCard_arrayRun(array,isWrite,address,used,results);
+        // Only the blocks really moved are counted
+        for (card = 0; card < array->count; ++card)
+        {
+            if (results[card] == SDCARD_ERRORS_OK)
+                array->stats.blocks[card] += blocks[card];
+        }
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+    }
+    return SDCARD_ERRORS_OK;
+}
+
+/**
+ * The function reads the blocks of the mirrored array, splitting them
+ * between the cards. The part of a card that fails is read again from the
+ * other cards.
+ *
+ * @param[in] array An handle of the array
+ * @param[in] blockAddress The first block
+ * @param[out] data The buffer of count sectors
+ * @param[in] count The number of blocks
+ * @return SDCARD_ERRORS_OK if the blocks are read, an error otherwise.
+ */
+static SDCard_Errors SDCard_arrayMirrorRead (SDCard_Array* array,
+                                             uint32_t blockAddress,
+                                             uint8_t* data,
+                                             uint32_t count)
+{
+    SDCard_Errors error;
+    SDCard_Errors results[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t address[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint8_t used[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t part = (count + array->count - 1) / array->count;
+    uint8_t i, j, card;
+
+    memset(used,0,sizeof(used));
+    // The first card changes at each request, so also the single blocks
+    // are spread
+    card = array->nextRead;
+    array->nextRead = (array->nextRead + 1) % array->count;
+    for (i = 0; (i < array->count) && (count > 0); ++i)
+    {
+        if (part > count)
+            part = count;
+        address[card] = blockAddress;
+        array->segments[card][0].data  = data;
+        array->segments[card][0].count = part;
+        used[card] = 1;
+
+        blockAddress += part;
+        data         += part * 512;
+        count        -= part;
+        card = (card + 1) % array->count;
+    }
+
+    // The results are checked one by one: a card failed, also at its
+    // start, is replaced by the others
+    SDCard_arrayRun(array,FALSE,address,used,results);
+
+    error = SDCARD_ERRORS_OK;
+    for (i = 0; i < array->count; ++i)
+    {
+        if (used[i] == 0)
+            continue;
+        if (results[i] == SDCARD_ERRORS_OK)
+        {
+            array->stats.blocks[i] += array->segments[i][0].count;
+            continue;
+        }
+
+        for (j = 1; j < array->count; ++j)
+        {
+            card = (i + j) % array->count;
+            array->stats.failovers++;
+            array->stats.transfers++;
+            results[i] = SDCard_readv(array->cards[card],address[i],array->segments[i],1);
+            if (results[i] == SDCARD_ERRORS_OK)
+            {
+                array->stats.blocks[card] += array->segments[i][0].count;
+                break;
+            }
+        }
+        if ((results[i] != SDCARD_ERRORS_OK) && (error == SDCARD_ERRORS_OK))
+            error = results[i];
+    }
+    return error;
+}
+
+SDCard_Errors SDCard_arrayInit (SDCard_Array* array)
+{
+    SDCard_Errors error;
+    uint32_t sectors = 0xFFFFFFFF;
+    uint8_t i;
+
+    array->sectorCount = 0;
+    array->nextRead    = 0;
+    if ((array->count == 0) ||
+        (array->count > WARCOMEB_SDCARD_ARRAY_CARDS) ||
+        ((array->mode == SDCARD_ARRAYMODE_STRIPE) && (array->chunk == 0)))
+        return SDCARD_ERRORS_INIT_FAILED;
+
+    for (i = 0; i < array->count; ++i)
+    {
+        if (array->cards[i]->isInit == FALSE)
+        {
+            error = SDCard_init(array->cards[i]);
+            if (error != SDCARD_ERRORS_OK)
+                return error;
+        }
+        if (array->cards[i]->info.sectorCount < sectors)
+            sectors = array->cards[i]->info.sectorCount;
+    }
+
+    if (array->mode == SDCARD_ARRAYMODE_STRIPE)
+        sectors = (sectors / array->chunk) * array->chunk * array->count;
+    array->sectorCount = sectors;
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_arrayReadBlocks (SDCard_Array* array,
+                                      uint32_t blockAddress,
+                                      uint8_t* data,
+                                      uint32_t count)
+{
+    if ((count == 0) ||
+        (blockAddress >= array->sectorCount) ||
+        (count > (array->sectorCount - blockAddress)))
+        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+
+    if (array->mode == SDCARD_ARRAYMODE_MIRROR)
+        return SDCard_arrayMirrorRead(array,blockAddress,data,count);
+    return SDCard_arrayStripe(array,FALSE,blockAddress,data,count);
+}
+
+SDCard_Errors SDCard_arrayWriteBlocks (SDCard_Array* array,
+                                       uint32_t blockAddress,
+                                       const uint8_t* data,
+                                       uint32_t count)
+{
+    SDCard_Errors error;
+    SDCard_Errors results[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint32_t address[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint8_t used[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint8_t i;
+
+    if ((count == 0) ||
+        (blockAddress >= array->sectorCount) ||
+        (count > (array->sectorCount - blockAddress)))
+        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
+
+    if (array->mode == SDCARD_ARRAYMODE_STRIPE)
+        return SDCard_arrayStripe(array,TRUE,blockAddress,(uint8_t*) data,count);
+
+    for (i = 0; i < array->count; ++i)
+    {
+        address[i] = blockAddress;
+        array->segments[i][0].data  = (uint8_t*) data;
+        array->segments[i][0].count = count;
+        used[i] = 1;
+    }
+    error = SDCard_arrayRun(array,TRUE,address,used,results);
+
+    for (i = 0; i < array->count; ++i)
+    {
+        if (results[i] == SDCARD_ERRORS_OK)
+            array->stats.blocks[i] += count;
+    }
+    return error;
+}
+
+SDCard_Errors SDCard_arrayGetSectorCount (SDCard_Array* array,
+                                          uint32_t* size)
+{
+    *size = array->sectorCount;
+    return (array->sectorCount == 0) ? SDCARD_ERRORS_CARD_NOT_DETECTED : SDCARD_ERRORS_OK;
+}
 
-    // Send starting block with writing blocks command
-    do
-	{
-        SDCard_sendCommand(dev,SDCARD_COMMAND_25,blockAddress,&response);
-		retry++;
-		if (retry > SDCARD_MAX_RETRY)
-		{
-		    // Close CMD25
-	        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD25 write blocks fail",CLI_MESSAGETYPE_ERROR);
+void SDCard_getArrayStats (SDCard_Array* array, SDCard_ArrayStats* stats)
+{
+    *stats = array->stats;
+}
 #endif
-	        return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
-		}
-		dev->delayTime(10);
-	} while (response != SDCARD_RESPONSE_OK);
 
-    do
-    {
-        // Send TOKEN
-        Spi_writeByte(dev->device,0xFC);
+#ifdef WARCOMEB_SDCARD_STORE_SEGMENTS
+/**
+ * The store fields are little endian. The header of a sector is the
+ * sequence (4 bytes), the time of the first record (4), the bytes of the
+ * records (2) and the CRC16 of the sector with the CRC field at zero (2).
+ * A record is the time (4), the length (2) and the data.
+ */
+#define SDCARD_STORE_MAGIC             0x53444C47UL
+#define SDCARD_STORE_CHECKPOINT        28
 
-        // Send DATA
-        for (i = 0; i < 512; ++i)
-        {
-            Spi_writeByte(dev->device,data[i]);
-        }
+static uint32_t SDCard_storeGet32 (const uint8_t* data)
+{
+    return ((uint32_t)data[0]) | ((uint32_t)data[1] << 8) |
+           ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
 
-        // Send dummy CRC
-        Spi_writeByte(dev->device,0xFF);
-        Spi_writeByte(dev->device,0xFF);
+static void SDCard_storePut32 (uint8_t* data, uint32_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+    data[2] = (uint8_t)(value >> 16);
+    data[3] = (uint8_t)(value >> 24);
+}
 
-        // Read card reply
-        // Every data block written to the card will be acknoledged by a
-        // data response token. It is one byte long and has the following format:
-        // X X X 0 STATUS 1, where status bits is defined as
-        // 010 - Data accepted
-        // 101 - Data rejected due to a CRC error
-        // 110 - Data rejected due to a write error
-        Spi_readByte(dev->device,&response);
-        if (response != SDCARD_RESPONSE_FAULT)
-        {
-            // Close CMD25
-            SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","write blocks response fault",CLI_MESSAGETYPE_ERROR);
-#endif
-            return SDCARD_ERRORS_WRITE_BLOCKS_FAILED;
-        }
+static uint16_t SDCard_storeGet16 (const uint8_t* data)
+{
+    return ((uint16_t)data[0]) | ((uint16_t)data[1] << 8);
+}
 
-        SDCard_waitReady(dev,SDCARD_TIMEOUT_WRITE);
+static void SDCard_storePut16 (uint8_t* data, uint16_t value)
+{
+    data[0] = (uint8_t)value;
+    data[1] = (uint8_t)(value >> 8);
+}
 
-        // Move forward the data pointer
-        data += 512;
+/**
+ * The function computes the CRC16 of a sector, as its CRC field was zero.
+ *
+ * @param[in] sector
+ * @return The CRC16
+ */
+static uint16_t SDCard_storeCrc (const uint8_t* sector)
+{
+    static const uint8_t zero[2] = {0,0};
+    uint16_t crc;
+
+    crc = SDCard_crc16(0,sector,SDCARD_STORE_HEADER - 2);
+    crc = SDCard_crc16(crc,zero,2);
+    return SDCard_crc16(crc,sector + SDCARD_STORE_HEADER,512 - SDCARD_STORE_HEADER);
+}
+
+/**
+ * @param[in] store An handle of the store
+ * @param[in] sequence The sequence of a sector
+ * @return The block of the sector
+ */
+static uint32_t SDCard_storeBlock (SDCard_Store* store, uint32_t sequence)
+{
+    return store->start + store->segment +
+           (sequence - 1) % (store->segments * store->segment);
+}
+
+/**
+ * The function checks that a sector read from the card is the one
+ * written with that sequence.
+ *
+ * @param[in] sector
+ * @param[in] sequence The expected sequence
+ * @return TRUE if the sector is valid, FALSE otherwise.
+ */
+static bool SDCard_storeIsValid (const uint8_t* sector, uint32_t sequence)
+{
+    if ((SDCard_storeGet32(sector) != sequence) ||
+        (SDCard_storeGet16(sector + 8) > 512 - SDCARD_STORE_HEADER))
+        return FALSE;
+
+    return (SDCard_storeGet16(sector + 10) == SDCard_storeCrc(sector)) ? TRUE : FALSE;
+}
 
-    } while (--count);
+/**
+ * The function gives a sector of the log: the sector being filled, or the
+ * sector read from the card. The last sector read is kept into the store.
+ *
+ * @param[in] store An handle of the store
+ * @param[in] sequence The sequence of the sector
+ * @param[out] sector The sector
+ * @return SDCARD_ERRORS_OK if the sector is valid, an error otherwise.
+ */
+static SDCard_Errors SDCard_storeLoad (SDCard_Store* store,
+                                       uint32_t sequence,
+                                       const uint8_t** sector)
+{
+    SDCard_Errors error;
 
-    // Send TOKEN for STOP TRANS
-    Spi_writeByte(dev->device,0xFD);
+    if (sequence == store->sequence)
+    {
+        *sector = store->buffer;
+        return SDCARD_ERRORS_OK;
+    }
 
-    SDCard_waitReady(dev,SDCARD_TIMEOUT_WRITE);
+    *sector = store->sector;
+    if (store->sectorSequence == sequence)
+        return SDCARD_ERRORS_OK;
 
-    // Close CMD25
-    SDCard_deselect(dev);
+    // The CMD25 of the appends must be stopped for reading
+    store->sectorSequence = 0;
+    error = SDCard_closeWrite(store->dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+    error = SDCard_waitOperation(store->dev,
+                                 SDCard_readBlocksAsync(store->dev,
+                                                        SDCard_storeBlock(store,sequence),
+                                                        store->sector,
+                                                        1,
+                                                        0,
+                                                        0));
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+    store->stats.reads++;
+
+    if (SDCard_storeIsValid(store->sector,sequence) == FALSE)
+        return SDCARD_ERRORS_READ_BLOCK_FAILED;
+    store->sectorSequence = sequence;
     return SDCARD_ERRORS_OK;
 }
 
-SDCard_Errors SDCard_readBlock (SDCard_Device* dev,
-                                uint32_t blockAddress,
-                                uint8_t* data)
+/**
+ * The function writes a checkpoint with the head and the tail of the log,
+ * alternating between the first two blocks of the area.
+ *
+ * @param[in] store An handle of the store
+ * @return SDCARD_ERRORS_OK if the checkpoint is written, an error otherwise.
+ */
+static SDCard_Errors SDCard_storeCheckpoint (SDCard_Store* store)
 {
-    uint8_t response, retry = 0;
-    uint16_t i;
-    uint32_t time;
+    SDCard_Errors error;
 
-    // Send starting block with reading command
-    do
-	{
-        SDCard_sendCommand(dev,SDCARD_COMMAND_17,blockAddress,&response);
-		retry++;
-		if (retry > SDCARD_MAX_RETRY)
-		{
-		    // Close CMD17
-	        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD17 read block fail",CLI_MESSAGETYPE_ERROR);
-#endif
-	        return SDCARD_ERRORS_READ_BLOCK_FAILED;
-		}
-		dev->delayTime(10);
-	} while (response != SDCARD_RESPONSE_OK);
+    error = SDCard_closeWrite(store->dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
 
-    // Wait for datastart token
-    // Current time + Timeout
-    time = dev->currentTime() + SDCARD_TIMEOUT_READ;
-    do
+    store->checkpoint++;
+    store->sectorSequence = 0;
+    memset(store->sector,0,512);
+    SDCard_storePut32(store->sector,SDCARD_STORE_MAGIC);
+    SDCard_storePut32(store->sector + 4,store->checkpoint);
+    SDCard_storePut32(store->sector + 8,store->head);
+    SDCard_storePut32(store->sector + 12,store->sequence);
+    SDCard_storePut32(store->sector + 16,store->lastTime);
+    SDCard_storePut32(store->sector + 20,store->segment);
+    SDCard_storePut32(store->sector + 24,store->segments);
+    SDCard_storePut16(store->sector + SDCARD_STORE_CHECKPOINT,
+                      SDCard_crc16(0,store->sector,SDCARD_STORE_CHECKPOINT));
+
+    error = SDCard_waitOperation(store->dev,
+                                 SDCard_writeBlocksAsync(store->dev,
+                                                         store->start + (store->checkpoint & 1),
+                                                         store->sector,
+                                                         1,
+                                                         0,
+                                                         0));
+    if (error == SDCARD_ERRORS_OK)
+        store->stats.checkpoints++;
+    return error;
+}
+
+/**
+ * The function moves the tail to the next sector. At the end of a segment
+ * the oldest segment is dropped when the area is full, and a checkpoint
+ * is written.
+ *
+ * @param[in] store An handle of the store
+ * @return SDCARD_ERRORS_OK if the tail is moved, an error otherwise.
+ */
+static SDCard_Errors SDCard_storeNext (SDCard_Store* store)
+{
+    store->sequence++;
+    store->used = 0;
+    memset(store->buffer,0,512);
+
+    if (((store->sequence - 1) % store->segment) != 0)
+        return SDCARD_ERRORS_OK;
+
+    if ((store->sequence - store->head) >= (store->segments * store->segment))
     {
-        Spi_readByte(dev->device,&response);
-    } while ((response != 0xFE) && (dev->currentTime() < time));
-    if (response != 0xFE)
+        store->head += store->segment;
+        store->stats.dropped++;
+    }
+    return SDCard_storeCheckpoint(store);
+}
+
+/**
+ * The function writes the sector being filled. The sectors of a segment
+ * are written with one CMD25, pre-erased up to the end of the segment.
+ *
+ * @param[in] store An handle of the store
+ * @return SDCARD_ERRORS_OK if the sector is written, an error otherwise.
+ */
+static SDCard_Errors SDCard_storeWrite (SDCard_Store* store)
+{
+    SDCard_Device* dev = store->dev;
+    SDCard_Errors error;
+    uint32_t block = SDCard_storeBlock(store,store->sequence);
+
+    SDCard_storePut32(store->buffer,store->sequence);
+    SDCard_storePut16(store->buffer + 10,SDCard_storeCrc(store->buffer));
+
+    if ((dev->asyncOpen == SDCARD_TRANSFER_WRITE) && (dev->asyncNext == block))
     {
-        // Close CMD17
-        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-        Cli_sendMessage("SDCARD","read block failed",CLI_MESSAGETYPE_ERROR);
-#endif
-        return SDCARD_ERRORS_READ_BLOCK_FAILED;
+        error = SDCard_continueWriteAsync(dev,store->buffer,1,0,0);
+    }
+    else
+    {
+        error = SDCard_closeWrite(dev);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+        error = SDCard_openWriteAsync(dev,
+                                      block,
+                                      store->buffer,
+                                      1,
+                                      store->segment - (store->sequence - 1) % store->segment,
+                                      0,
+                                      0);
+    }
+    error = SDCard_waitOperation(dev,error);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    store->stats.sectors++;
+    store->stats.padding += 512 - SDCARD_STORE_HEADER - store->used;
+    return SDCard_storeNext(store);
+}
+
+/**
+ * The function finds the last sector written after the checkpoint: they
+ * are written in order, so the valid ones are the first of the segment.
+ *
+ * @param[in] store An handle of the store
+ * @return SDCARD_ERRORS_OK if the tail is found, an error otherwise.
+ */
+static SDCard_Errors SDCard_storeRollForward (SDCard_Store* store)
+{
+    SDCard_Errors error;
+    const uint8_t* sector;
+    uint32_t first = store->sequence;
+    uint32_t low = 0;
+    uint32_t high = store->segment - (first - 1) % store->segment;
+    uint32_t middle, offset, used;
+
+    // The sequence of the checkpoint is not written yet
+    store->sequence = 0;
+    while (low < high)
+    {
+        middle = (low + high + 1) / 2;
+        error = SDCard_storeLoad(store,first + middle - 1,&sector);
+        if (error == SDCARD_ERRORS_OK)
+            low = middle;
+        else if (error == SDCARD_ERRORS_READ_BLOCK_FAILED)
+            high = middle - 1;
+        else
+            return error;
     }
 
-    // Read DATA
-    for (i = 0; i < 512; ++i)
+    if (low > 0)
     {
-        Spi_readByte(dev->device,&data[i]);
+        error = SDCard_storeLoad(store,first + low - 1,&sector);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        // The time of the last record
+        used = SDCard_storeGet16(sector + 8);
+        for (offset = 0; offset < used;
+             offset += SDCARD_STORE_RECORD + SDCard_storeGet16(sector + SDCARD_STORE_HEADER + offset + 4))
+            store->lastTime = SDCard_storeGet32(sector + SDCARD_STORE_HEADER + offset);
     }
 
-    // Read CRC, doesn't used
-    Spi_readByte(dev->device,&response);
-    Spi_readByte(dev->device,&response);
+    store->sequence = first + low - 1;
+    if (low > 0)
+        return SDCard_storeNext(store);
 
-    // Close CMD17
-    SDCard_deselect(dev);
+    store->sequence++;
+    memset(store->buffer,0,512);
     return SDCARD_ERRORS_OK;
 }
 
-SDCard_Errors SDCard_readBlocks (SDCard_Device* dev,
-                                 uint32_t blockAddress,
-                                 uint8_t* data,
-                                 uint8_t count)
+/**
+ * @param[in] store An handle of the store
+ * @return The sequence of the last sector with records, lower than the
+ *         head when the log is empty.
+ */
+static uint32_t SDCard_storeLast (SDCard_Store* store)
 {
-    uint8_t response, retry = 0;
-    uint16_t i;
-    uint32_t time;
+    return (store->used > 0) ? store->sequence : store->sequence - 1;
+}
 
-    // Send starting block with reading multiple block command
-    do
-	{
-        SDCard_sendCommand(dev,SDCARD_COMMAND_18,blockAddress,&response);
-		retry++;
-		if (retry > SDCARD_MAX_RETRY)
-		{
-		    // Close CMD18
-	        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-            Cli_sendMessage("SDCARD","CMD18 read blocks fail",CLI_MESSAGETYPE_ERROR);
-#endif
-	        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
-		}
-		dev->delayTime(10);
-	} while (response != SDCARD_RESPONSE_OK);
+/**
+ * @param[in] store An handle of the store
+ * @param[in] sequence The sequence of a sector
+ * @return The position into the index of the segment of the sector
+ */
+static uint32_t SDCard_storeSegment (SDCard_Store* store, uint32_t sequence)
+{
+    return ((sequence - 1) / store->segment) % store->segments;
+}
 
-    // Wait for datastart token
-    // Current time + Timeout
-    time = dev->currentTime() + SDCARD_TIMEOUT_READ;
-    do
-    {
-        Spi_readByte(dev->device,&response);
-    } while ((response != 0xFE) && (dev->currentTime() < time));
-    if (response != 0xFE)
+SDCard_Errors SDCard_storeFormat (SDCard_Store* store)
+{
+    SDCard_Device* dev = store->dev;
+    SDCard_Errors error;
+
+    store->segments = 0;
+    store->segment  = (dev->info.auSize != 0) ? dev->info.auSize : SDCARD_STORE_SEGMENT;
+    if (((store->start % store->segment) != 0) ||
+        (store->count / store->segment < 3) ||
+        (store->start + store->count > dev->info.sectorCount))
+        return SDCARD_ERRORS_INIT_FAILED;
+
+    error = SDCard_closeWrite(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+
+    store->segments = store->count / store->segment - 1;
+    if (store->segments > WARCOMEB_SDCARD_STORE_SEGMENTS)
+        store->segments = WARCOMEB_SDCARD_STORE_SEGMENTS;
+    error = SDCard_eraseBlocks(dev,store->start,(store->segments + 1) * store->segment);
+    if (error != SDCARD_ERRORS_OK)
     {
-        // Close CMD18
-        SDCard_deselect(dev);
-#ifdef WARCOMEB_SDCARD_DEBUG
-        Cli_sendMessage("SDCARD","read blocks failed",CLI_MESSAGETYPE_ERROR);
-#endif
-        return SDCARD_ERRORS_READ_BLOCK_FAILED;
+        store->segments = 0;
+        return error;
     }
 
-    do
-    {
-        // Read DATA
-        for (i = 0; i < 512; ++i)
-        {
-            Spi_readByte(dev->device,&data[i]);
-        }
+    store->head           = 1;
+    store->sequence       = 1;
+    store->lastTime       = 0;
+    store->checkpoint     = 0;
+    store->used           = 0;
+    store->sectorSequence = 0;
+    memset(store->buffer,0,512);
+    memset(&store->stats,0,sizeof(SDCard_StoreStats));
+    return SDCard_storeCheckpoint(store);
+}
 
-        // Read CRC, doesn't used
-        Spi_readByte(dev->device,&response);
-        Spi_readByte(dev->device,&response);
+SDCard_Errors SDCard_storeMount (SDCard_Store* store)
+{
+    SDCard_Device* dev = store->dev;
+    SDCard_Errors error;
+    const uint8_t* sector;
+    uint32_t number = 0;
+    uint32_t sequence, last;
+    uint8_t i;
 
-        // Move forward the data pointer
-        data += 512;
+    store->segments       = 0;
+    store->used           = 0;
+    store->sectorSequence = 0;
+    memset(&store->stats,0,sizeof(SDCard_StoreStats));
 
-    } while (--count);
+    error = SDCard_closeWrite(dev);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
 
-    // Close CMD18
-    SDCard_deselect(dev);
+    // The valid checkpoint with the greater number
+    for (i = 0; i < 2; ++i)
+    {
+        error = SDCard_waitOperation(dev,
+                                     SDCard_readBlocksAsync(dev,store->start + i,store->sector,1,0,0));
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+        store->stats.reads++;
+
+        if ((SDCard_storeGet32(store->sector) != SDCARD_STORE_MAGIC) ||
+            (SDCard_storeGet16(store->sector + SDCARD_STORE_CHECKPOINT) !=
+                 SDCard_crc16(0,store->sector,SDCARD_STORE_CHECKPOINT)) ||
+            (SDCard_storeGet32(store->sector + 4) <= number))
+            continue;
 
-    // Send STOP command
-    SDCard_sendCommand(dev,SDCARD_COMMAND_12,0,&response);
+        number            = SDCard_storeGet32(store->sector + 4);
+        store->checkpoint = number;
+        store->head       = SDCard_storeGet32(store->sector + 8);
+        store->sequence   = SDCard_storeGet32(store->sector + 12);
+        store->lastTime   = SDCard_storeGet32(store->sector + 16);
+        store->segment    = SDCard_storeGet32(store->sector + 20);
+        store->segments   = SDCard_storeGet32(store->sector + 24);
+    }
+    if ((number == 0) ||
+        (store->segment == 0) ||
+        (store->segments < 2) ||
+        (store->segments > WARCOMEB_SDCARD_STORE_SEGMENTS) ||
+        ((store->segments + 1) * store->segment > store->count))
+    {
+        store->segments = 0;
+        return SDCARD_ERRORS_INIT_FAILED;
+    }
 
-    if (count > 0)
+    error = SDCard_storeRollForward(store);
+    if (error != SDCARD_ERRORS_OK)
     {
-#ifdef WARCOMEB_SDCARD_DEBUG
-        Cli_sendMessage("SDCARD","read blocks fail (count > 0)",CLI_MESSAGETYPE_ERROR);
-#endif
-        return SDCARD_ERRORS_READ_BLOCKS_FAILED;
+        store->segments = 0;
+        return error;
     }
-    else
+
+    // The first time of each segment
+    last = SDCard_storeLast(store);
+    for (sequence = store->head; (sequence <= last) && (sequence >= store->head); sequence += store->segment)
     {
-        return SDCARD_ERRORS_OK;
+        error = SDCard_storeLoad(store,sequence,&sector);
+        if (error != SDCARD_ERRORS_OK)
+        {
+            store->segments = 0;
+            return error;
+        }
+        store->index[SDCard_storeSegment(store,sequence)] = SDCard_storeGet32(sector + 4);
     }
+    return SDCARD_ERRORS_OK;
 }
 
-SDCard_Errors SDCard_eraseBlocks (SDCard_Device* dev,
-                                  uint32_t blockAddress,
-                                  uint32_t count)
+SDCard_Errors SDCard_storeAppend (SDCard_Store* store,
+                                  uint32_t time,
+                                  const uint8_t* data,
+                                  uint16_t length)
 {
-    uint8_t response;
+    SDCard_Errors error;
+    uint8_t* record;
 
-    // Send starting block
-    SDCard_sendCommand(dev,SDCARD_COMMAND_32,blockAddress,&response);
-    if (response != SDCARD_RESPONSE_OK)
-    {
-//        SDCard_deselect(dev);
-        return SDCARD_ERRORS_ERASE_BLOCKS_FAILED;
-    }
+    if ((store->segments == 0) ||
+        (length > SDCARD_STORE_MAX_LENGTH) ||
+        (time < store->lastTime))
+        return SDCARD_ERRORS_WRITE_BLOCK_FAILED;
 
-    // Send ending block
-    SDCard_sendCommand(dev,SDCARD_COMMAND_33,(blockAddress+count-1),&response);
-    if (response != SDCARD_RESPONSE_OK)
+    // The records don't span two sectors
+    if (store->used + SDCARD_STORE_RECORD + length > 512 - SDCARD_STORE_HEADER)
     {
-//        SDCard_deselect(dev);
-        return SDCARD_ERRORS_ERASE_BLOCKS_FAILED;
+        error = SDCard_storeWrite(store);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
     }
 
-    // Send starting block
-    SDCard_sendCommand(dev,SDCARD_COMMAND_38,0,&response);
-    if (response != SDCARD_RESPONSE_OK)
+    if (store->used == 0)
     {
-//        SDCard_deselect(dev);
-        return SDCARD_ERRORS_ERASE_BLOCKS_FAILED;
+        SDCard_storePut32(store->buffer + 4,time);
+        if (((store->sequence - 1) % store->segment) == 0)
+            store->index[SDCard_storeSegment(store,store->sequence)] = time;
     }
 
-    // Wait...
-    SDCard_waitReady(dev,SDCARD_TIMEOUT_ERASE);
+    record = store->buffer + SDCARD_STORE_HEADER + store->used;
+    SDCard_storePut32(record,time);
+    SDCard_storePut16(record + 4,length);
+    if (length > 0)
+        memcpy(record + SDCARD_STORE_RECORD,data,length);
+    store->used += SDCARD_STORE_RECORD + length;
+    SDCard_storePut16(store->buffer + 8,store->used);
 
-    SDCard_deselect(dev);
+    store->lastTime = time;
+    store->stats.records++;
+    store->stats.bytes += length;
     return SDCARD_ERRORS_OK;
 }
 
-SDCard_Errors SDCard_getSectorCount (SDCard_Device* dev,
-                                     uint32_t* size)
+SDCard_Errors SDCard_storeSync (SDCard_Store* store)
 {
-    uint8_t response;
-    uint8_t i;
-    uint8_t csd[16];
+    SDCard_Errors error;
 
-    uint32_t tempSize = 0, time = 0;
+    if (store->segments == 0)
+        return SDCARD_ERRORS_WRITE_BLOCK_FAILED;
 
-
-    SDCard_sendCommand(dev,SDCARD_COMMAND_9,0,&response);
-    if (response != SDCARD_RESPONSE_OK)
+    if (store->used > 0)
     {
-        // Close CMD9
-        SDCard_deselect(dev);
-        *size = 0;
-        return SDCARD_ERRORS_COMMAND_FAILED;
+        error = SDCard_storeWrite(store);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+
+        // The end of a segment has just written the checkpoint
+        if (((store->sequence - 1) % store->segment) == 0)
+            return SDCARD_ERRORS_OK;
     }
+    return SDCard_storeCheckpoint(store);
+}
 
-    // Wait for datastart token
-    // Current time + Timeout
-    time = dev->currentTime() + SDCARD_TIMEOUT_READ;
-    do
-    {
-        Spi_readByte(dev->device,&response);
-    } while ((response != 0xFE) && (dev->currentTime() < time));
-    if (response != 0xFE)
-    {
-        *size = 0;
-        // Close CMD9
-        SDCard_deselect(dev);
+SDCard_Errors SDCard_storeSeek (SDCard_Store* store,
+                                uint32_t time,
+                                SDCard_StoreCursor* cursor)
+{
+    SDCard_Errors error;
+    const uint8_t* sector;
+    uint32_t last = SDCard_storeLast(store);
+    uint32_t low, high, middle, first, used;
+    uint16_t offset;
+
+    cursor->sequence = store->head;
+    cursor->offset   = 0;
+    if (store->segments == 0)
         return SDCARD_ERRORS_READ_BLOCK_FAILED;
+    if (last < store->head)
+        return SDCARD_ERRORS_OK;
+
+    // The last segment that starts before the time
+    low  = 0;
+    high = (last - store->head) / store->segment;
+    while (low < high)
+    {
+        middle = (low + high + 1) / 2;
+        if (store->index[SDCard_storeSegment(store,store->head + middle * store->segment)] < time)
+            low = middle;
+        else
+            high = middle - 1;
     }
+    first = store->head + low * store->segment;
 
-    // Read DATA
-    for (i = 0; i < 16; ++i) Spi_readByte(dev->device,&csd[i]);
-    // Read CRC, doesn't used
-    Spi_readByte(dev->device,&response);
-    Spi_readByte(dev->device,&response);
-    // Close CMD9
-    SDCard_deselect(dev);
+    // The first sector of the segment that starts at the time or later
+    low  = first;
+    high = first + store->segment;
+    if (high > last + 1)
+        high = last + 1;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        error = SDCard_storeLoad(store,middle,&sector);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+        if (SDCard_storeGet32(sector + 4) < time)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    cursor->sequence = low;
+    if (low == first)
+        return SDCARD_ERRORS_OK;
 
-    // !! The first byte read is the last one!
-    if ((csd[0] >> 6) == 1) // SDCARD v.2
+    // The records of the time can start into the previous sector
+    error = SDCard_storeLoad(store,low - 1,&sector);
+    if (error != SDCARD_ERRORS_OK)
+        return error;
+    used = SDCard_storeGet16(sector + 8);
+    for (offset = 0; offset < used;
+         offset += SDCARD_STORE_RECORD + SDCard_storeGet16(sector + SDCARD_STORE_HEADER + offset + 4))
     {
-        // See page 87 of "Physical Layer Simplified Specification Version 2.00"
-        tempSize = csd[9] + ((uint32_t)csd[8] << 8) + ((uint32_t)(csd[7] & 63) << 16) + 1;
-        *size = tempSize << 10;
+        if (SDCard_storeGet32(sector + SDCARD_STORE_HEADER + offset) >= time)
+        {
+            cursor->sequence = low - 1;
+            cursor->offset   = offset;
+            break;
+        }
     }
-    else // SDCARD v.1 or MMC v.3
+    return SDCARD_ERRORS_OK;
+}
+
+SDCard_Errors SDCard_storeRead (SDCard_Store* store,
+                                SDCard_StoreCursor* cursor,
+                                uint32_t* time,
+                                uint8_t* data,
+                                uint16_t* length)
+{
+    SDCard_Errors error;
+    const uint8_t* sector;
+    const uint8_t* record;
+
+    if (store->segments == 0)
+        return SDCARD_ERRORS_READ_BLOCK_FAILED;
+
+    while (TRUE)
     {
-        // See page 81 of "Physical Layer Simplified Specification Version 2.00"
-        i = (csd[5] & 0x0F) + ((csd[10] & 0x80) >> 7) + ((csd[9] & 0x03) << 1) + 2;
-        tempSize = (csd[8] >> 6) + ((uint32_t)csd[7] << 2) + ((uint32_t)(csd[6] & 3) << 10) + 1;
-        *size = tempSize << (i - 9);
+        // The sectors before the head are overwritten
+        if (cursor->sequence < store->head)
+        {
+            cursor->sequence = store->head;
+            cursor->offset   = 0;
+        }
+        if ((cursor->sequence > store->sequence) ||
+            ((cursor->sequence == store->sequence) && (cursor->offset >= store->used)))
+            return SDCARD_ERRORS_END;
+
+        error = SDCard_storeLoad(store,cursor->sequence,&sector);
+        if (error != SDCARD_ERRORS_OK)
+            return error;
+        if (cursor->offset < SDCard_storeGet16(sector + 8))
+            break;
+
+        cursor->sequence++;
+        cursor->offset = 0;
     }
 
+    record  = sector + SDCARD_STORE_HEADER + cursor->offset;
+    *time   = SDCard_storeGet32(record);
+    *length = SDCard_storeGet16(record + 4);
+    if (data != 0)
+        memcpy(data,record + SDCARD_STORE_RECORD,*length);
+    cursor->offset += SDCARD_STORE_RECORD + *length;
     return SDCARD_ERRORS_OK;
 }
 
+void SDCard_getStoreStats (SDCard_Store* store, SDCard_StoreStats* stats)
+{
+    *stats = store->stats;
+}
+#endif
+
 bool SDCard_isBusy(SDCard_Device* dev)
 {
-    bool result = SDCard_select(dev);
+    bool result;
+
+    if (dev->asyncState != SDCARD_ASYNCSTATE_IDLE)
+        return TRUE;
+    if (dev->cardBusy == FALSE)
+        return FALSE;
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    // The card is checked again when the bus is free
+    if (SDCard_busOwn(dev,FALSE) == FALSE)
+        return TRUE;
+#endif
+
+    result = SDCard_select(dev);
     SDCard_deselect(dev);
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    if (dev->bus != 0)
+        SDCard_busRelease(dev->bus,dev->busUser);
+#endif
 
     return !result;
 }
@@ -761,3 +5631,34 @@ bool SDCard_isPresent(SDCard_Device* dev)
 {
     return (Gpio_get(dev->cpPin) != dev->cpType) ? FALSE : TRUE;
 }
+
+void SDCard_getRetryStats (SDCard_Device* dev,
+                           SDCard_RetryCommand command,
+                           SDCard_RetryStats* stats)
+{
+    *stats = dev->retryStats[command];
+}
+
+void SDCard_getInitStats (SDCard_Device* dev, SDCard_InitStats* stats)
+{
+    *stats = dev->initStats;
+}
+
+void SDCard_resetRetryStats (SDCard_Device* dev)
+{
+    uint8_t i;
+
+    for (i = 0; i < SDCARD_RETRYCOMMAND_COUNT; ++i)
+    {
+        dev->retryStats[i].commands = 0;
+        dev->retryStats[i].retries  = 0;
+        dev->retryStats[i].failures = 0;
+        dev->retryStats[i].delay    = 0;
+        dev->retryStats[i].maxRetry = 0;
+    }
+}
+
+void SDCard_transferComplete (SDCard_Device* dev)
+{
+    dev->asyncTransferDone = TRUE;
+}
@@ -83,7 +83,10 @@ typedef enum _SDCard_Errors
     SDCARD_ERRORS_WRITE_BLOCKS_FAILED,
     SDCARD_ERRORS_READ_BLOCKS_FAILED,
 
-    SDCARD_ERRORS_ERASE_BLOCKS_FAILED
+    SDCARD_ERRORS_ERASE_BLOCKS_FAILED,
+
+    SDCARD_ERRORS_BUSY,                   /**< An operation is still running */
+    SDCARD_ERRORS_END,                    /**< No more records into the log */
 } SDCard_Errors;
 
 typedef enum _SDCard_PresentType
@@ -92,6 +95,408 @@ typedef enum _SDCard_PresentType
     SDCARD_PRESENTTYPE_HIGH = 1,
 } SDCard_PresentType;
 
+typedef enum _SDCard_RetryCommand
+{
+    SDCARD_RETRYCOMMAND_RESET,                                     /**< CMD0 */
+    SDCARD_RETRYCOMMAND_READ,                               /**< CMD17/CMD18 */
+    SDCARD_RETRYCOMMAND_WRITE,                              /**< CMD24/CMD25 */
+
+    SDCARD_RETRYCOMMAND_COUNT,
+} SDCard_RetryCommand;
+
+/**
+ * Retry policy of a command. The first attempt is sent immediately, after
+ * each failure the next attempt is delayed: the delay starts from
+ * firstDelay and is multiplied by factor up to maxDelay. With a delay of 0
+ * the command is sent again at the next call of SDCard_poll.
+ */
+typedef struct _SDCard_RetryPolicy
+{
+    uint8_t  maxRetry;          /**< Attempts allowed after the first one */
+    uint16_t firstDelay;                    /**< Delay of first retry [ms] */
+    uint16_t maxDelay;                      /**< Upper limit of delay [ms] */
+    uint8_t  factor;           /**< Delay multiplier, 1 for constant delay */
+} SDCard_RetryPolicy;
+
+typedef struct _SDCard_RetryStats
+{
+    uint32_t commands;            /**< Commands completed or failed at all */
+    uint32_t retries;                     /**< Attempts after the first one */
+    uint32_t failures;                /**< Commands failed after all retry */
+    uint32_t delay;                 /**< Total time waited before retry [ms] */
+    uint8_t  maxRetry;          /**< Max number of retry used by a command */
+} SDCard_RetryStats;
+
+/**
+ * Duration of the phases of the last initialization [ms]. The registers
+ * phase holds the reading of CSD, CID and SD Status, the High-Speed switch
+ * and the change of clock.
+ */
+typedef struct _SDCard_InitStats
+{
+    uint32_t reset;                                   /**< CMD0 with retries */
+    uint32_t ifCond;                                               /**< CMD8 */
+    uint32_t opCond;                             /**< Polling of ACMD41/CMD1 */
+    uint32_t ocr;                                                 /**< CMD58 */
+    uint32_t registers;
+    uint32_t total;
+    uint16_t opCondPolls;                     /**< ACMD41/CMD1 commands sent */
+    bool     warm;               /**< Card found still initialized by reinit */
+} SDCard_InitStats;
+
+/**
+ * Online estimate of the time waited by an operation, used for its timeout.
+ * The limit comes from the card registers (CSD and SD Status); after some
+ * samples the timeout follows the measured times: it is the mean plus four
+ * times the mean deviation (both EWMA), never over the limit. A read over
+ * the timeout is sent again, a write goes on waiting until the limit.
+ */
+typedef struct _SDCard_Latency
+{
+    uint32_t mean;                          /**< EWMA of the samples [ms/16] */
+    uint32_t deviation;              /**< EWMA of the mean deviation [ms/16] */
+    uint32_t samples;
+    uint32_t timeout;                              /**< Current timeout [ms] */
+    uint32_t limit;                            /**< Timeout of the card [ms] */
+    uint32_t late;                               /**< Waits over the timeout */
+} SDCard_Latency;
+
+/**
+ * A piece of a scattered buffer: count sectors stored one after the other
+ * starting from data. The same segments describe the buffers of reads and
+ * writes, so data isn't const: the write functions store their const
+ * buffer here with a cast, and the transfer only reads from it.
+ */
+typedef struct _SDCard_Segment
+{
+    uint8_t*           data;
+    uint32_t           count;
+} SDCard_Segment;
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+/**
+ * When WARCOMEB_SDCARD_CACHE_SECTORS is defined, every device keeps a pool
+ * of this number of sectors in RAM. The pool is used by SDCard_readBlock,
+ * SDCard_writeBlock, SDCard_readBlocks and SDCard_writeBlocks; the least
+ * recently used sector is evicted when the pool is full.
+ * The asynchronous functions bypass the cache: call SDCard_flush before
+ * reading with them.
+ */
+typedef enum _SDCard_CacheMode
+{
+    SDCARD_CACHEMODE_WRITE_THROUGH = 0,
+    SDCARD_CACHEMODE_WRITE_BACK,      /**< Written at eviction or at flush */
+} SDCard_CacheMode;
+
+typedef struct _SDCard_CacheLine
+{
+    uint32_t           blockAddress;
+    uint32_t           lastUse;
+    bool               isValid;
+    bool               isDirty;
+    uint8_t            data[512];
+} SDCard_CacheLine;
+
+typedef struct _SDCard_CacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writeBacks;                      /**< Dirty sectors written */
+} SDCard_CacheStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+/**
+ * When WARCOMEB_SDCARD_READAHEAD_SECTORS is defined, SDCard_readBlock
+ * detects the sequential reading: the next sectors are read with one
+ * multiple block read (CMD18) into a ring buffer of this number of sectors.
+ * The CMD18 is kept open between two calls and it is closed with CMD12 when
+ * the sequence breaks or when another command must be sent.
+ */
+typedef struct _SDCard_ReadAheadStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t streams;                         /**< CMD18 opened for prefetch */
+    uint32_t prefetched;                          /**< Sectors read ahead */
+} SDCard_ReadAheadStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+/**
+ * When WARCOMEB_SDCARD_COALESCE_SECTORS is defined, SDCard_writeBlock
+ * holds consecutive blocks into a staging buffer of this number of sectors.
+ * The buffer is written with one multiple block write (CMD25) when it is
+ * full, when the next block isn't consecutive, when coalesceTimeout is
+ * elapsed (checked by the next read or write, and by SDCard_coalesceService)
+ * or with SDCard_flush. The reading functions, also the
+ * asynchronous ones, return the blocks still in the buffer. An asynchronous
+ * write drops the buffered blocks it overwrites, because they are older.
+ */
+typedef struct _SDCard_CoalesceStats
+{
+    uint32_t writes;                              /**< Blocks buffered */
+    uint32_t bursts;                       /**< Multiple block writes */
+    uint32_t hits;                       /**< Blocks read from buffer */
+} SDCard_CoalesceStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_LOGGER_BUFFERS
+#ifndef WARCOMEB_SDCARD_LOGGER_SECTORS
+#define WARCOMEB_SDCARD_LOGGER_SECTORS 1
+#endif
+
+/**
+ * When WARCOMEB_SDCARD_LOGGER_BUFFERS is defined (2 or more), the device
+ * holds that number of buffers of WARCOMEB_SDCARD_LOGGER_SECTORS sectors
+ * for continuous logging. The producer fills one buffer with
+ * SDCard_loggerPut, also from an interrupt, while the full ones are
+ * written by SDCard_loggerService into one CMD25 left open.
+ */
+typedef struct _SDCard_LoggerStats
+{
+    uint32_t blocks;                                     /**< Blocks written */
+    uint32_t buffers;                                   /**< Buffers written */
+    uint32_t overruns;         /**< Calls of SDCard_loggerPut that lost data */
+    uint32_t lost;                                           /**< Bytes lost */
+    uint32_t maxWrite;                   /**< Longest write of a buffer [ms] */
+    uint8_t  maxUsed;            /**< High watermark of buffers full at once */
+} SDCard_LoggerStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+/**
+ * When WARCOMEB_SDCARD_DISCARD_RANGES is defined, SDCard_discardBlocks
+ * queues the blocks not used anymore into that number of ranges, merging
+ * the adjacent or overlapping ones. SDCard_discardService erases them
+ * while the device is idle, one allocation unit (AU) at a time and only
+ * whole units: the erase command ends just after CMD38, and the next
+ * operation waits only for the rest of that erase. A block written after
+ * its discard leaves the queue.
+ */
+typedef struct _SDCard_DiscardRange
+{
+    uint32_t blockAddress;
+    uint32_t count;
+} SDCard_DiscardRange;
+
+typedef struct _SDCard_DiscardStats
+{
+    uint32_t queued;                                   /**< Blocks discarded */
+    uint32_t merged;                         /**< Ranges merged with another */
+    uint32_t dropped;              /**< Blocks forgotten with the queue full */
+    uint32_t erases;                       /**< Erase commands in background */
+    uint32_t erased;                                      /**< Blocks erased */
+    uint32_t eraseTime;                /**< Card busy erasing the queue [ms] */
+    uint32_t deferred;           /**< Service calls with the device not idle */
+} SDCard_DiscardStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_METRICS
+#define SDCARD_METRICS_BINS 20
+
+/**
+ * When WARCOMEB_SDCARD_METRICS is defined, the library measures the
+ * commands and the phases of the operations. The durations are in units
+ * of metricsTime, or of currentTime when it is NULL.
+ */
+typedef enum _SDCard_MetricsCommand
+{
+    SDCARD_METRICSCOMMAND_READ_SINGLE = 0,                        /**< CMD17 */
+    SDCARD_METRICSCOMMAND_READ_MULTIPLE,                          /**< CMD18 */
+    SDCARD_METRICSCOMMAND_WRITE_SINGLE,                           /**< CMD24 */
+    SDCARD_METRICSCOMMAND_WRITE_MULTIPLE,                         /**< CMD25 */
+    SDCARD_METRICSCOMMAND_STOP,                                   /**< CMD12 */
+    SDCARD_METRICSCOMMAND_ERASE,                       /**< CMD32, 33 and 38 */
+    SDCARD_METRICSCOMMAND_OTHER,
+
+    SDCARD_METRICSCOMMAND_COUNT,
+} SDCard_MetricsCommand;
+
+/**
+ * Durations in a log2 histogram: the bin i holds the durations from
+ * 2^(i-1) to 2^i - 1 (the bin 0 holds 0), the last bin also the longer
+ * ones.
+ */
+typedef struct _SDCard_Histogram
+{
+    uint32_t count;
+    uint32_t total;
+    uint32_t max;
+    uint32_t bins[SDCARD_METRICS_BINS];
+} SDCard_Histogram;
+
+typedef struct _SDCard_Metrics
+{
+    SDCard_Histogram command[SDCARD_METRICSCOMMAND_COUNT];    /**< To the R1 */
+    uint32_t errors[SDCARD_METRICSCOMMAND_COUNT];   /**< No R1 or error bits */
+    SDCard_Histogram tokenWait;         /**< From read command to data token */
+    SDCard_Histogram transfer;        /**< Data of a block, CRC and response */
+    SDCard_Histogram busyWait;         /**< Programming or erase of the card */
+    uint32_t bytesRead;
+    uint32_t bytesWritten;
+    uint32_t retries;                    /**< Attempts again of all commands */
+} SDCard_Metrics;
+#endif
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+/**
+ * When WARCOMEB_SDCARD_TRACE_EVENTS is defined (a power of two), the
+ * library records the last events of the bus into a ring of that size.
+ * The events are read with SDCard_traceRead, also while the library runs,
+ * and they can be decoded on the host by tools/sdcard_trace.py.
+ */
+typedef enum _SDCard_TraceType
+{
+    SDCARD_TRACETYPE_START = 0,            /**< Operation, code: first state */
+    SDCARD_TRACETYPE_END,                       /**< Operation, code: result */
+    SDCARD_TRACETYPE_COMMAND,    /**< code: index, value: argument bits 0-15 */
+    SDCARD_TRACETYPE_RESPONSE,              /**< code: R1, value: bytes read */
+    SDCARD_TRACETYPE_TOKEN,                /**< Data token read, code: token */
+    SDCARD_TRACETYPE_DATA_START,                           /**< value: bytes */
+    SDCARD_TRACETYPE_DATA_END,         /**< code: data response of the write */
+    SDCARD_TRACETYPE_BUSY_START,
+    SDCARD_TRACETYPE_BUSY_END,
+    SDCARD_TRACETYPE_DESELECT,
+} SDCard_TraceType;
+
+typedef struct _SDCard_TraceEvent
+{
+    uint32_t time;                       /**< From traceTime, or currentTime */
+    uint8_t  type;
+    uint8_t  code;
+    uint16_t value;
+} SDCard_TraceEvent;
+#endif
+
+/**
+ * The registers of the card, read once by the initialization.
+ */
+typedef struct _SDCard_Info
+{
+    uint8_t  csd[16];
+    uint8_t  cid[16];
+    uint32_t ocr;
+
+    uint32_t sectorCount;
+    uint32_t tranSpeed;             /**< Maximum clock from TRAN_SPEED [Hz] */
+    uint32_t taac;                        /**< Asynchronous access time [ns] */
+    uint16_t nsac;                   /**< Access time in clock cycles (x100) */
+    uint8_t  r2wFactor;      /**< Write time is 2^r2wFactor the read time */
+    uint16_t commandClasses;                                      /**< CCC */
+
+    /* From SD Status (ACMD13), zero when it isn't available */
+    uint8_t  speedClass;                            /**< 0, 2, 4, 6 or 10 */
+    uint32_t auSize;                         /**< Allocation unit [sectors] */
+    uint16_t eraseSize;              /**< AUs erased in eraseTimeout seconds */
+    uint8_t  eraseTimeout;                                          /**< [s] */
+    uint8_t  eraseOffset;                                           /**< [s] */
+} SDCard_Info;
+
+struct _SDCard_Device;
+
+/**
+ * Prototype of the function called at the end of an asynchronous operation.
+ *
+ * @param[in] dev The device that completed the operation
+ * @param[in] error SDCARD_ERRORS_OK if the operation succeeded
+ * @param[in] context The user pointer passed when the operation was started
+ */
+typedef void (*SDCard_Callback)(struct _SDCard_Device* dev,
+                                SDCard_Errors error,
+                                void* context);
+
+#ifdef WARCOMEB_SDCARD_QUEUE_CLIENTS
+#ifndef WARCOMEB_SDCARD_QUEUE_MERGE
+#define WARCOMEB_SDCARD_QUEUE_MERGE 8
+#endif
+
+/**
+ * When WARCOMEB_SDCARD_QUEUE_CLIENTS is defined, the requests of that
+ * number of clients (tasks) can be queued with SDCard_submit, also from
+ * different threads, and one task runs them with SDCard_queueService.
+ * The queue is served in ascending order of block from the last one
+ * moved (C-LOOK), and the requests of the same direction that follow one
+ * another are merged into one multiple block command, up to
+ * WARCOMEB_SDCARD_QUEUE_MERGE requests. A request older than queueDeadline
+ * is served first. A request never passes an older one of the same blocks
+ * when one of them is a write. As the asynchronous functions, the queue
+ * moves data directly with the card.
+ *
+ * The request is owned by the client and it must be valid until its
+ * result is not SDCARD_ERRORS_BUSY anymore.
+ */
+typedef struct _SDCard_Request
+{
+    uint8_t            client;       /**< 0 to WARCOMEB_SDCARD_QUEUE_CLIENTS-1 */
+    bool               isWrite;
+    uint32_t           blockAddress;
+    uint32_t           count;
+    uint8_t*           data;
+    SDCard_Callback    callback;   /**< Called by SDCard_queueService, or 0 */
+    void*              context;
+
+    /* Managed by the library */
+    volatile SDCard_Errors result;        /**< BUSY until the request ends */
+    uint32_t           submitTime;
+    struct _SDCard_Request* next;
+} SDCard_Request;
+
+typedef struct _SDCard_QueueStats
+{
+    uint32_t requests;
+    uint32_t blocks;
+    uint32_t merged;            /**< Requests moved together with others */
+    uint32_t totalLatency;      /**< From submit to end of the request [ms] */
+    uint32_t maxLatency;                                           /**< [ms] */
+} SDCard_QueueStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+#define SDCARD_BUS_USERS 8
+
+/**
+ * When WARCOMEB_SDCARD_SHARED_BUS is defined, the cards attached with
+ * SDCard_busAttach to the same SDCard_Bus share its SPI. An operation
+ * holds the bus from its start to its end; a CMD18 or CMD25 left open and
+ * the programming of the card don't hold it. An operation started while
+ * another user holds the bus waits into SDCard_poll, and the bus passes
+ * to the users that wait in turn (round robin). The clock of the card,
+ * and the mode with setMode, are set again when another user has used
+ * the bus. The cards of different buses never wait each other.
+ *
+ * The other peripherals of the bus get an identifier with
+ * SDCard_busAddUser, and use the bus between SDCard_busAcquire and
+ * SDCard_busRelease.
+ */
+typedef struct _SDCard_Bus
+{
+    Spi_DeviceHandle   device;
+
+    /**
+     * Optional functions for serialize the access to the bus between the
+     * tasks, for example a mutex or the disabling of the interrupts. When
+     * they are NULL, all users of the bus must run into one task.
+     */
+    void (*lock)(struct _SDCard_Bus* bus);
+    void (*unlock)(struct _SDCard_Bus* bus);
+    /**
+     * Optional function for set the SPI mode of the cards (CPOL 0, CPHA 0)
+     * after another user, needed only when the users don't share the mode.
+     */
+    void (*setMode)(Spi_DeviceHandle dev);
+
+    /* Managed by the library, the users are numbered from 1 */
+    uint8_t            users;
+    volatile uint8_t   owner;             /**< User that holds the bus, or 0 */
+    uint8_t            waiting;         /**< Bit (user - 1) for each waiting */
+    uint8_t            configured;    /**< Last user that set clock and mode */
+    struct _SDCard_Device* cards[SDCARD_BUS_USERS];   /**< 0 for other users */
+    uint32_t           handovers;     /**< Times the bus passed to a waiting */
+} SDCard_Bus;
+#endif
+
 typedef struct _SDCard_Device
 {
     Spi_DeviceHandle   device;
@@ -107,9 +512,328 @@ typedef struct _SDCard_Device
     void (*delayTime)(uint32_t delay);       /**< Function for blocking delay */
     uint32_t (*currentTime)(void);             /**< Function for current time */
 
+    /**
+     * Optional function for transmit a whole buffer. When it is NULL, the
+     * library sends the buffer byte-by-byte with Spi_writeByte.
+     */
+    void (*writeBuffer)(Spi_DeviceHandle dev,
+                        const uint8_t* buffer,
+                        uint16_t length);
+    /**
+     * Optional function for receive a whole buffer, the bytes transmitted
+     * must be 0xFF. When it is NULL, the library receives the buffer
+     * byte-by-byte with Spi_readByte.
+     */
+    void (*readBuffer)(Spi_DeviceHandle dev,
+                       uint8_t* buffer,
+                       uint16_t length);
+    /**
+     * Optional function for start a DMA transfer of length bytes. When
+     * txBuffer is NULL the function must transmit 0xFF, when rxBuffer is NULL
+     * the received bytes must be discarded. At the end of the transfer the
+     * board must call SDCard_transferComplete. When it is NULL, the
+     * asynchronous functions move the data into SDCard_poll.
+     */
+    void (*transferAsync)(Spi_DeviceHandle dev,
+                          const uint8_t* txBuffer,
+                          uint8_t* rxBuffer,
+                          uint16_t length);
+    /**
+     * Optional function for change the SPI clock, it returns the clock
+     * really set [Hz]. When it is not NULL, the identification runs at
+     * 400 kHz and then the clock is raised to the maximum of the card
+     * (TRAN_SPEED of CSD, or 50 MHz after the High-Speed switch), limited
+     * by maxClock.
+     */
+    uint32_t (*setClock)(Spi_DeviceHandle dev, uint32_t frequency);
+
+    uint32_t           maxClock;    /**< Limit of the board [Hz], 0 for none */
+    bool               highSpeed;   /**< Switch the card in High-Speed mode */
+    uint32_t           cardClock;         /**< Maximum clock of card [Hz] */
+    uint32_t           clock;                   /**< Current SPI clock [Hz] */
+
+    /**
+     * When it is TRUE, a write ends as soon as the card accepts the last
+     * block: the card programs it while the host goes on, and the next
+     * operation waits for the card. A programming error or timeout is
+     * reported by that operation.
+     */
+    bool               lazyBusy;
+
     bool               isInit;
+    SDCard_Info        info;                  /**< Valid when isInit is TRUE */
+    SDCard_InitStats   initStats;
+
+    /**
+     * Array of SDCARD_RETRYCOMMAND_COUNT retry policies, one for each
+     * command. When it is NULL, the library uses its default policies.
+     */
+    const SDCard_RetryPolicy* retryPolicy;
+    SDCard_RetryStats  retryStats[SDCARD_RETRYCOMMAND_COUNT];
+
+    SDCard_Latency     readLatency;              /**< Wait of the data token */
+    SDCard_Latency     writeLatency;             /**< Programming of a block */
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+    SDCard_CacheMode   cacheMode;
+    SDCard_CacheLine   cache[WARCOMEB_SDCARD_CACHE_SECTORS];
+    uint32_t           cacheClock;
+    SDCard_CacheStats  cacheStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+    uint8_t            readAhead[WARCOMEB_SDCARD_READAHEAD_SECTORS][512];
+    uint32_t           readAheadAddress;    /**< Block of the first sector */
+    uint16_t           readAheadHead;        /**< Index of the first sector */
+    uint16_t           readAheadCount;
+    uint32_t           readAheadLast;           /**< Last block requested */
+    SDCard_ReadAheadStats readAheadStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+    uint8_t            coalesce[WARCOMEB_SDCARD_COALESCE_SECTORS][512];
+    uint32_t           coalesceAddress;     /**< Block of the first sector */
+    uint16_t           coalesceCount;
+    uint32_t           coalesceStart;   /**< Time of the first sector [ms] */
+    uint16_t           coalesceTimeout;        /**< [ms], 0 for no timeout */
+    SDCard_CoalesceStats coalesceStats;
+    const SDCard_Segment* coalesceRead;    /**< Async read to merge, or NULL */
+    uint32_t           coalesceReadCount;                /**< Segments of it */
+    uint32_t           coalesceReadAddress;
+    uint32_t           coalesceReadOffset;      /**< Byte range of readRange */
+    uint32_t           coalesceReadLength;           /**< 0 for whole blocks */
+    SDCard_Segment     coalesceReadBlocks;   /**< Buffer of a read of blocks */
+#endif
+
+#ifdef WARCOMEB_SDCARD_LOGGER_BUFFERS
+    uint8_t            logger[WARCOMEB_SDCARD_LOGGER_BUFFERS][WARCOMEB_SDCARD_LOGGER_SECTORS * 512];
+    volatile uint32_t  loggerFilled;    /**< Buffers filled, by the producer */
+    volatile uint32_t  loggerWritten;       /**< Buffers written to the card */
+    uint32_t           loggerLength;   /**< Bytes of the buffer being filled */
+    uint32_t           loggerAddress;          /**< Block of the next buffer */
+    uint32_t           loggerEnd;            /**< First block after the area */
+    uint32_t           loggerStart;     /**< Start of the current write [ms] */
+    volatile bool      loggerRunning;
+    SDCard_Errors      loggerError;
+    SDCard_LoggerStats loggerStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+    SDCard_DiscardRange discard[WARCOMEB_SDCARD_DISCARD_RANGES];
+    uint8_t            discardCount;
+    uint16_t           discardIdle;      /**< Idle time before an erase [ms] */
+    uint32_t           discardLast;      /**< End of the last operation [ms] */
+    uint32_t           discardStart;            /**< Start of the erase [ms] */
+    bool               discardBusy;           /**< The card erases the queue */
+    SDCard_DiscardStats discardStats;
+#endif
+
+#ifdef WARCOMEB_SDCARD_QUEUE_CLIENTS
+    /**
+     * Optional functions for serialize the access to the queue between
+     * SDCard_submit and SDCard_queueService, for example a mutex or the
+     * disabling of the interrupts. When they are NULL, all calls must be
+     * done by one task.
+     */
+    void (*lock)(struct _SDCard_Device* dev);
+    void (*unlock)(struct _SDCard_Device* dev);
+
+    uint16_t           queueDeadline;     /**< Maximum wait [ms], 0 for none */
+    SDCard_Request*    queuePending;             /**< In order of submission */
+    SDCard_Request*    queueActive;                 /**< Moved by the card */
+    SDCard_Segment     queueSegments[WARCOMEB_SDCARD_QUEUE_MERGE];
+    uint32_t           queueHead;           /**< Block after the last moved */
+    uint32_t           queueTransfers;           /**< Commands of the queue */
+    SDCard_QueueStats  queueStats[WARCOMEB_SDCARD_QUEUE_CLIENTS];
+#endif
+
+#ifdef WARCOMEB_SDCARD_METRICS
+    /**
+     * Optional function for a fine time (for example [us] from a free
+     * running timer), it is called a few times for each block so it must
+     * be fast. When it is NULL, the metrics use currentTime.
+     */
+    uint32_t (*metricsTime)(void);
+    uint32_t           metricsStart;         /**< Start of the current phase */
+    uint32_t           metricsBusy;              /**< Start of the card busy */
+    SDCard_Metrics     metrics;
+#endif
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+    /**
+     * Optional function for a fine time of the events (for example [us]),
+     * it must be fast. When it is NULL, the events use currentTime.
+     */
+    uint32_t (*traceTime)(void);
+    SDCard_TraceEvent  trace[WARCOMEB_SDCARD_TRACE_EVENTS];
+    volatile uint32_t  traceHead;                       /**< Events recorded */
+    uint32_t           traceTail;                           /**< Events read */
+    uint32_t           traceLost;        /**< Events overwritten before read */
+#endif
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+    SDCard_Bus*        bus;               /**< Set by SDCard_busAttach, or 0 */
+    uint8_t            busUser;
+    bool               busPending;      /**< The operation waits for the bus */
+    bool               busYielded;   /**< Bus released while card is busy */
+#endif
+
+#ifdef WARCOMEB_SDCARD_CRC
+    /**
+     * When WARCOMEB_SDCARD_CRC is defined the card checks the CRC of
+     * commands and data blocks (CMD59), and the library checks the CRC of
+     * the blocks read. A corrupted block is moved again alone, following
+     * the retry policy; this counter holds the corrupted blocks.
+     */
+    uint32_t           crcErrors;
+#endif
+
+    /* Session status, managed by the library */
+    uint8_t            streamMode;
+    uint32_t           streamAddress;       /**< Next block of the session */
+
+    /* Operation status, managed by the library */
+    bool               cardBusy;             /**< Programming not waited yet */
+    uint32_t           busyTimer;           /**< Deadline of the programming */
+    uint8_t            asyncState;
+    bool               asyncMultiple;
+    bool               asyncKeepOpen;  /**< Don't stop CMD18/25 at the end */
+    uint8_t            asyncOpen;       /**< CMD18/CMD25 still running */
+    uint32_t           asyncNext;    /**< Next block of CMD18/CMD25 open */
+    volatile bool      asyncTransferDone;
+    uint8_t*           asyncData;         /**< Not const, see SDCard_Segment */
+    const SDCard_Segment* asyncSegment;
+    uint32_t           asyncSegmentCount;
+    uint32_t           asyncAddress;
+    uint32_t           asyncCount;
+    uint16_t           asyncSkip;      /**< Bytes discarded before the range */
+    uint32_t           asyncLength;         /**< Bytes of the range to store */
+    uint32_t           asyncPreErase;              /**< Blocks of the ACMD23 */
+    uint8_t            asyncRetry;
+    uint32_t           asyncTimer;                 /**< Operation deadline */
+    uint32_t           asyncTime;             /**< Start of the current wait */
+    uint32_t           asyncWait;             /**< Time of the next attempt */
+    uint16_t           asyncDelay;         /**< Delay of the last retry [ms] */
+    uint32_t*          asyncResult;
+    uint8_t            asyncRegister[64];
+    SDCard_Callback    asyncCallback;
+    void*              asyncContext;
 } SDCard_Device;
 
+#ifdef WARCOMEB_SDCARD_ARRAY_CARDS
+#ifndef WARCOMEB_SDCARD_ARRAY_SEGMENTS
+#define WARCOMEB_SDCARD_ARRAY_SEGMENTS 16
+#endif
+
+/**
+ * When WARCOMEB_SDCARD_ARRAY_CARDS is defined, up to that number of cards
+ * can be joined into one SDCard_Array, read and written as one device.
+ * In stripe mode (RAID-0) the blocks are spread chunk by chunk over the
+ * cards; in mirror mode (RAID-1) every card holds all blocks, a write goes
+ * to all cards and a read is split between them, and moved again from
+ * another card when it fails. The commands of the cards run together, so
+ * the cards on different buses move their data at the same time.
+ *
+ * The cards are used only by the array. As the asynchronous functions,
+ * the array moves data directly with the cards. A striped request is
+ * moved with one command for each card, or more when a card has more
+ * than WARCOMEB_SDCARD_ARRAY_SEGMENTS chunks of it.
+ */
+typedef enum _SDCard_ArrayMode
+{
+    SDCARD_ARRAYMODE_STRIPE = 0,
+    SDCARD_ARRAYMODE_MIRROR,
+} SDCard_ArrayMode;
+
+typedef struct _SDCard_ArrayStats
+{
+    uint32_t blocks[WARCOMEB_SDCARD_ARRAY_CARDS];    /**< Moved by each card */
+    uint32_t transfers;                      /**< Commands sent to the cards */
+    uint32_t failovers;             /**< Reads moved again from another card */
+} SDCard_ArrayStats;
+
+typedef struct _SDCard_Array
+{
+    SDCard_Device*     cards[WARCOMEB_SDCARD_ARRAY_CARDS];
+    uint8_t            count;                        /**< Cards of the array */
+    SDCard_ArrayMode   mode;
+    uint16_t           chunk;                     /**< Stripe unit [sectors] */
+
+    /* Managed by the library */
+    uint32_t           sectorCount;        /**< Valid after SDCard_arrayInit */
+    uint8_t            nextRead;     /**< First card of the next mirror read */
+    SDCard_Segment     segments[WARCOMEB_SDCARD_ARRAY_CARDS][WARCOMEB_SDCARD_ARRAY_SEGMENTS];
+    SDCard_ArrayStats  stats;
+} SDCard_Array;
+#endif
+
+#ifdef WARCOMEB_SDCARD_STORE_SEGMENTS
+/**
+ * When WARCOMEB_SDCARD_STORE_SEGMENTS is defined, an area of the card can
+ * hold an append-only log of timestamped records (SDCard_Store), over at
+ * most that number of data segments. A segment is an allocation unit of
+ * the card (auSize, or SDCARD_STORE_SEGMENT blocks when the card doesn't
+ * report it); the first segment of the area holds the checkpoints.
+ *
+ * The records are packed into sectors, never across two of them, and the
+ * sectors are written in order into each segment with one CMD25 left
+ * open, pre-erased with ACMD23. When the last segment is full the oldest
+ * one is overwritten. A checkpoint of the head and the tail of the log is
+ * written at each change of segment and by SDCard_storeSync: the mount
+ * starts from it and finds the sectors written later with a binary
+ * search. The first time of each segment is kept into RAM, so
+ * SDCard_storeSeek finds a time with a binary search on the segments and
+ * one on the sectors of a segment.
+ *
+ * The times of the records must not decrease. While the CMD25 is open the
+ * other operations of the card return SDCARD_ERRORS_BUSY; SDCard_storeSync
+ * closes it. The store moves data directly with the card, as the
+ * asynchronous functions.
+ */
+#define SDCARD_STORE_SEGMENT           8192
+#define SDCARD_STORE_HEADER            12      /**< Bytes before the records */
+#define SDCARD_STORE_RECORD            6                /**< Time and length */
+#define SDCARD_STORE_MAX_LENGTH        (512 - SDCARD_STORE_HEADER - SDCARD_STORE_RECORD)
+
+typedef struct _SDCard_StoreCursor
+{
+    uint32_t sequence;                        /**< Sector of the next record */
+    uint16_t offset;            /**< Record bytes of the sector already read */
+} SDCard_StoreCursor;
+
+typedef struct _SDCard_StoreStats
+{
+    uint32_t records;
+    uint32_t bytes;                                 /**< Data of the records */
+    uint32_t sectors;
+    uint32_t padding;              /**< Bytes not used at the end of sectors */
+    uint32_t checkpoints;
+    uint32_t dropped;                       /**< Oldest segments overwritten */
+    uint32_t reads;                /**< Sectors read by mount, seek and read */
+} SDCard_StoreStats;
+
+typedef struct _SDCard_Store
+{
+    SDCard_Device*     dev;
+    uint32_t           start;             /**< First block, aligned to an AU */
+    uint32_t           count;                        /**< Blocks of the area */
+
+    /* Managed by the library */
+    uint32_t           segment;                     /**< Blocks of a segment */
+    uint32_t           segments;         /**< Data segments, 0 until mounted */
+    uint32_t           head;              /**< Sequence of the oldest sector */
+    uint32_t           sequence;       /**< Sequence of the sector in buffer */
+    uint32_t           lastTime;                /**< Time of the last record */
+    uint32_t           checkpoint;        /**< Number of the last checkpoint */
+    uint16_t           used;                 /**< Bytes of records in buffer */
+    uint8_t            buffer[512];                 /**< Sector being filled */
+    uint8_t            sector[512];
+    uint32_t           sectorSequence;    /**< Sector read into sector, or 0 */
+    uint32_t           index[WARCOMEB_SDCARD_STORE_SEGMENTS];
+    SDCard_StoreStats  stats;
+} SDCard_Store;
+#endif
+
 /**
  * @brief
  *
@@ -119,7 +843,22 @@ typedef struct _SDCard_Device
 SDCard_Errors SDCard_init (SDCard_Device* dev);
 
 /**
- * This function control if there is some pending write operations.
+ * This function initializes again a card already initialized, for example
+ * after a reset of the board that doesn't remove the power of the card.
+ * When the card is still out of the idle state, the reset and ACMD41
+ * polling are skipped and, if info is still valid, the registers are not
+ * read again. Otherwise the full initialization is done. The sectors not
+ * flushed are lost, as with SDCard_init.
+ *
+ * @param[in] dev An handle of the device
+ * @return SDCARD_ERRORS_OK if the card is ready, an error otherwise.
+ */
+SDCard_Errors SDCard_reinit (SDCard_Device* dev);
+
+/**
+ * This function control if there is some pending write operations: an
+ * operation still running, or the programming of the last block written
+ * with lazyBusy. It doesn't wait, at most one byte is read from the card.
  *
  * @param[in] dev
  * @return TRUE if the SDC is busy, FALSE otherwise.
@@ -186,6 +925,56 @@ SDCard_Errors SDCard_readBlocks (SDCard_Device* dev,
                                  uint8_t* data,
                                  uint8_t count);
 
+/**
+ * This function reads length bytes starting from offset bytes after the
+ * start of blockAddress, directly into data: the other bytes of the blocks
+ * are received and discarded, without a buffer of a sector. Without CRC
+ * check the reading is stopped with CMD12 as soon as the last byte is
+ * received.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The block of reference
+ * @param[in] offset The offset of the first byte, can be over a block
+ * @param[in] length The number of bytes
+ * @param[out] data
+ * @return SDCARD_ERRORS_OK if the bytes are read, an error otherwise.
+ */
+SDCard_Errors SDCard_readRange (SDCard_Device* dev,
+                                uint32_t blockAddress,
+                                uint32_t offset,
+                                uint32_t length,
+                                uint8_t* data);
+
+/**
+ * This function reads consecutive blocks into a list of segments with one
+ * multiple block read (CMD18), without a contiguous buffer.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list of segments, each one of at least a sector
+ * @param[in] segmentCount The number of segments
+ * @return SDCARD_ERRORS_OK if all blocks are read, an error otherwise.
+ */
+SDCard_Errors SDCard_readv (SDCard_Device* dev,
+                            uint32_t blockAddress,
+                            const SDCard_Segment* segments,
+                            uint32_t segmentCount);
+
+/**
+ * This function writes consecutive blocks from a list of segments with one
+ * multiple block write (CMD25), without a contiguous buffer.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list of segments, each one of at least a sector
+ * @param[in] segmentCount The number of segments
+ * @return SDCARD_ERRORS_OK if all blocks are written, an error otherwise.
+ */
+SDCard_Errors SDCard_writev (SDCard_Device* dev,
+                             uint32_t blockAddress,
+                             const SDCard_Segment* segments,
+                             uint32_t segmentCount);
+
 /**
  * @brief
  *
@@ -202,11 +991,735 @@ SDCard_Errors SDCard_eraseBlocks (SDCard_Device* dev,
  * @brief
  *
  * @param[in] dev
- * @param[out] size The number of sectors of the card
+ * @param[out] size The number of sectors of the card, read by the
+ *                  initialization
  * @return
  */
 SDCard_Errors SDCard_getSectorCount (SDCard_Device* dev,
                                      uint32_t* size);
 
+/**
+ * This function starts a reading session: the consecutive blocks from
+ * blockAddress are read with SDCard_readNext into one multiple block read
+ * (CMD18), without limit of length. The CMD18 is sent with the first block.
+ * Another function called during the session stops the CMD18, the next
+ * SDCard_readNext sends it again.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block of the session
+ * @return SDCARD_ERRORS_OK if the session is started, an error otherwise.
+ */
+SDCard_Errors SDCard_beginRead (SDCard_Device* dev,
+                                uint32_t blockAddress);
+
+/**
+ * This function reads the next block of the reading session.
+ *
+ * @param[in] dev
+ * @param[out] data
+ * @return SDCARD_ERRORS_OK if the block is read, an error otherwise.
+ */
+SDCard_Errors SDCard_readNext (SDCard_Device* dev,
+                               uint8_t* data);
+
+/**
+ * This function stops the reading session (CMD12).
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_OK if the session is stopped, an error otherwise.
+ */
+SDCard_Errors SDCard_endRead (SDCard_Device* dev);
+
+/**
+ * This function starts a writing session: the consecutive blocks from
+ * blockAddress are written with SDCard_writeNext into one multiple block
+ * write (CMD25), without limit of length. The CMD25 is sent with the first
+ * block. Until SDCard_endWrite the other functions return
+ * SDCARD_ERRORS_BUSY.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block of the session
+ * @return SDCARD_ERRORS_OK if the session is started, an error otherwise.
+ */
+SDCard_Errors SDCard_beginWrite (SDCard_Device* dev,
+                                 uint32_t blockAddress);
+
+/**
+ * This function writes the next block of the writing session. When the
+ * block fails the CMD25 is stopped, the next call tries the same block
+ * again with a new CMD25.
+ *
+ * @param[in] dev
+ * @param[in] data
+ * @return SDCARD_ERRORS_OK if the block is written, an error otherwise.
+ */
+SDCard_Errors SDCard_writeNext (SDCard_Device* dev,
+                                const uint8_t* data);
+
+/**
+ * This function stops the writing session (stop token) and waits the end
+ * of programming.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_OK if the session is stopped, an error otherwise.
+ */
+SDCard_Errors SDCard_endWrite (SDCard_Device* dev);
+
+/**
+ * This function starts the initialization of the card and returns
+ * immediately. The sequence goes on into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, an error code otherwise.
+ */
+SDCard_Errors SDCard_initAsync (SDCard_Device* dev,
+                                SDCard_Callback callback,
+                                void* context);
+
+/**
+ * This function starts the initialization of a card already initialized
+ * (see SDCard_reinit) and returns immediately. The sequence goes on into
+ * SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, an error code otherwise.
+ */
+SDCard_Errors SDCard_reinitAsync (SDCard_Device* dev,
+                                  SDCard_Callback callback,
+                                  void* context);
+
+/**
+ * This function starts the reading of one or more blocks and returns
+ * immediately. The data phase is moved with the transferAsync function
+ * when available. The operation goes on into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress
+ * @param[out] data The buffer must be valid until the end of operation
+ * @param[in] count Number of sectors to read (1 to 128)
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+SDCard_Errors SDCard_readBlocksAsync (SDCard_Device* dev,
+                                      uint32_t blockAddress,
+                                      uint8_t* data,
+                                      uint8_t count,
+                                      SDCard_Callback callback,
+                                      void* context);
+
+/**
+ * This function starts the writing of one or more blocks and returns
+ * immediately. The data phase is moved with the transferAsync function
+ * when available. The operation goes on into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress
+ * @param[in] data The buffer must be valid until the end of operation
+ * @param[in] count Number of sectors to write (1 to 128)
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+SDCard_Errors SDCard_writeBlocksAsync (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       const uint8_t* data,
+                                       uint8_t count,
+                                       SDCard_Callback callback,
+                                       void* context);
+
+/**
+ * This function starts the reading of a byte range and returns
+ * immediately, see SDCard_readRange. The operation goes on into
+ * SDCard_poll, the bytes are moved by the CPU (not with transferAsync).
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The block of reference
+ * @param[in] offset The offset of the first byte, can be over a block
+ * @param[in] length The number of bytes
+ * @param[out] data The buffer must be valid until the end of operation
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, an error code otherwise.
+ */
+SDCard_Errors SDCard_readRangeAsync (SDCard_Device* dev,
+                                     uint32_t blockAddress,
+                                     uint32_t offset,
+                                     uint32_t length,
+                                     uint8_t* data,
+                                     SDCard_Callback callback,
+                                     void* context);
+
+/**
+ * This function starts the reading of consecutive blocks into a list of
+ * segments and returns immediately, see SDCard_readv. The operation goes on
+ * into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list and its buffers must be valid until the end
+ *            of operation
+ * @param[in] segmentCount The number of segments
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, an error code otherwise.
+ */
+SDCard_Errors SDCard_readvAsync (SDCard_Device* dev,
+                                 uint32_t blockAddress,
+                                 const SDCard_Segment* segments,
+                                 uint32_t segmentCount,
+                                 SDCard_Callback callback,
+                                 void* context);
+
+/**
+ * This function starts the writing of consecutive blocks from a list of
+ * segments and returns immediately, see SDCard_writev. The operation goes
+ * on into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] segments The list and its buffers must be valid until the end
+ *            of operation
+ * @param[in] segmentCount The number of segments
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, an error code otherwise.
+ */
+SDCard_Errors SDCard_writevAsync (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  const SDCard_Segment* segments,
+                                  uint32_t segmentCount,
+                                  SDCard_Callback callback,
+                                  void* context);
+
+/**
+ * This function starts the erasing of blocks and returns immediately.
+ * The busy time of the card is waited into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress
+ * @param[in] count
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+SDCard_Errors SDCard_eraseBlocksAsync (SDCard_Device* dev,
+                                       uint32_t blockAddress,
+                                       uint32_t count,
+                                       SDCard_Callback callback,
+                                       void* context);
+
+/**
+ * This function starts the reading of the number of sectors of the card
+ * and returns immediately. The CSD is read again from the card and info is
+ * updated. The operation goes on into SDCard_poll.
+ *
+ * @param[in] dev
+ * @param[out] size Must be valid until the end of operation
+ * @param[in] callback Function called at the end of operation, can be NULL
+ * @param[in] context User pointer passed to the callback
+ * @return SDCARD_ERRORS_OK if the operation is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running.
+ */
+SDCard_Errors SDCard_getSectorCountAsync (SDCard_Device* dev,
+                                          uint32_t* size,
+                                          SDCard_Callback callback,
+                                          void* context);
+
+/**
+ * This function moves forward the running operation without blocking: each
+ * call executes a bounded amount of SPI work, at most one command or one
+ * data block. It must be called periodically from the main loop or from
+ * the scheduler, the callback of the operation is executed inside this
+ * function.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_BUSY if the operation is still running, the result
+ *         of the operation when it ends into this call, SDCARD_ERRORS_OK
+ *         when there is no operation.
+ */
+SDCard_Errors SDCard_poll (SDCard_Device* dev);
+
+/**
+ * This function returns the retry statistics of a command.
+ *
+ * @param[in] dev
+ * @param[in] command
+ * @param[out] stats
+ */
+void SDCard_getRetryStats (SDCard_Device* dev,
+                           SDCard_RetryCommand command,
+                           SDCard_RetryStats* stats);
+
+/**
+ * This function returns the duration of the phases of the last
+ * initialization.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+void SDCard_getInitStats (SDCard_Device* dev, SDCard_InitStats* stats);
+
+/**
+ * This function clears the retry statistics of all commands.
+ *
+ * @param[in] dev
+ */
+void SDCard_resetRetryStats (SDCard_Device* dev);
+
+#if defined(WARCOMEB_SDCARD_CACHE_SECTORS) || defined(WARCOMEB_SDCARD_COALESCE_SECTORS)
+/**
+ * This function writes the staging buffer and all dirty sectors of the
+ * cache. The sectors are sorted and the consecutive ones are written with
+ * one multiple block write.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_OK if all sectors are written, an error otherwise.
+ */
+SDCard_Errors SDCard_flush (SDCard_Device* dev);
+#endif
+
+#ifdef WARCOMEB_SDCARD_CACHE_SECTORS
+
+/**
+ * This function returns the statistics of the cache.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+void SDCard_getCacheStats (SDCard_Device* dev, SDCard_CacheStats* stats);
+
+/**
+ * This function clears the statistics of the cache.
+ *
+ * @param[in] dev
+ */
+void SDCard_resetCacheStats (SDCard_Device* dev);
+#endif
+
+#ifdef WARCOMEB_SDCARD_READAHEAD_SECTORS
+/**
+ * This function returns the statistics of the read-ahead.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+void SDCard_getReadAheadStats (SDCard_Device* dev,
+                               SDCard_ReadAheadStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_COALESCE_SECTORS
+/**
+ * This function returns the statistics of the write coalescing.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+/**
+ * This function writes the staging buffer when coalesceTimeout is elapsed
+ * and the device is idle, and waits the end of the write. The timeout is
+ * otherwise checked only by the next read or write: the idle loop must call
+ * this function for bound the time a block stays in RAM.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_OK if the buffer is written or there is nothing to
+ *         write, SDCARD_ERRORS_BUSY if the device is not idle, an error
+ *         code otherwise.
+ */
+SDCard_Errors SDCard_coalesceService (SDCard_Device* dev);
+
+void SDCard_getCoalesceStats (SDCard_Device* dev,
+                              SDCard_CoalesceStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_LOGGER_BUFFERS
+/**
+ * This function starts the logging into count blocks from blockAddress,
+ * count 0 means until the end of the card. While the CMD25 of the logger
+ * is open, the other operations return SDCARD_ERRORS_BUSY.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] count The number of blocks of the area
+ * @return SDCARD_ERRORS_OK if the logger is started, SDCARD_ERRORS_BUSY
+ *         if another operation is running, SDCARD_ERRORS_WRITE_BLOCKS_FAILED
+ *         if the area is not inside the card, an error code otherwise.
+ */
+SDCard_Errors SDCard_startLogger (SDCard_Device* dev,
+                                  uint32_t blockAddress,
+                                  uint32_t count);
+
+/**
+ * This function copies data into the logger buffers and returns
+ * immediately. It can be called from an interrupt service routine, by one
+ * producer at a time. When all buffers are full the remaining data is
+ * lost and counted as overrun.
+ *
+ * @param[in] dev
+ * @param[in] data
+ * @param[in] length The number of bytes
+ * @return The number of bytes stored.
+ */
+uint32_t SDCard_loggerPut (SDCard_Device* dev,
+                           const uint8_t* data,
+                           uint32_t length);
+
+/**
+ * This function goes on with the writing of the full buffers and returns
+ * immediately. It must be called from the main loop in place of
+ * SDCard_poll while the logger runs.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_BUSY while a buffer is written, SDCARD_ERRORS_OK
+ *         when there is nothing to write, an error code when a write is
+ *         failed or the area is full (the logger doesn't write anymore).
+ */
+SDCard_Errors SDCard_loggerService (SDCard_Device* dev);
+
+/**
+ * This function stops the producer, writes the buffers still full and the
+ * sectors of the last buffer (the rest of the last sector is filled with
+ * zeros), and closes the CMD25.
+ *
+ * @param[in] dev
+ * @param[out] blocks The number of blocks written by the logger, can be NULL
+ * @return SDCARD_ERRORS_OK if all data is written, an error otherwise.
+ */
+SDCard_Errors SDCard_stopLogger (SDCard_Device* dev, uint32_t* blocks);
+
+/**
+ * This function returns the statistics of the logger.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+void SDCard_getLoggerStats (SDCard_Device* dev,
+                            SDCard_LoggerStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_DISCARD_RANGES
+/**
+ * This function adds blocks not used anymore to the discard queue and
+ * returns immediately, the card is not accessed. The cached copies of
+ * the blocks are dropped, also when dirty. When the queue is full the
+ * smallest range is forgotten.
+ *
+ * @param[in] dev
+ * @param[in] blockAddress The first block
+ * @param[in] count The number of blocks
+ * @return SDCARD_ERRORS_OK
+ */
+SDCard_Errors SDCard_discardBlocks (SDCard_Device* dev,
+                                    uint32_t blockAddress,
+                                    uint32_t count);
+
+/**
+ * This function starts the erase of one AU of the discard queue when the
+ * device is idle since discardIdle ms and the card is ready, and returns
+ * immediately. It should be called from the idle loop, SDCard_poll ends
+ * the command. The erase ranges only whole AUs (8192 sectors when the AU
+ * size isn't known), the other blocks wait for a merge.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_OK if an erase is started or there is nothing to
+ *         erase, SDCARD_ERRORS_BUSY if the device is not idle, an error
+ *         code otherwise.
+ */
+SDCard_Errors SDCard_discardService (SDCard_Device* dev);
+
+/**
+ * This function returns the statistics of the discard queue. eraseTime is
+ * the time [ms] the card has been busy for the erases of the queue: a
+ * caller of SDCard_eraseBlocks would have waited it. The end of an erase
+ * is seen by the next SDCard_discardService, SDCard_isBusy or operation,
+ * so eraseTime is an upper bound, as precise as the period of these calls
+ * and never over the erase timeout.
+ *
+ * @param[in] dev
+ * @param[out] stats
+ */
+void SDCard_getDiscardStats (SDCard_Device* dev,
+                             SDCard_DiscardStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_QUEUE_CLIENTS
+/**
+ * This function adds a request to the queue and returns immediately. It
+ * can be called by any client, the end of the request is notified by its
+ * result and its callback.
+ *
+ * @param[in] dev
+ * @param[in] request
+ * @return SDCARD_ERRORS_OK if the request is queued, an error code
+ *         otherwise.
+ */
+SDCard_Errors SDCard_submit (SDCard_Device* dev, SDCard_Request* request);
+
+/**
+ * This function goes on with the request running, or starts the next ones,
+ * and returns immediately. It must be called by one task in place of
+ * SDCard_poll, the callbacks of the requests are called by it. The other
+ * functions of the library return SDCARD_ERRORS_BUSY while the queue moves
+ * data.
+ *
+ * @param[in] dev
+ * @return SDCARD_ERRORS_BUSY while there are requests, SDCARD_ERRORS_OK
+ *         when the queue is empty.
+ */
+SDCard_Errors SDCard_queueService (SDCard_Device* dev);
+
+/**
+ * This function returns the statistics of the requests of a client.
+ *
+ * @param[in] dev
+ * @param[in] client
+ * @param[out] stats
+ */
+void SDCard_getQueueStats (SDCard_Device* dev,
+                           uint8_t client,
+                           SDCard_QueueStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_METRICS
+/**
+ * This function copies the metrics measured since the last call of
+ * SDCard_resetMetrics, or since the device was cleared.
+ *
+ * @param[in] dev
+ * @param[out] metrics
+ */
+void SDCard_getMetrics (SDCard_Device* dev, SDCard_Metrics* metrics);
+
+/**
+ * This function clears the metrics.
+ *
+ * @param[in] dev
+ */
+void SDCard_resetMetrics (SDCard_Device* dev);
+#endif
+
+#ifdef WARCOMEB_SDCARD_TRACE_EVENTS
+/**
+ * This function moves the oldest events not read yet into events. It
+ * doesn't lock the recording: it can be called from a task other than
+ * the one of the library, but by one reader at a time. The events
+ * overwritten before they are read are counted into traceLost.
+ *
+ * @param[in] dev
+ * @param[out] events
+ * @param[in] count The size of events
+ * @return The number of events moved.
+ */
+uint32_t SDCard_traceRead (SDCard_Device* dev,
+                           SDCard_TraceEvent* events,
+                           uint32_t count);
+#endif
+
+#ifdef WARCOMEB_SDCARD_SHARED_BUS
+/**
+ * This function attaches the card to the bus, in place of device. The
+ * csPin must be set before: it is configured high, so the card doesn't
+ * answer while the other users move data.
+ *
+ * @param[in] dev
+ * @param[in] bus
+ * @return TRUE if the card is attached, FALSE if the bus has already
+ *         SDCARD_BUS_USERS users.
+ */
+bool SDCard_busAttach (SDCard_Device* dev, SDCard_Bus* bus);
+
+/**
+ * This function adds a peripheral other than a card to the users of the
+ * bus.
+ *
+ * @param[in] bus
+ * @return The identifier of the user, 0 if the bus is full.
+ */
+uint8_t SDCard_busAddUser (SDCard_Bus* bus);
+
+/**
+ * This function takes the bus for the user, without waiting. When the bus
+ * is held by another user, the user is queued and it must call again the
+ * function until it gets the bus. The clock and the mode must be set by
+ * the user when configured is another user, and configured updated.
+ *
+ * @param[in] bus
+ * @param[in] user The identifier from SDCard_busAddUser
+ * @return TRUE if the user holds the bus, FALSE otherwise.
+ */
+bool SDCard_busAcquire (SDCard_Bus* bus, uint8_t user);
+
+/**
+ * This function leaves the bus, that passes to the next user waiting.
+ *
+ * @param[in] bus
+ * @param[in] user The identifier from SDCard_busAddUser
+ */
+void SDCard_busRelease (SDCard_Bus* bus, uint8_t user);
+#endif
+
+#ifdef WARCOMEB_SDCARD_ARRAY_CARDS
+/**
+ * This function initializes the cards of the array not initialized yet,
+ * and computes the sectors of the array: the smallest card, rounded down
+ * to a whole chunk and multiplied by count in stripe mode.
+ *
+ * @param[in] array
+ * @return SDCARD_ERRORS_OK if all cards are ready, an error otherwise.
+ */
+SDCard_Errors SDCard_arrayInit (SDCard_Array* array);
+
+/**
+ * This function reads consecutive blocks of the array.
+ *
+ * @param[in] array
+ * @param[in] blockAddress The first block of the array
+ * @param[out] data The buffer of count sectors
+ * @param[in] count Number of sectors to read
+ * @return SDCARD_ERRORS_OK if the blocks are read, an error otherwise.
+ */
+SDCard_Errors SDCard_arrayReadBlocks (SDCard_Array* array,
+                                      uint32_t blockAddress,
+                                      uint8_t* data,
+                                      uint32_t count);
+
+/**
+ * This function writes consecutive blocks of the array.
+ *
+ * @param[in] array
+ * @param[in] blockAddress The first block of the array
+ * @param[in] data The buffer of count sectors
+ * @param[in] count Number of sectors to write
+ * @return SDCARD_ERRORS_OK if the blocks are written on all cards that
+ *         hold them, an error otherwise.
+ */
+SDCard_Errors SDCard_arrayWriteBlocks (SDCard_Array* array,
+                                       uint32_t blockAddress,
+                                       const uint8_t* data,
+                                       uint32_t count);
+
+/**
+ * @param[in] array
+ * @param[out] size The sectors of the array
+ * @return SDCARD_ERRORS_OK, or SDCARD_ERRORS_CARD_NOT_DETECTED before
+ *         SDCard_arrayInit.
+ */
+SDCard_Errors SDCard_arrayGetSectorCount (SDCard_Array* array,
+                                          uint32_t* size);
+
+/**
+ * @param[in] array
+ * @param[out] stats
+ */
+void SDCard_getArrayStats (SDCard_Array* array, SDCard_ArrayStats* stats);
+#endif
+
+#ifdef WARCOMEB_SDCARD_STORE_SEGMENTS
+/**
+ * This function erases the area of the store and writes its first
+ * checkpoint, the store is left mounted and empty. The card must be
+ * initialized.
+ *
+ * @param[in] store
+ * @return SDCARD_ERRORS_OK if the store is ready, an error otherwise.
+ */
+SDCard_Errors SDCard_storeFormat (SDCard_Store* store);
+
+/**
+ * This function opens the store from its last checkpoint, looks for the
+ * sectors written after it and reads the first time of each segment. The
+ * card must be initialized.
+ *
+ * @param[in] store
+ * @return SDCARD_ERRORS_OK if the store is ready, SDCARD_ERRORS_INIT_FAILED
+ *         when the area doesn't hold a store, an error otherwise.
+ */
+SDCard_Errors SDCard_storeMount (SDCard_Store* store);
+
+/**
+ * This function adds a record at the end of the log. The record is copied
+ * into the sector being filled, that is written when the next record
+ * doesn't fit into it.
+ *
+ * @param[in] store
+ * @param[in] time The time of the record, not lower than the previous one
+ * @param[in] data
+ * @param[in] length From 0 to SDCARD_STORE_MAX_LENGTH bytes
+ * @return SDCARD_ERRORS_OK if the record is stored, an error otherwise.
+ */
+SDCard_Errors SDCard_storeAppend (SDCard_Store* store,
+                                  uint32_t time,
+                                  const uint8_t* data,
+                                  uint16_t length);
+
+/**
+ * This function writes the sector being filled, closes the CMD25 and
+ * writes a checkpoint: all records appended are found by the next mount.
+ *
+ * @param[in] store
+ * @return SDCARD_ERRORS_OK if the log is on the card, an error otherwise.
+ */
+SDCard_Errors SDCard_storeSync (SDCard_Store* store);
+
+/**
+ * This function moves the cursor to the first record with a time not
+ * lower than time, or to the end of the log.
+ *
+ * @param[in] store
+ * @param[in] time
+ * @param[out] cursor
+ * @return SDCARD_ERRORS_OK if the cursor is set, an error otherwise.
+ */
+SDCard_Errors SDCard_storeSeek (SDCard_Store* store,
+                                uint32_t time,
+                                SDCard_StoreCursor* cursor);
+
+/**
+ * This function reads the record of the cursor and moves the cursor to the
+ * next one. A cursor into a segment already overwritten goes on from the
+ * oldest record.
+ *
+ * @param[in] store
+ * @param[in,out] cursor
+ * @param[out] time
+ * @param[out] data A buffer of SDCARD_STORE_MAX_LENGTH bytes, can be NULL
+ * @param[out] length
+ * @return SDCARD_ERRORS_OK if the record is read, SDCARD_ERRORS_END at the
+ *         end of the log (the cursor stays there, and reads the records
+ *         appended later), an error otherwise.
+ */
+SDCard_Errors SDCard_storeRead (SDCard_Store* store,
+                                SDCard_StoreCursor* cursor,
+                                uint32_t* time,
+                                uint8_t* data,
+                                uint16_t* length);
+
+/**
+ * @param[in] store
+ * @param[out] stats
+ */
+void SDCard_getStoreStats (SDCard_Store* store, SDCard_StoreStats* stats);
+#endif
+
+/**
+ * This function must be called by the board when the transfer started with
+ * the transferAsync function is completed. It can be called from an
+ * interrupt service routine.
+ *
+ * @param[in] dev
+ */
+void SDCard_transferComplete (SDCard_Device* dev);
 
 #endif /* __WARCOMEB_SDCARD_H */
@@ -0,0 +1,215 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Benchmark of the block functions against the card emulator.
+ *
+ * For sequential and random reads and writes, of single blocks and of
+ * groups of blocks, it reports MB/s, operations per second and the
+ * percentiles of the latency of one call, all in the virtual time of the
+ * emulator. The options change the timing model:
+ *
+ *   bench_blocks [-c clock_MHz] [-a access_us] [-p program_us]
+ *                [-g gc_period] [-n operations] [-b blocks] [-s]
+ *
+ * -s moves the data byte by byte, without the buffer functions.
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_MAX_BLOCKS 64
+#define BENCH_MAX_OPERATIONS 100000
+
+typedef enum _Bench_Kind
+{
+    BENCH_KIND_READ_BLOCK,
+    BENCH_KIND_READ_BLOCKS,
+    BENCH_KIND_WRITE_BLOCK,
+    BENCH_KIND_WRITE_BLOCKS,
+} Bench_Kind;
+
+static SDCard_Device Bench_device;
+static uint8_t Bench_buffer[BENCH_MAX_BLOCKS * 512];
+static uint64_t Bench_latency[BENCH_MAX_OPERATIONS];
+
+static int Bench_compare (const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t Bench_percentile (uint32_t count, uint32_t percent)
+{
+    uint32_t index = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+    return Bench_latency[(index > 0) ? index - 1 : 0];
+}
+
+/**
+ * The function runs count operations of blocks blocks each, sequential
+ * from block 0 or random over the card, and prints one line of results.
+ */
+static int Bench_run (const char* name,
+                      Bench_Kind kind,
+                      bool isRandom,
+                      uint32_t count,
+                      uint8_t blocks)
+{
+    SDCard_Errors error = SDCARD_ERRORS_OK;
+    uint32_t sectors = SDCardEmu_cards[0].sectors - blocks;
+    uint32_t address = 0;
+    uint64_t start, begin;
+    double seconds;
+    uint32_t i;
+
+    srand(1);
+    start = SDCardEmu_now();
+    for (i = 0; i < count; ++i)
+    {
+        if (isRandom == TRUE)
+            address = (uint32_t)(((uint64_t)rand() * blocks) % sectors);
+
+        begin = SDCardEmu_now();
+        switch (kind)
+        {
+        case BENCH_KIND_READ_BLOCK:
+            error = SDCard_readBlock(&Bench_device,address,Bench_buffer);
+            break;
+        case BENCH_KIND_READ_BLOCKS:
+            error = SDCard_readBlocks(&Bench_device,address,Bench_buffer,blocks);
+            break;
+        case BENCH_KIND_WRITE_BLOCK:
+            error = SDCard_writeBlock(&Bench_device,address,Bench_buffer);
+            break;
+        case BENCH_KIND_WRITE_BLOCKS:
+            error = SDCard_writeBlocks(&Bench_device,address,Bench_buffer,blocks);
+            break;
+        }
+        Bench_latency[i] = SDCardEmu_now() - begin;
+        if (error != SDCARD_ERRORS_OK)
+        {
+            printf("%-22s error %d at block %u\n",name,error,address);
+            return 1;
+        }
+        address += blocks;
+    }
+
+    seconds = (double)(SDCardEmu_now() - start) / 1e9;
+    qsort(Bench_latency,count,sizeof(uint64_t),Bench_compare);
+    printf("%-22s %8.3f MB/s %9.0f IOPS   p50 %7.0f  p90 %7.0f  p99 %7.0f  max %7.0f us\n",
+           name,
+           (double)count * blocks * 512 / 1e6 / seconds,
+           count / seconds,
+           Bench_percentile(count,50) / 1e3,
+           Bench_percentile(count,90) / 1e3,
+           Bench_percentile(count,99) / 1e3,
+           Bench_latency[count - 1] / 1e3);
+    return 0;
+}
+
+int main (int argc, char** argv)
+{
+    SDCardEmu_Card* card = &SDCardEmu_cards[0];
+    uint32_t count = 2000;
+    uint32_t clock = 25;
+    uint8_t blocks = 16;
+    bool isByte = FALSE;
+    int failed = 0;
+    int i;
+
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    for (i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i],"-s") == 0)
+            isByte = TRUE;
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-c") == 0))
+            clock = (uint32_t)atoi(argv[++i]);
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-a") == 0))
+            card->timing.accessTime = (uint32_t)atoi(argv[++i]);
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-p") == 0))
+            card->timing.programTime = (uint32_t)atoi(argv[++i]);
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-g") == 0))
+            card->timing.gcPeriod = (uint32_t)atoi(argv[++i]);
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-n") == 0))
+            count = (uint32_t)atoi(argv[++i]);
+        else if ((i + 1 < argc) && (strcmp(argv[i],"-b") == 0))
+            blocks = (uint8_t)atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr,"usage: %s [-c clock_MHz] [-a access_us] [-p program_us] "
+                           "[-g gc_period] [-n operations] [-b blocks] [-s]\n",argv[0]);
+            return 2;
+        }
+    }
+    if ((count == 0) || (count > BENCH_MAX_OPERATIONS) ||
+        (blocks == 0) || (blocks > BENCH_MAX_BLOCKS) || (clock == 0))
+    {
+        fprintf(stderr,"operations 1-%d, blocks 1-%d\n",BENCH_MAX_OPERATIONS,BENCH_MAX_BLOCKS);
+        return 2;
+    }
+
+    SDCardEmu_setup(&Bench_device,0);
+    Bench_device.setClock = SDCardEmu_setClock;
+    Bench_device.maxClock = clock * 1000000;
+    if (isByte == TRUE)
+    {
+        Bench_device.writeBuffer = 0;
+        Bench_device.readBuffer  = 0;
+    }
+    if (SDCard_init(&Bench_device) != SDCARD_ERRORS_OK)
+    {
+        printf("init failed\n");
+        return 1;
+    }
+    for (i = 0; i < (int)sizeof(Bench_buffer); ++i)
+        Bench_buffer[i] = (uint8_t)(i * 7 + 3);
+
+    printf("clock %u MHz, access %u us, program %u us, page %u blocks, jitter %u %%, "
+           "slow block every %u, %s transfers, %u operations\n",
+           Bench_device.clock / 1000000,
+           card->timing.accessTime,
+           card->timing.programTime,
+           card->timing.pageSectors,
+           card->timing.jitter,
+           card->timing.gcPeriod,
+           (isByte == TRUE) ? "byte" : "buffer",
+           count);
+
+    failed |= Bench_run("sequential writeBlock",BENCH_KIND_WRITE_BLOCK,FALSE,count,1);
+    failed |= Bench_run("sequential readBlock",BENCH_KIND_READ_BLOCK,FALSE,count,1);
+    failed |= Bench_run("random writeBlock",BENCH_KIND_WRITE_BLOCK,TRUE,count,1);
+    failed |= Bench_run("random readBlock",BENCH_KIND_READ_BLOCK,TRUE,count,1);
+    failed |= Bench_run("sequential writeBlocks",BENCH_KIND_WRITE_BLOCKS,FALSE,count,blocks);
+    failed |= Bench_run("sequential readBlocks",BENCH_KIND_READ_BLOCKS,FALSE,count,blocks);
+    failed |= Bench_run("random writeBlocks",BENCH_KIND_WRITE_BLOCKS,TRUE,count,blocks);
+    failed |= Bench_run("random readBlocks",BENCH_KIND_READ_BLOCKS,TRUE,count,blocks);
+    printf("(writeBlocks/readBlocks move %u blocks per call)\n",blocks);
+    return failed;
+}
@@ -0,0 +1,194 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Benchmark of the CRC kernels of WARCOMEB_SDCARD_CRC on the host.
+ *
+ * The library is included in this file for reach its static kernels. Each
+ * kernel is checked against a bit-by-bit reference, then timed over batches
+ * of calls: the mean of all batches and the best batch, per call, in
+ * nanoseconds and, on x86, in TSC cycles. The inputs are hidden from the
+ * compiler by a barrier, so no call is folded or hoisted out of the loop.
+ ******************************************************************************/
+
+#include "../../sdcard.c"
+
+#include <stdio.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC
+#endif
+
+#define BENCH_BATCHES 100
+#define BENCH_BATCH   1000                            // Calls of each batch
+
+static uint8_t Bench_sector[512];
+static uint8_t Bench_command[5] = {0x51,0x00,0x01,0x02,0x03};
+
+static uint16_t Bench_crc16Bitwise (const uint8_t* data, uint16_t length)
+{
+    uint16_t crc = 0;
+    uint8_t bit;
+
+    while (length--)
+    {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static uint8_t Bench_crc7Bitwise (const uint8_t* data, uint8_t length)
+{
+    uint8_t crc = 0;
+    uint8_t value, bit;
+
+    while (length--)
+    {
+        value = *data++;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            crc <<= 1;
+            if ((value ^ crc) & 0x80)
+                crc ^= 0x09;
+            value <<= 1;
+        }
+    }
+    return (uint8_t)((crc << 1) | 0x01);
+}
+
+static uint64_t Bench_ns (void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t Bench_cycles (void)
+{
+#ifdef BENCH_HAS_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// The compiler must assume that the input changed before each call
+#define BENCH_BARRIER(input) __asm__ volatile ("" : : "r" (input) : "memory")
+
+// The kernels under test, with the signature of the timing loop
+static volatile uint16_t Bench_sink;
+
+static void Bench_crc16Table (void)
+{
+    BENCH_BARRIER(Bench_sector);
+    Bench_sink ^= SDCard_crc16(0,Bench_sector,512);
+}
+
+static void Bench_crc16Reference (void)
+{
+    BENCH_BARRIER(Bench_sector);
+    Bench_sink ^= Bench_crc16Bitwise(Bench_sector,512);
+}
+
+static void Bench_crc7Table (void)
+{
+    BENCH_BARRIER(Bench_command);
+    Bench_sink ^= SDCard_crc7(Bench_command,5);
+}
+
+static void Bench_crc7Reference (void)
+{
+    BENCH_BARRIER(Bench_command);
+    Bench_sink ^= Bench_crc7Bitwise(Bench_command,5);
+}
+
+static void Bench_run (const char* name, void (*kernel)(void), uint16_t bytes)
+{
+    uint64_t best = ~0ULL, bestNs = ~0ULL;
+    uint64_t cycles = 0, ns = 0;
+    uint64_t start, startNs, batch, batchNs;
+    uint32_t i, j;
+
+    for (i = 0; i < BENCH_BATCH; ++i)
+        kernel();
+
+    for (j = 0; j < BENCH_BATCHES; ++j)
+    {
+        startNs = Bench_ns();
+        start   = Bench_cycles();
+        for (i = 0; i < BENCH_BATCH; ++i)
+            kernel();
+        batch   = Bench_cycles() - start;
+        batchNs = Bench_ns() - startNs;
+
+        cycles += batch;
+        ns     += batchNs;
+        if (batch < best)
+            best = batch;
+        if (batchNs < bestNs)
+            bestNs = batchNs;
+    }
+
+    printf("%-16s %9.1f ns (best %7.1f)",
+           name,
+           (double)ns / BENCH_BATCHES / BENCH_BATCH,
+           (double)bestNs / BENCH_BATCH);
+#ifdef BENCH_HAS_TSC
+    printf(" %9.1f cycles (best %9.1f) %6.2f cycles/byte",
+           (double)cycles / BENCH_BATCHES / BENCH_BATCH,
+           (double)best / BENCH_BATCH,
+           (double)best / BENCH_BATCH / bytes);
+#endif
+    printf("\n");
+}
+
+int main (void)
+{
+    uint16_t i;
+
+    for (i = 0; i < sizeof(Bench_sector); ++i)
+        Bench_sector[i] = (uint8_t)(i * 7 + 1);
+
+    if ((SDCard_crc16(0,Bench_sector,512) != Bench_crc16Bitwise(Bench_sector,512)) ||
+        (SDCard_crc16(SDCard_crc16(0,Bench_sector,100),Bench_sector + 100,412) !=
+             Bench_crc16Bitwise(Bench_sector,512)) ||
+        (SDCard_crc7(Bench_command,5) != Bench_crc7Bitwise(Bench_command,5)))
+    {
+        printf("CRC kernels don't match the reference\n");
+        return 1;
+    }
+
+    printf("per sector (512 bytes):\n");
+    Bench_run("crc16 table",Bench_crc16Table,512);
+    Bench_run("crc16 bitwise",Bench_crc16Reference,512);
+    printf("per command (5 bytes):\n");
+    Bench_run("crc7 table",Bench_crc7Table,5);
+    Bench_run("crc7 bitwise",Bench_crc7Reference,5);
+    return 0;
+}
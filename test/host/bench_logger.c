@@ -0,0 +1,194 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Benchmark of the logger (WARCOMEB_SDCARD_LOGGER_BUFFERS) against the card
+ * emulator, with a slow block (garbage collection) every gc_period blocks.
+ *
+ * A producer makes rate kB/s of samples, in chunks of 64 bytes, and the main
+ * loop calls SDCard_loggerService. It reports the sustained throughput, the
+ * data lost and the worst stall of the producer: the longest call of
+ * SDCard_loggerPut or SDCard_loggerService. For comparison it reports also
+ * the worst stall of a producer that writes each block by SDCard_writeBlock.
+ * All times are virtual.
+ *
+ *   bench_logger [-r rate_kBps] [-m megabytes] [-g gc_period] [-t gc_us]
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_CHUNK   64
+#define BENCH_ADDRESS 1000
+#define BENCH_IDLE    10000                  // Main loop with nothing to do [ns]
+
+static SDCard_Device Bench_device;
+
+int main (int argc, char** argv)
+{
+    SDCardEmu_Card* card = &SDCardEmu_cards[0];
+    SDCard_LoggerStats stats;
+    SDCard_Errors error;
+    uint8_t chunk[BENCH_CHUNK];
+    uint8_t block[512];
+    double rate = 200.0;
+    uint64_t total = 4;
+    uint64_t produced = 0, stored = 0;
+    uint64_t start, last, begin, stall, worst = 0;
+    double credit = 0, seconds;
+    uint32_t blocks, i, j;
+    uint32_t bad = 0;
+    int k;
+
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    card->timing.gcPeriod = 256;
+    for (k = 1; k < argc; ++k)
+    {
+        if ((k + 1 < argc) && (strcmp(argv[k],"-r") == 0))
+            rate = atof(argv[++k]);
+        else if ((k + 1 < argc) && (strcmp(argv[k],"-m") == 0))
+            total = (uint64_t)atoi(argv[++k]);
+        else if ((k + 1 < argc) && (strcmp(argv[k],"-g") == 0))
+            card->timing.gcPeriod = (uint32_t)atoi(argv[++k]);
+        else if ((k + 1 < argc) && (strcmp(argv[k],"-t") == 0))
+            card->timing.gcTime = (uint32_t)atoi(argv[++k]);
+        else
+        {
+            fprintf(stderr,"usage: %s [-r rate_kBps] [-m megabytes] [-g gc_period] [-t gc_us]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    total <<= 20;
+    if ((rate <= 0) || (total == 0) || (total / 512 > SDCARD_EMU_SECTORS / 2))
+    {
+        fprintf(stderr,"rate > 0, megabytes 1-%d\n",SDCARD_EMU_SECTORS / 4096);
+        return 2;
+    }
+
+    SDCardEmu_setup(&Bench_device,0);
+    if (SDCard_init(&Bench_device) != SDCARD_ERRORS_OK)
+    {
+        printf("init failed\n");
+        return 1;
+    }
+    printf("logger %d buffers of %d sectors, %.0f kB/s, %llu MB, slow block of %u us every %u\n",
+           WARCOMEB_SDCARD_LOGGER_BUFFERS,
+           WARCOMEB_SDCARD_LOGGER_SECTORS,
+           rate,
+           (unsigned long long)(total >> 20),
+           card->timing.gcTime,
+           card->timing.gcPeriod);
+
+    error = SDCard_startLogger(&Bench_device,BENCH_ADDRESS,0);
+    if (error != SDCARD_ERRORS_OK)
+    {
+        printf("startLogger error %d\n",error);
+        return 1;
+    }
+
+    start = SDCardEmu_now();
+    last  = start;
+    while (produced < total)
+    {
+        // The samples made since the last loop, each chunk holds its number
+        credit += (double)(SDCardEmu_now() - last) * rate * 1000 / 1e9;
+        last    = SDCardEmu_now();
+        while ((credit >= BENCH_CHUNK) && (produced < total))
+        {
+            memset(chunk,(uint8_t)(produced / BENCH_CHUNK),BENCH_CHUNK);
+            begin   = SDCardEmu_now();
+            stored += SDCard_loggerPut(&Bench_device,chunk,BENCH_CHUNK);
+            stall   = SDCardEmu_now() - begin;
+            if (stall > worst)
+                worst = stall;
+            produced += BENCH_CHUNK;
+            credit   -= BENCH_CHUNK;
+        }
+
+        begin = SDCardEmu_now();
+        error = SDCard_loggerService(&Bench_device);
+        stall = SDCardEmu_now() - begin;
+        if (stall > worst)
+            worst = stall;
+        if (error == SDCARD_ERRORS_OK)
+            SDCardEmu_advance(BENCH_IDLE);
+        else if (error != SDCARD_ERRORS_BUSY)
+        {
+            printf("loggerService error %d\n",error);
+            return 1;
+        }
+    }
+    seconds = (double)(SDCardEmu_now() - start) / 1e9;
+
+    error = SDCard_stopLogger(&Bench_device,&blocks);
+    SDCard_getLoggerStats(&Bench_device,&stats);
+    printf("stop %d, %u blocks, lost %llu bytes in %u overruns, max %u buffers full, "
+           "longest write %u ms\n",
+           error,
+           blocks,
+           (unsigned long long)(produced - stored),
+           stats.overruns,
+           stats.maxUsed,
+           stats.maxWrite);
+    printf("sustained %.1f kB/s over %.2f s, worst producer stall %.1f us\n",
+           stored / 1000.0 / seconds,
+           seconds,
+           worst / 1e3);
+
+    // Without data lost, each chunk of the card holds its number
+    for (i = 0; (produced == stored) && (i < blocks); ++i)
+    {
+        SDCard_readBlock(&Bench_device,BENCH_ADDRESS + i,block);
+        for (j = 0; j < 512; j += BENCH_CHUNK)
+        {
+            if (block[j] != (uint8_t)((i * 512 + j) / BENCH_CHUNK))
+            {
+                bad++;
+                break;
+            }
+        }
+    }
+    if (produced == stored)
+        printf("verify: %u blocks wrong\n",bad);
+
+    // The same producer with one block and a synchronous write
+    worst = 0;
+    for (i = 0; i < 2048; ++i)
+    {
+        begin = SDCardEmu_now();
+        SDCard_writeBlock(&Bench_device,BENCH_ADDRESS + blocks + i,block);
+        stall = SDCardEmu_now() - begin;
+        if (stall > worst)
+            worst = stall;
+    }
+    printf("synchronous writeBlock: worst producer stall %.1f us\n",worst / 1e3);
+
+    return ((error != SDCARD_ERRORS_OK) || (bad != 0)) ? 1 : 0;
+}
@@ -0,0 +1,69 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Host stand-in of the part of libohiboard used by the library: the SPI and
+ * GPIO functions are implemented by the card emulator (sdcard_emu.c).
+ ******************************************************************************/
+
+#ifndef __LIBOHIBOARD_HOST_H
+#define __LIBOHIBOARD_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t bool;
+#define TRUE  1
+#define FALSE 0
+
+typedef enum
+{
+    ERRORS_NO_ERROR = 0,
+    ERRORS_SPI_TIMEOUT_TX,
+} System_Errors;
+
+typedef struct _Spi_Device
+{
+    uint8_t  number;
+    uint32_t clock;                                                /**< [Hz] */
+} Spi_Device;
+
+typedef Spi_Device* Spi_DeviceHandle;
+
+typedef int Gpio_Pins;
+
+#define GPIO_PINS_OUTPUT 0x01
+#define GPIO_PINS_INPUT  0x02
+
+System_Errors Spi_readByte (Spi_DeviceHandle dev, uint8_t* data);
+System_Errors Spi_writeByte (Spi_DeviceHandle dev, uint8_t data);
+
+System_Errors Gpio_config (Gpio_Pins pin, uint16_t options);
+void Gpio_set (Gpio_Pins pin);
+void Gpio_clear (Gpio_Pins pin);
+uint8_t Gpio_get (Gpio_Pins pin);
+
+#endif /* __LIBOHIBOARD_HOST_H */
@@ -0,0 +1,957 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SDCARD_EMU_CLOCK_DEFAULT  25000000 // [Hz]
+#define SDCARD_EMU_REGISTER_TIME     20000 // [ns]
+#define SDCARD_EMU_TIME_STEP           200 // [ns] for each currentTime call
+
+typedef enum _SDCardEmu_State
+{
+    SDCARDEMU_STATE_IDLE,
+    SDCARDEMU_STATE_READ_SINGLE,
+    SDCARDEMU_STATE_READ_MULTIPLE,
+    SDCARDEMU_STATE_READ_REGISTER,
+    SDCARDEMU_STATE_WRITE_SINGLE,
+    SDCARDEMU_STATE_WRITE_MULTIPLE,
+} SDCardEmu_State;
+
+/**
+ * Protocol state of a card, not visible to the tests.
+ */
+typedef struct _SDCardEmu_Protocol
+{
+    bool               isSelected;
+    bool               isIdle;
+    bool               isAppCommand;
+    bool               isCrcOn;
+    bool               initStarted;
+    uint64_t           initEnd;                                    /**< [ns] */
+
+    uint8_t            frame[6];
+    uint8_t            frameLength;
+
+    uint8_t            output[1024];         /**< Responses waiting the host */
+    uint16_t           outputHead;
+    uint16_t           outputLength;
+
+    SDCardEmu_State    state;
+    uint32_t           block;
+    uint64_t           dataReady;                                  /**< [ns] */
+    uint64_t           busyEnd;                                    /**< [ns] */
+    uint8_t            data[1 + 512 + 2];          /**< Token, block and CRC */
+    uint16_t           dataLength;
+    uint16_t           dataPosition;
+    uint8_t            input[512 + 2];
+    int16_t            inputPosition;              /**< -1 waiting the token */
+    uint32_t           eraseStart;
+    uint32_t           eraseEnd;
+    uint64_t           programmed;       /**< Blocks, for garbage collection */
+    uint32_t           buffered;       /**< Blocks of a CMD25 not programmed */
+    uint32_t           page;                          /**< Last page accessed */
+    uint32_t           random;                    /**< State of the generator */
+    bool               corruptNextRead;
+} SDCardEmu_Protocol;
+
+/**
+ * DMA channel of a bus: its thread moves the bytes of one transfer at a
+ * time, like the DMA of the SPI next to the CPU.
+ */
+typedef struct _SDCardEmu_Dma
+{
+    pthread_t          thread;
+    pthread_mutex_t    mutex;
+    pthread_cond_t     start;
+    bool               isRunning;
+    bool               isPending;
+    Spi_DeviceHandle   bus;
+    SDCard_Device*     dev;                 /**< Device of the card selected */
+    const uint8_t*     txBuffer;
+    uint8_t*           rxBuffer;
+    uint16_t           length;
+} SDCardEmu_Dma;
+
+SDCardEmu_Card SDCardEmu_cards[SDCARD_EMU_CARDS];
+Spi_Device SDCardEmu_buses[SDCARD_EMU_BUSES];
+uint64_t SDCardEmu_collisions;
+_Atomic uint64_t SDCardEmu_dmaTransfers;
+
+static SDCardEmu_Protocol SDCardEmu_protocol[SDCARD_EMU_CARDS];
+static SDCardEmu_Dma SDCardEmu_dma[SDCARD_EMU_BUSES];
+static SDCard_Device* SDCardEmu_dmaDevices[SDCARD_EMU_CARDS];
+
+// The producers of the tests can read the time from other threads
+static _Atomic uint64_t SDCardEmu_clock;
+
+static const SDCardEmu_Timing SDCardEmu_defaultTiming =
+{
+    .callTime       = 400,
+    .accessTime     = 300,
+    .nextAccessTime = 40,
+    .programTime    = 800,
+    .bufferTime     = 30,
+    .stopTime       = 16,
+    .pageSectors    = 32,
+    .jitter         = 50,
+    .gcPeriod       = 512,
+    .gcTime         = 20000,
+    .eraseTime      = 2000,
+    .initTime       = 5000,
+};
+
+static uint16_t SDCardEmu_crc16 (const uint8_t* data, uint16_t length)
+{
+    uint16_t crc = 0;
+    uint8_t bit;
+
+    while (length--)
+    {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (bit = 0; bit < 8; ++bit)
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+static uint8_t SDCardEmu_crc7 (const uint8_t* data, uint8_t length)
+{
+    uint8_t crc = 0;
+    uint8_t value, bit;
+
+    while (length--)
+    {
+        value = *data++;
+        for (bit = 0; bit < 8; ++bit)
+        {
+            crc <<= 1;
+            if ((value ^ crc) & 0x80)
+                crc ^= 0x09;
+            value <<= 1;
+        }
+    }
+    return (uint8_t)((crc << 1) | 0x01);
+}
+
+static void SDCardEmu_put (SDCardEmu_Protocol* card, uint8_t value)
+{
+    card->output[(card->outputHead + card->outputLength++) % sizeof(card->output)] = value;
+}
+
+static bool SDCardEmu_get (SDCardEmu_Protocol* card, uint8_t* value)
+{
+    if (card->outputLength == 0)
+        return FALSE;
+
+    *value = card->output[card->outputHead];
+    card->outputHead = (card->outputHead + 1) % sizeof(card->output);
+    card->outputLength--;
+    return TRUE;
+}
+
+/**
+ * The function returns a time of the model [us] in ns, with the random
+ * extra of the jitter (xorshift32).
+ */
+static uint64_t SDCardEmu_vary (const SDCardEmu_Card* config,
+                                SDCardEmu_Protocol* card,
+                                uint32_t time)
+{
+    uint64_t extra = (uint64_t)time * 10 * config->timing.jitter;
+
+    card->random ^= card->random << 13;
+    card->random ^= card->random >> 17;
+    card->random ^= card->random << 5;
+    return (uint64_t)time * 1000 + ((extra != 0) ? card->random % (extra + 1) : 0);
+}
+
+/**
+ * The function returns the page of a block, and makes it the last one
+ * accessed.
+ *
+ * @return TRUE if the page was the last one accessed.
+ */
+static bool SDCardEmu_page (const SDCardEmu_Card* config,
+                            SDCardEmu_Protocol* card,
+                            uint32_t block)
+{
+    uint32_t sectors = (config->timing.pageSectors != 0) ? config->timing.pageSectors : 1;
+    bool isSame = ((block / sectors) == card->page) ? TRUE : FALSE;
+
+    card->page = block / sectors;
+    return isSame;
+}
+
+/**
+ * The function programs blocks blocks into the flash: the card is busy for
+ * the program time, or for gcTime when the count of blocks programmed
+ * crosses a multiple of gcPeriod.
+ */
+static void SDCardEmu_program (const SDCardEmu_Card* config,
+                               SDCardEmu_Protocol* card,
+                               uint32_t blocks,
+                               uint64_t now)
+{
+    uint64_t before = card->programmed;
+    uint32_t time = config->timing.programTime;
+
+    card->programmed += blocks;
+    if ((config->timing.gcPeriod != 0) &&
+        ((before / config->timing.gcPeriod) != (card->programmed / config->timing.gcPeriod)))
+        time = config->timing.gcTime;
+    card->busyEnd = now + SDCardEmu_vary(config,card,time);
+}
+
+/**
+ * The function prepares a data block for the host: token, data and CRC16.
+ */
+static void SDCardEmu_prepare (SDCardEmu_Protocol* card,
+                               const uint8_t* data,
+                               uint16_t length,
+                               uint64_t ready)
+{
+    uint16_t crc = SDCardEmu_crc16(data,length);
+
+    if (card->corruptNextRead == TRUE)
+    {
+        crc ^= 0x5555;
+        card->corruptNextRead = FALSE;
+    }
+    card->data[0] = 0xFE;
+    memcpy(card->data + 1,data,length);
+    card->data[length + 1] = (uint8_t)(crc >> 8);
+    card->data[length + 2] = (uint8_t)crc;
+    card->dataLength   = length + 3;
+    card->dataPosition = 0;
+    card->dataReady    = ready;
+}
+
+/**
+ * The function fills the CSD: version 2.0 for SDHC, 1.0 otherwise.
+ */
+static void SDCardEmu_csd (const SDCardEmu_Card* config, uint8_t* csd)
+{
+    uint32_t size;
+    uint8_t multiplier = 0;
+
+    memset(csd,0,16);
+    csd[1]  = 0x0E;                                          // TAAC 1 ms
+    csd[3]  = 0x32;                                   // TRAN_SPEED 25 MHz
+    csd[4]  = 0x5B;
+    csd[5]  = 0x59;                                     // READ_BL_LEN 512
+    if (config->isSDHC == TRUE)
+    {
+        size = config->sectors / 1024 - 1;
+        csd[0] = 0x40;
+        csd[7] = (uint8_t)((size >> 16) & 0x3F);
+        csd[8] = (uint8_t)(size >> 8);
+        csd[9] = (uint8_t)size;
+    }
+    else
+    {
+        while ((config->sectors >> (multiplier + 2)) > 4096)
+            multiplier++;
+        size = (config->sectors >> (multiplier + 2)) - 1;
+        csd[6]  = (uint8_t)((size >> 10) & 0x03);
+        csd[7]  = (uint8_t)(size >> 2);
+        csd[8]  = (uint8_t)((size & 0x03) << 6);
+        csd[9]  = (uint8_t)((multiplier >> 1) & 0x03);
+        csd[10] = (uint8_t)((multiplier & 0x01) << 7);
+    }
+    csd[10] |= 0x7F;
+    csd[11]  = 0x80;
+    csd[12]  = 0x0A;                                      // R2W_FACTOR x4
+    csd[13]  = 0x40;
+    csd[15]  = SDCardEmu_crc7(csd,15);
+}
+
+static void SDCardEmu_command (SDCardEmu_Card* config, SDCardEmu_Protocol* card)
+{
+    uint64_t now = SDCardEmu_now();
+    uint8_t index = card->frame[0] & 0x3F;
+    uint32_t argument = ((uint32_t)card->frame[1] << 24) |
+                        ((uint32_t)card->frame[2] << 16) |
+                        ((uint32_t)card->frame[3] << 8) |
+                        card->frame[4];
+    bool isApp = card->isAppCommand;
+    uint8_t r1 = (card->isIdle == TRUE) ? 0x01 : 0x00;
+    uint32_t access;
+    uint8_t reg[64];
+
+    card->isAppCommand = FALSE;
+    config->stats.commands[index]++;
+
+    if (((index == 0) || (index == 8) || (card->isCrcOn == TRUE)) &&
+        (SDCardEmu_crc7(card->frame,5) != card->frame[5]))
+    {
+        config->stats.commandCrcErrors++;
+        SDCardEmu_put(card,0xFF);
+        SDCardEmu_put(card,r1 | 0x08);
+        return;
+    }
+    if (now < card->busyEnd)
+    {
+        config->stats.commandsWhileBusy++;
+        return;
+    }
+
+    // The data commands use byte addresses on SDSC cards
+    if ((config->isSDHC == FALSE) &&
+        ((index == 17) || (index == 18) || (index == 24) || (index == 25) ||
+         (index == 32) || (index == 33)))
+        argument /= 512;
+
+    SDCardEmu_put(card,0xFF);                                          // NCR
+    switch (index)
+    {
+    case 0:
+        card->isIdle      = TRUE;
+        card->isCrcOn     = FALSE;
+        card->initStarted = FALSE;
+        card->state       = SDCARDEMU_STATE_IDLE;
+        SDCardEmu_put(card,0x01);
+        break;
+
+    case 8:
+        SDCardEmu_put(card,r1);
+        SDCardEmu_put(card,0x00);
+        SDCardEmu_put(card,0x00);
+        SDCardEmu_put(card,0x01);
+        SDCardEmu_put(card,(uint8_t)argument);
+        break;
+
+    case 55:
+        card->isAppCommand = TRUE;
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 41:
+        if (isApp == FALSE)
+        {
+            SDCardEmu_put(card,r1 | 0x04);
+            break;
+        }
+        if (card->initStarted == FALSE)
+        {
+            card->initStarted = TRUE;
+            card->initEnd     = now + (uint64_t)config->timing.initTime * 1000;
+        }
+        if (now >= card->initEnd)
+            card->isIdle = FALSE;
+        SDCardEmu_put(card,(card->isIdle == TRUE) ? 0x01 : 0x00);
+        break;
+
+    case 58:
+        SDCardEmu_put(card,r1);
+        SDCardEmu_put(card,(config->isSDHC == TRUE) ? 0xC0 : 0x80);
+        SDCardEmu_put(card,0xFF);
+        SDCardEmu_put(card,0x80);
+        SDCardEmu_put(card,0x00);
+        break;
+
+    case 59:
+        card->isCrcOn = (argument & 0x01) ? TRUE : FALSE;
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 16:
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 9:
+    case 10:
+        if (index == 9)
+        {
+            SDCardEmu_csd(config,reg);
+        }
+        else
+        {
+            memcpy(reg,"\x03SDEMU1\x10\x12\x34\x56\x78\x01\x6A",15);
+            reg[15] = SDCardEmu_crc7(reg,15);
+        }
+        SDCardEmu_put(card,r1);
+        SDCardEmu_prepare(card,reg,16,now + SDCARD_EMU_REGISTER_TIME);
+        card->state = SDCARDEMU_STATE_READ_REGISTER;
+        break;
+
+    case 13:
+        SDCardEmu_put(card,r1);
+        SDCardEmu_put(card,0x00);
+        if (isApp == TRUE)
+        {
+            // SD Status: class 4, AU of the card, erase of 64 AU in 21 s + 1 s
+            memset(reg,0,64);
+            reg[8]  = 0x02;
+            reg[9]  = 0x02;
+            reg[10] = (uint8_t)(config->auSize << 4);
+            reg[12] = 0x40;
+            reg[13] = (0x15 << 2) | 0x01;
+            SDCardEmu_prepare(card,reg,64,now + SDCARD_EMU_REGISTER_TIME);
+            card->state = SDCARDEMU_STATE_READ_REGISTER;
+        }
+        break;
+
+    case 6:
+        // Function group 1 supports and switches to High-Speed
+        memset(reg,0,64);
+        reg[1]  = 0xC8;
+        reg[13] = 0x03;
+        reg[16] = 0x01;
+        SDCardEmu_put(card,r1);
+        SDCardEmu_prepare(card,reg,64,now + SDCARD_EMU_REGISTER_TIME);
+        card->state = SDCARDEMU_STATE_READ_REGISTER;
+        break;
+
+    case 17:
+    case 18:
+        if (argument >= config->sectors)
+        {
+            SDCardEmu_put(card,r1 | 0x40);
+            break;
+        }
+        access = (SDCardEmu_page(config,card,argument) == TRUE) ?
+                 config->timing.nextAccessTime : config->timing.accessTime;
+        SDCardEmu_put(card,r1);
+        card->block = argument;
+        card->state = (index == 17) ? SDCARDEMU_STATE_READ_SINGLE :
+                                      SDCARDEMU_STATE_READ_MULTIPLE;
+        SDCardEmu_prepare(card,
+                          config->storage + (size_t)argument * 512,
+                          512,
+                          now + SDCardEmu_vary(config,card,access));
+        break;
+
+    case 12:
+        // The bytes of the block being read are dropped, a read stops
+        // without busy
+        card->outputLength = 0;
+        SDCardEmu_put(card,0xFF);
+        SDCardEmu_put(card,0x00);
+        card->state = SDCARDEMU_STATE_IDLE;
+        break;
+
+    case 23:
+        if (isApp == TRUE)
+            config->stats.preErased += argument;
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 24:
+    case 25:
+        if (argument >= config->sectors)
+        {
+            SDCardEmu_put(card,r1 | 0x40);
+            break;
+        }
+        SDCardEmu_put(card,r1);
+        card->block         = argument;
+        card->inputPosition = -1;
+        card->buffered      = 0;
+        card->state = (index == 24) ? SDCARDEMU_STATE_WRITE_SINGLE :
+                                      SDCARDEMU_STATE_WRITE_MULTIPLE;
+        break;
+
+    case 32:
+        card->eraseStart = argument;
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 33:
+        card->eraseEnd = argument;
+        SDCardEmu_put(card,r1);
+        break;
+
+    case 38:
+        SDCardEmu_put(card,r1);
+        if ((card->eraseEnd >= card->eraseStart) && (card->eraseEnd < config->sectors))
+        {
+            memset(config->storage + (size_t)card->eraseStart * 512,
+                   0,
+                   (size_t)(card->eraseEnd - card->eraseStart + 1) * 512);
+            config->stats.blocksErased += card->eraseEnd - card->eraseStart + 1;
+        }
+        card->busyEnd = now + (uint64_t)config->timing.eraseTime * 1000;
+        break;
+
+    default:
+        SDCardEmu_put(card,r1 | 0x04);                    // Illegal command
+        break;
+    }
+}
+
+/**
+ * The function receives a byte of a block written by the host.
+ *
+ * @return TRUE if the byte belongs to the data phase.
+ */
+static bool SDCardEmu_receive (SDCardEmu_Card* config,
+                               SDCardEmu_Protocol* card,
+                               uint8_t value)
+{
+    uint64_t now = SDCardEmu_now();
+    bool isSamePage;
+    uint16_t crc;
+
+    if (card->inputPosition < 0)
+    {
+        if (((card->state == SDCARDEMU_STATE_WRITE_SINGLE) && (value == 0xFE)) ||
+            ((card->state == SDCARDEMU_STATE_WRITE_MULTIPLE) && (value == 0xFC)))
+        {
+            card->inputPosition = 0;
+            return TRUE;
+        }
+        if ((card->state == SDCARDEMU_STATE_WRITE_MULTIPLE) && (value == 0xFD))
+        {
+            // The blocks still in the buffer are programmed now
+            card->state = SDCARDEMU_STATE_IDLE;
+            if (card->buffered != 0)
+                SDCardEmu_program(config,card,card->buffered,now);
+            else
+                card->busyEnd = now;
+            card->busyEnd += (uint64_t)config->timing.stopTime * 1000;
+            card->buffered = 0;
+            SDCardEmu_put(card,0xFF);
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    card->input[card->inputPosition++] = value;
+    if (card->inputPosition < (int16_t)sizeof(card->input))
+        return TRUE;
+
+    crc = ((uint16_t)card->input[512] << 8) | card->input[513];
+    if ((card->isCrcOn == TRUE) && (crc != SDCardEmu_crc16(card->input,512)))
+    {
+        config->stats.dataCrcErrors++;
+        SDCardEmu_put(card,0x0B);
+        card->state = SDCARDEMU_STATE_IDLE;
+        return TRUE;
+    }
+
+    memcpy(config->storage + (size_t)card->block * 512,card->input,512);
+    config->stats.blocksWritten++;
+    SDCardEmu_put(card,0xE5);
+    isSamePage = SDCardEmu_page(config,card,card->block);
+
+    if (card->state == SDCARDEMU_STATE_WRITE_SINGLE)
+    {
+        // Out of the page accessed last, the card reads the page first
+        SDCardEmu_program(config,card,1,now);
+        if (isSamePage == FALSE)
+            card->busyEnd += SDCardEmu_vary(config,card,config->timing.accessTime);
+        card->state = SDCARDEMU_STATE_IDLE;
+    }
+    else
+    {
+        // A CMD25 programs the page when its last block arrives
+        card->buffered++;
+        if ((config->timing.pageSectors <= 1) ||
+            (((card->block + 1) % config->timing.pageSectors) == 0))
+        {
+            SDCardEmu_program(config,card,card->buffered,now);
+            card->buffered = 0;
+        }
+        else
+        {
+            card->busyEnd = now + (uint64_t)config->timing.bufferTime * 1000;
+        }
+        card->block++;
+        card->inputPosition = -1;
+    }
+    return TRUE;
+}
+
+/**
+ * The function moves one byte between the host and a selected card.
+ */
+static uint8_t SDCardEmu_exchange (SDCardEmu_Card* config,
+                                   SDCardEmu_Protocol* card,
+                                   uint8_t value)
+{
+    uint64_t now = SDCardEmu_now();
+    uint8_t result = 0xFF;
+
+    config->stats.bytes++;
+
+    // Output: responses, busy, then data blocks
+    if (SDCardEmu_get(card,&result) == TRUE)
+    {
+    }
+    else if (now < card->busyEnd)
+    {
+        result = 0x00;
+    }
+    else if (((card->state == SDCARDEMU_STATE_READ_SINGLE) ||
+              (card->state == SDCARDEMU_STATE_READ_MULTIPLE) ||
+              (card->state == SDCARDEMU_STATE_READ_REGISTER)) &&
+             (card->dataPosition < card->dataLength) &&
+             (now >= card->dataReady))
+    {
+        result = card->data[card->dataPosition++];
+        if ((card->dataPosition == card->dataLength) &&
+            (card->state != SDCARDEMU_STATE_READ_REGISTER))
+            config->stats.blocksRead++;
+        if (card->dataPosition == card->dataLength)
+        {
+            if ((card->state == SDCARDEMU_STATE_READ_MULTIPLE) &&
+                (card->block + 1 < config->sectors))
+            {
+                card->block++;
+                SDCardEmu_prepare(card,
+                                  config->storage + (size_t)card->block * 512,
+                                  512,
+                                  now + SDCardEmu_vary(config,card,config->timing.nextAccessTime));
+                SDCardEmu_page(config,card,card->block);
+            }
+            else if (card->state != SDCARDEMU_STATE_READ_MULTIPLE)
+            {
+                card->state = SDCARDEMU_STATE_IDLE;
+            }
+        }
+    }
+
+    // Input: data of a write, or command frames
+    if (((card->state == SDCARDEMU_STATE_WRITE_SINGLE) ||
+         (card->state == SDCARDEMU_STATE_WRITE_MULTIPLE)) &&
+        (now >= card->busyEnd) &&
+        (card->frameLength == 0) &&
+        (SDCardEmu_receive(config,card,value) == TRUE))
+        return result;
+
+    if (card->frameLength == 0)
+    {
+        if ((value & 0xC0) == 0x40)
+            card->frame[card->frameLength++] = value;
+    }
+    else
+    {
+        card->frame[card->frameLength++] = value;
+        if (card->frameLength == 6)
+        {
+            card->frameLength = 0;
+            SDCardEmu_command(config,card);
+        }
+    }
+    return result;
+}
+
+/**
+ * The function moves one byte on a bus: it takes the time of the byte at
+ * the clock of the bus, and goes to the cards selected on it.
+ */
+static uint8_t SDCardEmu_bus (Spi_DeviceHandle dev, uint8_t value)
+{
+    uint32_t clock = ((dev != 0) && (dev->clock != 0)) ? dev->clock : SDCARD_EMU_CLOCK_DEFAULT;
+    uint8_t result = 0xFF;
+    uint8_t selected = 0;
+    uint8_t i;
+
+    SDCardEmu_advance(8000000000ULL / clock);
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        if ((SDCardEmu_protocol[i].isSelected == FALSE) ||
+            (SDCardEmu_cards[i].isPresent == FALSE) ||
+            ((SDCardEmu_cards[i].bus != 0) && (SDCardEmu_cards[i].bus != dev)))
+            continue;
+
+        selected++;
+        result &= SDCardEmu_exchange(&SDCardEmu_cards[i],&SDCardEmu_protocol[i],value);
+    }
+    if (selected > 1)
+        SDCardEmu_collisions++;
+    return result;
+}
+
+static void SDCardEmu_call (Spi_DeviceHandle dev)
+{
+    uint8_t i;
+
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        if ((SDCardEmu_cards[i].bus == 0) || (SDCardEmu_cards[i].bus == dev))
+        {
+            SDCardEmu_advance(SDCardEmu_cards[i].timing.callTime);
+            return;
+        }
+    }
+    SDCardEmu_advance(SDCardEmu_defaultTiming.callTime);
+}
+
+void SDCardEmu_reset (uint32_t sectors)
+{
+    uint8_t i;
+
+    atomic_store(&SDCardEmu_clock,0);
+    atomic_store(&SDCardEmu_dmaTransfers,0);
+    SDCardEmu_collisions = 0;
+    for (i = 0; i < SDCARD_EMU_BUSES; ++i)
+    {
+        SDCardEmu_buses[i].number = i;
+        SDCardEmu_buses[i].clock  = SDCARD_EMU_CLOCK_DEFAULT;
+    }
+
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        free(SDCardEmu_cards[i].storage);
+        memset(&SDCardEmu_cards[i],0,sizeof(SDCardEmu_Card));
+        memset(&SDCardEmu_protocol[i],0,sizeof(SDCardEmu_Protocol));
+
+        SDCardEmu_cards[i].csPin     = SDCARD_EMU_CS_PIN + i;
+        SDCardEmu_cards[i].cpPin     = SDCARD_EMU_CP_PIN + i;
+        SDCardEmu_cards[i].bus       = &SDCardEmu_buses[0];
+        SDCardEmu_cards[i].isPresent = TRUE;
+        SDCardEmu_cards[i].isSDHC    = TRUE;
+        SDCardEmu_cards[i].sectors   = sectors;
+        SDCardEmu_cards[i].auSize    = 9;
+        SDCardEmu_cards[i].timing    = SDCardEmu_defaultTiming;
+        SDCardEmu_cards[i].storage   = calloc(sectors,512);
+        SDCardEmu_protocol[i].isIdle = TRUE;
+        SDCardEmu_protocol[i].page   = UINT32_MAX;
+        SDCardEmu_protocol[i].random = 2463534242u + i;
+    }
+}
+
+void SDCardEmu_powerCycle (uint8_t card)
+{
+    uint32_t random = SDCardEmu_protocol[card].random;
+
+    memset(&SDCardEmu_protocol[card],0,sizeof(SDCardEmu_Protocol));
+    SDCardEmu_protocol[card].isIdle = TRUE;
+    SDCardEmu_protocol[card].page   = UINT32_MAX;
+    SDCardEmu_protocol[card].random = random;
+}
+
+void SDCardEmu_setup (SDCard_Device* dev, uint8_t card)
+{
+    memset(dev,0,sizeof(SDCard_Device));
+    dev->device      = SDCardEmu_cards[card].bus;
+    dev->csPin       = SDCardEmu_cards[card].csPin;
+    dev->cpPin       = SDCardEmu_cards[card].cpPin;
+    dev->cpType      = SDCARD_PRESENTTYPE_HIGH;
+    dev->delayTime   = SDCardEmu_delay;
+    dev->currentTime = SDCardEmu_time;
+    dev->writeBuffer = SDCardEmu_writeBuffer;
+    dev->readBuffer  = SDCardEmu_readBuffer;
+}
+
+/**
+ * The thread of a DMA channel: it waits a transfer, moves its bytes on the
+ * bus and calls SDCard_transferComplete, as the interrupt of a DMA would.
+ */
+static void* SDCardEmu_dmaThread (void* argument)
+{
+    SDCardEmu_Dma* dma = argument;
+    SDCard_Device* dev;
+    uint8_t value;
+    uint16_t i;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&dma->mutex);
+        while (dma->isPending == FALSE)
+            pthread_cond_wait(&dma->start,&dma->mutex);
+        pthread_mutex_unlock(&dma->mutex);
+
+        SDCardEmu_call(dma->bus);
+        for (i = 0; i < dma->length; ++i)
+        {
+            value = SDCardEmu_bus(dma->bus,(dma->txBuffer != 0) ? dma->txBuffer[i] : 0xFF);
+            if (dma->rxBuffer != 0)
+                dma->rxBuffer[i] = value;
+        }
+        atomic_fetch_add(&SDCardEmu_dmaTransfers,1);
+
+        // The next transfer can be started by the callback of this one
+        pthread_mutex_lock(&dma->mutex);
+        dev = dma->dev;
+        dma->isPending = FALSE;
+        pthread_mutex_unlock(&dma->mutex);
+        atomic_thread_fence(memory_order_seq_cst);
+        SDCard_transferComplete(dev);
+    }
+    return 0;
+}
+
+/**
+ * The transferAsync function of the devices with DMA: it gives the
+ * transfer to the channel of the bus and returns immediately.
+ */
+static void SDCardEmu_transferAsync (Spi_DeviceHandle dev,
+                                     const uint8_t* txBuffer,
+                                     uint8_t* rxBuffer,
+                                     uint16_t length)
+{
+    SDCardEmu_Dma* dma = &SDCardEmu_dma[dev->number];
+    SDCard_Device* device = 0;
+    uint8_t i;
+
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        if ((SDCardEmu_protocol[i].isSelected == TRUE) &&
+            ((SDCardEmu_cards[i].bus == 0) || (SDCardEmu_cards[i].bus == dev)))
+            device = SDCardEmu_dmaDevices[i];
+    }
+
+    pthread_mutex_lock(&dma->mutex);
+    dma->bus      = dev;
+    dma->dev      = device;
+    dma->txBuffer = txBuffer;
+    dma->rxBuffer = rxBuffer;
+    dma->length   = length;
+    dma->isPending = TRUE;
+    pthread_cond_signal(&dma->start);
+    pthread_mutex_unlock(&dma->mutex);
+}
+
+void SDCardEmu_setupDma (SDCard_Device* dev, uint8_t card)
+{
+    uint8_t i;
+
+    SDCardEmu_dmaDevices[card] = dev;
+    dev->transferAsync = SDCardEmu_transferAsync;
+
+    for (i = 0; i < SDCARD_EMU_BUSES; ++i)
+    {
+        if (SDCardEmu_dma[i].isRunning == TRUE)
+            continue;
+
+        pthread_mutex_init(&SDCardEmu_dma[i].mutex,0);
+        pthread_cond_init(&SDCardEmu_dma[i].start,0);
+        pthread_create(&SDCardEmu_dma[i].thread,0,SDCardEmu_dmaThread,&SDCardEmu_dma[i]);
+        pthread_detach(SDCardEmu_dma[i].thread);
+        SDCardEmu_dma[i].isRunning = TRUE;
+    }
+}
+
+uint64_t SDCardEmu_now (void)
+{
+    return atomic_load(&SDCardEmu_clock);
+}
+
+void SDCardEmu_advance (uint64_t ns)
+{
+    atomic_fetch_add(&SDCardEmu_clock,ns);
+}
+
+void SDCardEmu_corruptNextRead (uint8_t card)
+{
+    SDCardEmu_protocol[card].corruptNextRead = TRUE;
+}
+
+void SDCardEmu_delay (uint32_t delay)
+{
+    SDCardEmu_advance((uint64_t)delay * 1000000);
+}
+
+uint32_t SDCardEmu_time (void)
+{
+    // The polling loops of the library see the time going on
+    return (uint32_t)((atomic_fetch_add(&SDCardEmu_clock,SDCARD_EMU_TIME_STEP) + SDCARD_EMU_TIME_STEP) / 1000000);
+}
+
+void SDCardEmu_writeBuffer (Spi_DeviceHandle dev,
+                            const uint8_t* buffer,
+                            uint16_t length)
+{
+    SDCardEmu_call(dev);
+    while (length--)
+        SDCardEmu_bus(dev,*buffer++);
+}
+
+void SDCardEmu_readBuffer (Spi_DeviceHandle dev,
+                           uint8_t* buffer,
+                           uint16_t length)
+{
+    SDCardEmu_call(dev);
+    while (length--)
+        *buffer++ = SDCardEmu_bus(dev,0xFF);
+}
+
+uint32_t SDCardEmu_setClock (Spi_DeviceHandle dev, uint32_t frequency)
+{
+    dev->clock = frequency;
+    return frequency;
+}
+
+System_Errors Spi_readByte (Spi_DeviceHandle dev, uint8_t* data)
+{
+    SDCardEmu_call(dev);
+    *data = SDCardEmu_bus(dev,0xFF);
+    return ERRORS_NO_ERROR;
+}
+
+System_Errors Spi_writeByte (Spi_DeviceHandle dev, uint8_t data)
+{
+    SDCardEmu_call(dev);
+    SDCardEmu_bus(dev,data);
+    return ERRORS_NO_ERROR;
+}
+
+System_Errors Gpio_config (Gpio_Pins pin, uint16_t options)
+{
+    (void) pin;
+    (void) options;
+    return ERRORS_NO_ERROR;
+}
+
+static void SDCardEmu_select (Gpio_Pins pin, bool isSelected)
+{
+    uint8_t i;
+
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        if (SDCardEmu_cards[i].csPin == pin)
+            SDCardEmu_protocol[i].isSelected = isSelected;
+    }
+}
+
+void Gpio_set (Gpio_Pins pin)
+{
+    SDCardEmu_select(pin,FALSE);
+}
+
+void Gpio_clear (Gpio_Pins pin)
+{
+    SDCardEmu_select(pin,TRUE);
+}
+
+uint8_t Gpio_get (Gpio_Pins pin)
+{
+    uint8_t i;
+
+    for (i = 0; i < SDCARD_EMU_CARDS; ++i)
+    {
+        if (SDCardEmu_cards[i].cpPin == pin)
+            return (SDCardEmu_cards[i].isPresent == TRUE) ? 1 : 0;
+    }
+    return 0;
+}
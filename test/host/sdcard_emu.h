@@ -0,0 +1,181 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Host emulator of SD cards in SPI mode.
+ *
+ * The emulator implements Spi_readByte, Spi_writeByte and the Gpio_*
+ * functions of libohiboard.h, and the delayTime, currentTime, writeBuffer,
+ * readBuffer, setClock and transferAsync functions of SDCard_Device. The
+ * time is virtual: it advances only with the bytes moved on the bus, the
+ * calls and the delays, so the results don't depend on the host. The DMA
+ * of each bus is a thread, that moves the bytes while the caller polls.
+ *
+ * Each card answers the commands CMD0, CMD6, CMD8, CMD9, CMD10, CMD12,
+ * CMD13, CMD16, CMD17, CMD18, CMD24, CMD25, CMD32, CMD33, CMD38, CMD55,
+ * CMD58, CMD59 and the application commands ACMD13, ACMD23 and ACMD41.
+ * Its timing model is in SDCardEmu_Timing; the clock of the bus is set by
+ * setClock. The flash is made of pages of pageSectors blocks:
+ *
+ * - a read pays accessTime when its first block is out of the page accessed
+ *   last, nextAccessTime otherwise, and nextAccessTime for each next block
+ *   of a CMD18;
+ * - a CMD24 programs its page, and pays accessTime more out of the page
+ *   accessed last; a CMD25 buffers the blocks and programs the page when
+ *   its last block arrives, or at the stop token;
+ * - every gcPeriod blocks programmed, the program takes gcTime instead;
+ * - the access and program times grow by a random 0-jitter %, from a
+ *   generator with a fixed seed, so the runs are repeatable.
+ ******************************************************************************/
+
+#ifndef __SDCARD_EMU_H
+#define __SDCARD_EMU_H
+
+#include "sdcard.h"
+
+#define SDCARD_EMU_CARDS      2
+#define SDCARD_EMU_BUSES      2
+#define SDCARD_EMU_CS_PIN     10             // Card i is selected by pin 10+i
+#define SDCARD_EMU_CP_PIN     20          // Card i is present when pin 20+i
+#define SDCARD_EMU_SECTORS    65536
+
+typedef struct _SDCardEmu_Timing
+{
+    uint32_t callTime;                   /**< Overhead of each SPI call [ns] */
+    uint32_t accessTime;      /**< First block of a read out of the page [us] */
+    uint32_t nextAccessTime;   /**< Next blocks, or a block of the page [us] */
+    uint32_t programTime;                    /**< Programming of a page [us] */
+    uint32_t bufferTime;  /**< Block of a CMD25 that doesn't end a page [us] */
+    uint32_t stopTime;                   /**< Busy after the stop token [us] */
+    uint32_t pageSectors;                  /**< Blocks of a page of the flash */
+    uint32_t jitter;        /**< Random extra on access and program times [%] */
+    uint32_t gcPeriod;             /**< Blocks between slow ones, 0 for none */
+    uint32_t gcTime;               /**< Slow block (garbage collection) [us] */
+    uint32_t eraseTime;                              /**< Erase command [us] */
+    uint32_t initTime;              /**< ACMD41 answers idle until then [us] */
+} SDCardEmu_Timing;
+
+typedef struct _SDCardEmu_Stats
+{
+    uint64_t commands[64];                  /**< Commands received, by index */
+    uint64_t bytes;                          /**< Bytes moved while selected */
+    uint64_t blocksRead;
+    uint64_t blocksWritten;
+    uint64_t blocksErased;
+    uint64_t preErased;                      /**< Blocks requested by ACMD23 */
+    uint64_t commandCrcErrors;
+    uint64_t dataCrcErrors;
+    uint64_t commandsWhileBusy;       /**< Ignored, the card was programming */
+} SDCardEmu_Stats;
+
+typedef struct _SDCardEmu_Card
+{
+    Gpio_Pins          csPin;
+    Gpio_Pins          cpPin;
+    Spi_DeviceHandle   bus;                  /**< SPI of the card, 0 for any */
+    bool               isPresent;
+    bool               isSDHC;  /**< FALSE for SDSC: CSD 1.0, byte addresses */
+    uint32_t           sectors;
+    uint8_t            auSize;     /**< AU_SIZE of the SD Status, 9 for 4 MB */
+    SDCardEmu_Timing   timing;
+    uint8_t*           storage;             /**< sectors blocks of 512 bytes */
+    SDCardEmu_Stats    stats;
+} SDCardEmu_Card;
+
+extern SDCardEmu_Card SDCardEmu_cards[SDCARD_EMU_CARDS];
+extern Spi_Device SDCardEmu_buses[SDCARD_EMU_BUSES];
+extern uint64_t SDCardEmu_collisions;   /**< Bytes seen by two cards at once */
+extern _Atomic uint64_t SDCardEmu_dmaTransfers;  /**< Moved by the threads */
+
+/**
+ * This function resets the time and all cards: they are present, SDHC, on
+ * the first bus, with sectors blocks set to zero, AU of 4 MB and the
+ * default timing.
+ *
+ * @param[in] sectors
+ */
+void SDCardEmu_reset (uint32_t sectors);
+
+/**
+ * This function removes the power of a card: it drops the command running,
+ * also a CMD25 left open, and must be initialized again. The blocks already
+ * received stay on the card.
+ *
+ * @param[in] card
+ */
+void SDCardEmu_powerCycle (uint8_t card);
+
+/**
+ * This function sets the pins, the bus and the functions of a device for
+ * use a card of the emulator.
+ *
+ * @param[out] dev
+ * @param[in] card
+ */
+void SDCardEmu_setup (SDCard_Device* dev, uint8_t card);
+
+/**
+ * This function gives to a device the transferAsync function of the
+ * emulator: the data phase of the asynchronous functions is moved by the
+ * thread of the bus, that calls SDCard_transferComplete at its end, while
+ * the caller goes on with SDCard_poll. Call it after SDCardEmu_setup.
+ *
+ * @param[in] dev
+ * @param[in] card The card of the device
+ */
+void SDCardEmu_setupDma (SDCard_Device* dev, uint8_t card);
+
+/**
+ * @return The virtual time [ns]
+ */
+uint64_t SDCardEmu_now (void);
+
+/**
+ * This function moves the virtual time forward, for example the work of
+ * the application between two calls of the library.
+ *
+ * @param[in] ns
+ */
+void SDCardEmu_advance (uint64_t ns);
+
+/**
+ * This function makes the CRC16 of the next block read wrong.
+ *
+ * @param[in] card
+ */
+void SDCardEmu_corruptNextRead (uint8_t card);
+
+void SDCardEmu_delay (uint32_t delay);
+uint32_t SDCardEmu_time (void);
+void SDCardEmu_writeBuffer (Spi_DeviceHandle dev,
+                            const uint8_t* buffer,
+                            uint16_t length);
+void SDCardEmu_readBuffer (Spi_DeviceHandle dev,
+                           uint8_t* buffer,
+                           uint16_t length);
+uint32_t SDCardEmu_setClock (Spi_DeviceHandle dev, uint32_t frequency);
+
+#endif /* __SDCARD_EMU_H */
@@ -0,0 +1,254 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Test of the card array (WARCOMEB_SDCARD_ARRAY_CARDS) against the card
+ * emulator, with two cards on two buses.
+ *
+ * Each block written holds its number into the array. In stripe mode the
+ * test writes requests that start and end inside a chunk, and longer than
+ * the WARCOMEB_SDCARD_ARRAY_SEGMENTS chunks of a round, then checks where
+ * each block is on the cards and reads it back from other offsets. In
+ * mirror mode it checks that both cards hold the blocks, that the reads
+ * are split between them, and that a read goes on from the other card
+ * when one is removed. The exit code is the number of failures.
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_CHUNK    8
+#define TEST_MAX      128
+
+static SDCard_Device Test_devices[2];
+static SDCard_Array Test_array;
+static int Test_failures;
+
+static uint8_t Test_data[TEST_MAX * 512];
+static uint8_t Test_read[TEST_MAX * 512];
+
+static void Test_check (bool condition, const char* message)
+{
+    if (condition == FALSE)
+    {
+        printf("FAIL: %s\n",message);
+        Test_failures++;
+    }
+}
+
+static uint32_t Test_get32 (const uint8_t* data)
+{
+    return ((uint32_t)data[0]) | ((uint32_t)data[1] << 8) |
+           ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+/**
+ * The function fills count blocks with their number into the array, and
+ * a tag that changes at each write.
+ */
+static void Test_fill (uint32_t blockAddress, uint32_t count, uint8_t tag)
+{
+    uint32_t i, block;
+
+    for (i = 0; i < count; ++i)
+    {
+        block = blockAddress + i;
+        memset(&Test_data[i * 512],tag,512);
+        Test_data[i * 512 + 0] = (uint8_t)block;
+        Test_data[i * 512 + 1] = (uint8_t)(block >> 8);
+        Test_data[i * 512 + 2] = (uint8_t)(block >> 16);
+        Test_data[i * 512 + 3] = (uint8_t)(block >> 24);
+    }
+}
+
+/**
+ * The function checks that count blocks of the buffer hold the blocks
+ * from blockAddress, written with tag.
+ */
+static bool Test_isRight (const uint8_t* data, uint32_t blockAddress, uint32_t count, uint8_t tag)
+{
+    uint32_t i;
+
+    for (i = 0; i < count; ++i)
+    {
+        if ((Test_get32(&data[i * 512]) != blockAddress + i) ||
+            (data[i * 512 + 4] != tag) ||
+            (data[i * 512 + 511] != tag))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+static void Test_setup (SDCard_ArrayMode mode)
+{
+    memset(&Test_array,0,sizeof(SDCard_Array));
+    Test_array.cards[0] = &Test_devices[0];
+    Test_array.cards[1] = &Test_devices[1];
+    Test_array.count    = 2;
+    Test_array.mode     = mode;
+    Test_array.chunk    = TEST_CHUNK;
+    Test_check(SDCard_arrayInit(&Test_array) == SDCARD_ERRORS_OK,"arrayInit");
+}
+
+/**
+ * The function writes a striped request, checks the block of each card
+ * with the stripe address math and reads the request back.
+ */
+static void Test_stripe (const char* name, uint32_t blockAddress, uint32_t count, uint8_t tag)
+{
+    SDCard_ArrayStats before, after;
+    uint32_t i, block, stripe, cardBlock;
+    uint8_t card;
+    bool isPlaced = TRUE;
+
+    SDCard_getArrayStats(&Test_array,&before);
+    Test_fill(blockAddress,count,tag);
+    Test_check(SDCard_arrayWriteBlocks(&Test_array,blockAddress,Test_data,count) == SDCARD_ERRORS_OK,name);
+    SDCard_getArrayStats(&Test_array,&after);
+
+    // Block b is into chunk b / chunk, the chunks go round the cards
+    for (i = 0; i < count; ++i)
+    {
+        block     = blockAddress + i;
+        stripe    = block / TEST_CHUNK;
+        card      = (uint8_t)(stripe % 2);
+        cardBlock = (stripe / 2) * TEST_CHUNK + block % TEST_CHUNK;
+        if (Test_isRight(&SDCardEmu_cards[card].storage[cardBlock * 512],block,1,tag) == FALSE)
+            isPlaced = FALSE;
+    }
+    Test_check(isPlaced == TRUE,name);
+    Test_check(after.blocks[0] + after.blocks[1] - before.blocks[0] - before.blocks[1] == count,name);
+
+    memset(Test_read,0,count * 512);
+    Test_check(SDCard_arrayReadBlocks(&Test_array,blockAddress,Test_read,count) == SDCARD_ERRORS_OK,name);
+    Test_check(Test_isRight(Test_read,blockAddress,count,tag) == TRUE,name);
+
+    printf("%-26s blocks %3u-%3u, card 0 %3u, card 1 %3u, %u commands written\n",
+           name,
+           blockAddress,
+           blockAddress + count - 1,
+           after.blocks[0] - before.blocks[0],
+           after.blocks[1] - before.blocks[1],
+           after.transfers - before.transfers);
+}
+
+static void Test_stripeMode (void)
+{
+    SDCard_ArrayStats before, after;
+    uint32_t sectors;
+
+    Test_setup(SDCARD_ARRAYMODE_STRIPE);
+    SDCard_arrayGetSectorCount(&Test_array,&sectors);
+    Test_check(sectors == 2 * SDCARD_EMU_SECTORS,"stripe sectors");
+
+    // Inside one chunk: one command to one card, for the write and the read
+    SDCard_getArrayStats(&Test_array,&before);
+    Test_stripe("inside a chunk",10,3,0x11);
+    SDCard_getArrayStats(&Test_array,&after);
+    Test_check(after.transfers - before.transfers == 2,"one command");
+    Test_check(after.blocks[0] == before.blocks[0],"one card");
+
+    // First and last chunks partial
+    Test_stripe("partial chunks",5,21,0x22);
+
+    // More chunks of a card than a round holds: more rounds
+    SDCard_getArrayStats(&Test_array,&before);
+    Test_stripe("more rounds",3,TEST_MAX,0x33);
+    SDCard_getArrayStats(&Test_array,&after);
+    Test_check(after.transfers - before.transfers > 2,"more rounds");
+
+    // Read back with other offsets of the chunks
+    memset(Test_read,0,sizeof(Test_read));
+    Test_check(SDCard_arrayReadBlocks(&Test_array,12,Test_read,97) == SDCARD_ERRORS_OK,"read with other offsets");
+    Test_check(Test_isRight(Test_read,12,97,0x33) == TRUE,"read with other offsets");
+
+    Test_check(SDCard_arrayWriteBlocks(&Test_array,sectors - 2,Test_data,3) != SDCARD_ERRORS_OK,
+               "write out of the array");
+}
+
+static void Test_mirrorMode (void)
+{
+    SDCard_ArrayStats before, after;
+    uint8_t i;
+
+    Test_setup(SDCARD_ARRAYMODE_MIRROR);
+
+    Test_fill(200,40,0x44);
+    Test_check(SDCard_arrayWriteBlocks(&Test_array,200,Test_data,40) == SDCARD_ERRORS_OK,"mirror write");
+    for (i = 0; i < 2; ++i)
+        Test_check(Test_isRight(&SDCardEmu_cards[i].storage[200 * 512],200,40,0x44) == TRUE,"mirror on each card");
+
+    // The read is split between the cards
+    SDCard_getArrayStats(&Test_array,&before);
+    memset(Test_read,0,sizeof(Test_read));
+    Test_check(SDCard_arrayReadBlocks(&Test_array,200,Test_read,40) == SDCARD_ERRORS_OK,"mirror read");
+    Test_check(Test_isRight(Test_read,200,40,0x44) == TRUE,"mirror read");
+    SDCard_getArrayStats(&Test_array,&after);
+    Test_check((after.blocks[0] - before.blocks[0] == 20) &&
+               (after.blocks[1] - before.blocks[1] == 20),"read split between the cards");
+
+    // Without card 1 its part is read from card 0, whichever card starts
+    SDCardEmu_cards[1].isPresent = FALSE;
+    for (i = 0; i < 2; ++i)
+    {
+        SDCard_getArrayStats(&Test_array,&before);
+        memset(Test_read,0,sizeof(Test_read));
+        Test_check(SDCard_arrayReadBlocks(&Test_array,200,Test_read,40) == SDCARD_ERRORS_OK,"failover read");
+        Test_check(Test_isRight(Test_read,200,40,0x44) == TRUE,"failover read");
+        SDCard_getArrayStats(&Test_array,&after);
+        Test_check(after.failovers - before.failovers == 1,"one failover");
+        Test_check(after.blocks[0] - before.blocks[0] == 40,"all blocks from card 0");
+    }
+    printf("mirror                     failovers %u, card 0 %u blocks, card 1 %u blocks\n",
+           after.failovers,
+           after.blocks[0],
+           after.blocks[1]);
+
+    // Without both cards the read fails
+    SDCardEmu_cards[0].isPresent = FALSE;
+    Test_check(SDCard_arrayReadBlocks(&Test_array,200,Test_read,40) != SDCARD_ERRORS_OK,"no card left");
+    SDCardEmu_cards[0].isPresent = TRUE;
+    SDCardEmu_cards[1].isPresent = TRUE;
+}
+
+int main (void)
+{
+    uint8_t i;
+
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    SDCardEmu_cards[1].bus = &SDCardEmu_buses[1];
+    for (i = 0; i < 2; ++i)
+        SDCardEmu_setup(&Test_devices[i],i);
+
+    Test_stripeMode();
+    Test_mirrorMode();
+
+    Test_check(SDCardEmu_collisions == 0,"one card on each bus");
+    printf(Test_failures == 0 ? "OK\n" : "%d failures\n",Test_failures);
+    return Test_failures;
+}
@@ -0,0 +1,188 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Test of the asynchronous block functions against the card emulator.
+ *
+ * SDCard_writeBlocksAsync and SDCard_readBlocksAsync run with one and many
+ * blocks, first with the data phase moved by the CPU into SDCard_poll, then
+ * with the DMA of the emulator (SDCardEmu_setupDma), whose thread moves the
+ * bytes and calls SDCard_transferComplete while the main thread polls. The
+ * last part runs two cards on two buses at once, each one with its DMA.
+ * Each operation must end with one callback, and the data must be right on
+ * the card and back into RAM. The exit code is the number of failures.
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_ADDRESS 1000
+#define TEST_BLOCKS  64
+
+static SDCard_Device Test_devices[2];
+static int Test_failures;
+
+static uint8_t Test_written[2][TEST_BLOCKS * 512];
+static uint8_t Test_read[2][TEST_BLOCKS * 512];
+
+static int Test_ends[2];
+static SDCard_Errors Test_errors[2];
+static uint32_t Test_inFlight;
+
+static void Test_check (bool condition, const char* message)
+{
+    if (condition == FALSE)
+    {
+        printf("FAIL: %s\n",message);
+        Test_failures++;
+    }
+}
+
+/**
+ * The callback of the operations: the context is the index of the device.
+ */
+static void Test_done (SDCard_Device* dev, SDCard_Errors error, void* context)
+{
+    uint8_t i = (uint8_t)(uintptr_t)context;
+
+    Test_ends[i]++;
+    Test_errors[i] = error;
+}
+
+/**
+ * The function polls the devices until their operations are ended, and
+ * counts the polls that returned with a data phase still moving.
+ */
+static void Test_wait (uint8_t devices)
+{
+    uint8_t i;
+    bool isRunning;
+
+    do
+    {
+        isRunning = FALSE;
+        for (i = 0; i < devices; ++i)
+        {
+            if (Test_ends[i] > 0)
+                continue;
+
+            isRunning = TRUE;
+            if ((SDCard_poll(&Test_devices[i]) == SDCARD_ERRORS_BUSY) &&
+                (Test_devices[i].asyncTransferDone == FALSE))
+                Test_inFlight++;
+        }
+    } while (isRunning == TRUE);
+}
+
+static void Test_start (uint8_t i, SDCard_Errors error)
+{
+    Test_ends[i]   = 0;
+    Test_errors[i] = SDCARD_ERRORS_OK;
+    Test_check(error == SDCARD_ERRORS_OK,"start");
+}
+
+/**
+ * The function writes and reads back count blocks on each device at once,
+ * and checks the callbacks, the card and the data read.
+ */
+static void Test_blocks (const char* name, uint8_t devices, uint32_t count)
+{
+    uint64_t transfers = SDCardEmu_dmaTransfers;
+    uint32_t i, j;
+
+    for (i = 0; i < devices; ++i)
+    {
+        for (j = 0; j < count * 512; ++j)
+            Test_written[i][j] = (uint8_t)(j / 512 * 31 + j + i * 7 + count);
+        memset(Test_read[i],0,count * 512);
+    }
+
+    for (i = 0; i < devices; ++i)
+        Test_start(i,SDCard_writeBlocksAsync(&Test_devices[i],TEST_ADDRESS,Test_written[i],count,Test_done,(void*)(uintptr_t)i));
+    Test_wait(devices);
+
+    for (i = 0; i < devices; ++i)
+    {
+        Test_check((Test_ends[i] == 1) && (Test_errors[i] == SDCARD_ERRORS_OK),"write callback");
+        Test_check(memcmp(&SDCardEmu_cards[i].storage[TEST_ADDRESS * 512],Test_written[i],count * 512) == 0,
+                   "data on the card");
+    }
+
+    for (i = 0; i < devices; ++i)
+        Test_start(i,SDCard_readBlocksAsync(&Test_devices[i],TEST_ADDRESS,Test_read[i],count,Test_done,(void*)(uintptr_t)i));
+    Test_wait(devices);
+
+    for (i = 0; i < devices; ++i)
+    {
+        Test_check((Test_ends[i] == 1) && (Test_errors[i] == SDCARD_ERRORS_OK),"read callback");
+        Test_check(memcmp(Test_read[i],Test_written[i],count * 512) == 0,"data read");
+    }
+
+    transfers = SDCardEmu_dmaTransfers - transfers;
+    printf("%-22s %2u blocks x %u: %llu DMA transfers\n",
+           name,
+           count,
+           devices,
+           (unsigned long long)transfers);
+    if (Test_devices[0].transferAsync != 0)
+        Test_check(transfers == (uint64_t)devices * count * 2,"a DMA transfer for each block");
+    else
+        Test_check(transfers == 0,"no DMA transfer");
+}
+
+int main (void)
+{
+    uint8_t i;
+
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    SDCardEmu_cards[1].bus = &SDCardEmu_buses[1];
+    for (i = 0; i < 2; ++i)
+    {
+        SDCardEmu_setup(&Test_devices[i],i);
+        if (SDCard_init(&Test_devices[i]) != SDCARD_ERRORS_OK)
+        {
+            printf("init failed\n");
+            return 1;
+        }
+    }
+
+    Test_blocks("CPU",1,1);
+    Test_blocks("CPU",1,TEST_BLOCKS);
+
+    SDCardEmu_setupDma(&Test_devices[0],0);
+    SDCardEmu_setupDma(&Test_devices[1],1);
+    Test_inFlight = 0;
+    Test_blocks("DMA",1,1);
+    Test_blocks("DMA",1,TEST_BLOCKS);
+    Test_blocks("DMA, two buses at once",2,TEST_BLOCKS);
+    printf("polls during a DMA transfer: %u\n",Test_inFlight);
+
+    Test_check(SDCardEmu_collisions == 0,"one card on each bus");
+    printf(Test_failures == 0 ? "OK\n" : "%d failures\n",Test_failures);
+    return Test_failures;
+}
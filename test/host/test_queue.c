@@ -0,0 +1,387 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Test of the request queue (WARCOMEB_SDCARD_QUEUE_CLIENTS) against the card
+ * emulator.
+ *
+ * The first part submits the requests from one task and checks the order
+ * of their ends: ascending blocks from the last one moved (C-LOOK), the
+ * merge of consecutive requests, a request blocked by an older write of
+ * the same blocks, and the deadline. The second part runs three clients
+ * in their threads while the main thread serves the queue, with a mutex
+ * into the lock and unlock functions: it checks that the queue is never
+ * held by two threads and that all data is right, and prints the latency
+ * of each client. The exit code is the number of failures.
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_MAX_ENDS     16
+#define TEST_STRESS       300
+#define TEST_FILES_BASE   20000
+#define TEST_FILES_BLOCKS 32000
+
+static SDCard_Device Test_device;
+static int Test_failures;
+
+static uint32_t Test_ends[TEST_MAX_ENDS];
+static uint8_t Test_endCount;
+
+static pthread_mutex_t Test_mutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int Test_holders;
+static atomic_int Test_running;
+static atomic_int Test_bad;
+
+static void Test_check (bool condition, const char* message)
+{
+    if (condition == FALSE)
+    {
+        printf("FAIL: %s\n",message);
+        Test_failures++;
+    }
+}
+
+/**
+ * The callback of the ordering tests: it records the first block of the
+ * request, passed as context.
+ */
+static void Test_done (SDCard_Device* dev, SDCard_Errors error, void* context)
+{
+    if (Test_endCount < TEST_MAX_ENDS)
+        Test_ends[Test_endCount++] = (uint32_t)(uintptr_t)context;
+    if (error != SDCARD_ERRORS_OK)
+        Test_failures++;
+}
+
+static void Test_submit (SDCard_Request* request,
+                         bool isWrite,
+                         uint32_t blockAddress,
+                         uint32_t count,
+                         uint8_t* data)
+{
+    memset(request,0,sizeof(SDCard_Request));
+    request->isWrite      = isWrite;
+    request->blockAddress = blockAddress;
+    request->count        = count;
+    request->data         = data;
+    request->callback     = Test_done;
+    request->context      = (void*)(uintptr_t)blockAddress;
+    Test_check(SDCard_submit(&Test_device,request) == SDCARD_ERRORS_OK,"submit");
+}
+
+/**
+ * The function serves the queue until it is empty, and compares the order
+ * of the ends with the expected one.
+ */
+static void Test_expect (const char* name, const uint32_t* expected, uint8_t count)
+{
+    uint8_t i;
+
+    while (SDCard_queueService(&Test_device) != SDCARD_ERRORS_OK)
+        ;
+
+    printf("%-10s",name);
+    for (i = 0; i < Test_endCount; ++i)
+        printf(" %u",Test_ends[i]);
+    printf("\n");
+
+    Test_check(Test_endCount == count,name);
+    for (i = 0; (i < count) && (i < Test_endCount); ++i)
+        Test_check(Test_ends[i] == expected[i],name);
+    Test_endCount = 0;
+}
+
+static void Test_order (void)
+{
+    static uint8_t data[60 * 512];
+    static uint8_t written[512];
+    SDCard_Request requests[5];
+    uint8_t i;
+
+    // C-LOOK from block 0, 100 and 101 go with one command
+    {
+        const uint32_t expected[] = {50,100,101,300,500};
+        uint32_t transfers = Test_device.queueTransfers;
+
+        Test_submit(&requests[0],FALSE,500,1,data);
+        Test_submit(&requests[1],FALSE,100,1,data + 512);
+        Test_submit(&requests[2],FALSE,300,1,data + 1024);
+        Test_submit(&requests[3],FALSE,101,1,data + 1536);
+        Test_submit(&requests[4],FALSE,50,1,data + 2048);
+        Test_expect("elevator",expected,5);
+        Test_check(Test_device.queueTransfers - transfers == 4,"merge of 100 and 101");
+    }
+
+    // From block 501: 600, then again from the lowest
+    {
+        const uint32_t expected[] = {600,10,400};
+
+        Test_submit(&requests[0],FALSE,400,1,data);
+        Test_submit(&requests[1],FALSE,600,1,data + 512);
+        Test_submit(&requests[2],FALSE,10,1,data + 1024);
+        Test_expect("wrap",expected,3);
+    }
+
+    // The read of 650-709 waits for the older write of 700, 680 doesn't
+    {
+        const uint32_t expected[] = {680,700,650};
+
+        memset(written,0xA5,sizeof(written));
+        Test_submit(&requests[0],TRUE,700,1,written);
+        Test_submit(&requests[1],FALSE,650,60,data);
+        Test_submit(&requests[2],FALSE,680,1,data + 60 * 512 - 512);
+        Test_expect("blocked",expected,3);
+        for (i = 0; i < 8; ++i)
+            Test_check(data[(700 - 650) * 512 + i] == 0xA5,"read after the write");
+    }
+
+    // From block 710 the read of 800 goes first, unless 100 waits too much
+    {
+        const uint32_t expected[] = {800,100};
+        const uint32_t late[] = {100,800};
+
+        Test_submit(&requests[0],FALSE,100,1,data);
+        SDCardEmu_advance(10000000);
+        Test_submit(&requests[1],FALSE,800,1,data + 512);
+        Test_expect("no limit",expected,2);
+
+        Test_device.queueDeadline = 5;
+        Test_submit(&requests[0],FALSE,100,1,data);
+        SDCardEmu_advance(10000000);
+        Test_submit(&requests[1],FALSE,800,1,data + 512);
+        Test_expect("deadline",late,2);
+        Test_device.queueDeadline = 0;
+    }
+}
+
+static void Test_lock (SDCard_Device* dev)
+{
+    pthread_mutex_lock(&Test_mutex);
+    if (atomic_fetch_add(&Test_holders,1) != 0)
+        atomic_fetch_add(&Test_bad,1);
+}
+
+static void Test_unlock (SDCard_Device* dev)
+{
+    atomic_fetch_sub(&Test_holders,1);
+    pthread_mutex_unlock(&Test_mutex);
+}
+
+/**
+ * A request of the threads: its end is published by the callback with an
+ * atomic flag, the result alone doesn't order the memory between threads.
+ */
+typedef struct _Test_Slot
+{
+    SDCard_Request request;
+    SDCard_Errors  error;
+    atomic_int     done;
+} Test_Slot;
+
+static void Test_finish (SDCard_Device* dev, SDCard_Errors error, void* context)
+{
+    Test_Slot* slot = (Test_Slot*)context;
+
+    slot->error = error;
+    atomic_store_explicit(&slot->done,1,memory_order_release);
+}
+
+static void Test_wait (Test_Slot* slot)
+{
+    while (atomic_load_explicit(&slot->done,memory_order_acquire) == 0)
+        sched_yield();
+    if (slot->error != SDCARD_ERRORS_OK)
+        atomic_fetch_add(&Test_bad,1);
+}
+
+static void Test_fill (Test_Slot* slot,
+                       uint8_t client,
+                       bool isWrite,
+                       uint32_t blockAddress,
+                       uint32_t count,
+                       uint8_t* data)
+{
+    SDCard_Request* request = &slot->request;
+
+    memset(request,0,sizeof(SDCard_Request));
+    request->client       = client;
+    request->isWrite      = isWrite;
+    request->blockAddress = blockAddress;
+    request->count        = count;
+    request->data         = data;
+    request->callback     = Test_finish;
+    request->context      = slot;
+    atomic_store(&slot->done,0);
+    if (SDCard_submit(&Test_device,request) != SDCARD_ERRORS_OK)
+        atomic_fetch_add(&Test_bad,1);
+}
+
+/**
+ * Client 0: a logger that writes consecutive blocks, four in flight.
+ */
+static void* Test_logger (void* argument)
+{
+    static uint8_t buffers[4][512];
+    Test_Slot slots[4];
+    uint32_t i;
+
+    for (i = 0; i < TEST_STRESS; ++i)
+    {
+        if (i >= 4)
+            Test_wait(&slots[i % 4]);
+        memset(buffers[i % 4],(uint8_t)i,512);
+        Test_fill(&slots[i % 4],0,TRUE,1000 + i,1,buffers[i % 4]);
+    }
+    for (i = 0; i < 4; ++i)
+        Test_wait(&slots[i]);
+    atomic_fetch_sub(&Test_running,1);
+    return 0;
+}
+
+/**
+ * Client 1: writes a random block and reads it back.
+ */
+static void* Test_config (void* argument)
+{
+    uint8_t written[512], read[512];
+    Test_Slot slot;
+    unsigned int seed = 1;
+    uint32_t i, block;
+
+    for (i = 0; i < TEST_STRESS / 3; ++i)
+    {
+        block = 5000 + rand_r(&seed) % 64;
+        memset(written,(uint8_t)(block + i),512);
+        Test_fill(&slot,1,TRUE,block,1,written);
+        Test_wait(&slot);
+        Test_fill(&slot,1,FALSE,block,1,read);
+        Test_wait(&slot);
+        if (memcmp(written,read,512) != 0)
+            atomic_fetch_add(&Test_bad,1);
+    }
+    atomic_fetch_sub(&Test_running,1);
+    return 0;
+}
+
+/**
+ * Client 2: reads groups of eight files of four blocks.
+ */
+static void* Test_files (void* argument)
+{
+    static uint8_t read[8][4 * 512];
+    Test_Slot slots[8];
+    unsigned int seed = 7;
+    uint32_t i, k, base;
+
+    for (i = 0; i < TEST_STRESS / 8; ++i)
+    {
+        base = TEST_FILES_BASE + (rand_r(&seed) % (TEST_FILES_BLOCKS / 32)) * 32;
+        for (k = 0; k < 8; ++k)
+            Test_fill(&slots[k],2,FALSE,base + k * 4,4,read[k]);
+        for (k = 0; k < 8; ++k)
+        {
+            Test_wait(&slots[k]);
+            if (read[k][0] != (uint8_t)((base + k * 4) * 3))
+                atomic_fetch_add(&Test_bad,1);
+        }
+    }
+    atomic_fetch_sub(&Test_running,1);
+    return 0;
+}
+
+static void Test_stress (void)
+{
+    uint8_t* storage = SDCardEmu_cards[0].storage;
+    SDCard_QueueStats stats;
+    pthread_t threads[3];
+    uint32_t transfers = Test_device.queueTransfers;
+    uint64_t start;
+    uint32_t i;
+    uint8_t client;
+
+    memset(Test_device.queueStats,0,sizeof(Test_device.queueStats));
+    for (i = TEST_FILES_BASE; i < TEST_FILES_BASE + TEST_FILES_BLOCKS; ++i)
+        storage[(size_t)i * 512] = (uint8_t)(i * 3);
+
+    Test_device.lock   = Test_lock;
+    Test_device.unlock = Test_unlock;
+    Test_device.queueDeadline = 200;
+    atomic_store(&Test_running,3);
+
+    start = SDCardEmu_now();
+    pthread_create(&threads[0],0,Test_logger,0);
+    pthread_create(&threads[1],0,Test_config,0);
+    pthread_create(&threads[2],0,Test_files,0);
+    while ((atomic_load(&Test_running) != 0) ||
+           (SDCard_queueService(&Test_device) != SDCARD_ERRORS_OK))
+        SDCard_queueService(&Test_device);
+    for (i = 0; i < 3; ++i)
+        pthread_join(threads[i],0);
+
+    for (i = 0; i < TEST_STRESS; ++i)
+        Test_check(storage[(size_t)(1000 + i) * 512] == (uint8_t)i,"logger data");
+    Test_check(atomic_load(&Test_bad) == 0,"stress: lock held twice, or wrong data");
+
+    printf("stress     %.1f ms, %u commands\n",
+           (SDCardEmu_now() - start) / 1e6,
+           Test_device.queueTransfers - transfers);
+    for (client = 0; client < 3; ++client)
+    {
+        SDCard_getQueueStats(&Test_device,client,&stats);
+        printf("client %u   %u requests, %u blocks, %u merged, mean %.1f ms, max %u ms\n",
+               client,
+               stats.requests,
+               stats.blocks,
+               stats.merged,
+               (stats.requests != 0) ? (double)stats.totalLatency / stats.requests : 0.0,
+               stats.maxLatency);
+    }
+}
+
+int main (void)
+{
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    SDCardEmu_setup(&Test_device,0);
+    if (SDCard_init(&Test_device) != SDCARD_ERRORS_OK)
+    {
+        printf("init failed\n");
+        return 1;
+    }
+
+    Test_order();
+    Test_stress();
+
+    printf("%s\n",(Test_failures == 0) ? "OK" : "FAILED");
+    return Test_failures;
+}
@@ -0,0 +1,261 @@
+/******************************************************************************
+ * Copyright (C) 2017-2018 Marco Giammarini
+ *
+ * Authors:
+ *  Marco Giammarini <m.giammarini@warcomeb.it>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ * Test of the record store (WARCOMEB_SDCARD_STORE_SEGMENTS) against the card
+ * emulator, with an AU of 32 sectors and 4 data segments.
+ *
+ * Record r has the time 10 * r and TEST_LENGTH bytes of value r, so each
+ * full sector holds 5 records. The test formats the store, appends, syncs
+ * and reads back; then cuts the power during the CMD25 of the appends, with
+ * the last sector written torn, and checks that the mount finds the sectors
+ * before it; then fills the ring until its oldest segments are dropped,
+ * and seeks at the boundaries of segments and sectors. The exit code is
+ * the number of failures.
+ ******************************************************************************/
+
+#include "sdcard_emu.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_AU_SIZE 1                        // 32 sectors for each segment
+#define TEST_SEGMENT 32
+#define TEST_START   (10 * TEST_SEGMENT)
+#define TEST_LENGTH  94                     // 5 records of 100 bytes a sector
+#define TEST_END     0xFFFFFFFFUL
+
+static SDCard_Device Test_device;
+static SDCard_Store Test_store;
+static int Test_failures;
+
+static void Test_check (bool condition, const char* message)
+{
+    if (condition == FALSE)
+    {
+        printf("FAIL: %s\n",message);
+        Test_failures++;
+    }
+}
+
+/**
+ * The function removes the power of the card, initializes it again and
+ * mounts the store.
+ */
+static SDCard_Errors Test_remount (void)
+{
+    SDCardEmu_powerCycle(0);
+    SDCardEmu_setup(&Test_device,0);
+    if (SDCard_init(&Test_device) != SDCARD_ERRORS_OK)
+        return SDCARD_ERRORS_INIT_FAILED;
+    return SDCard_storeMount(&Test_store);
+}
+
+/**
+ * The function appends the records from first to last.
+ */
+static void Test_append (uint32_t first, uint32_t last)
+{
+    uint8_t data[TEST_LENGTH];
+    uint32_t r;
+
+    for (r = first; r <= last; ++r)
+    {
+        memset(data,(uint8_t)r,TEST_LENGTH);
+        if (SDCard_storeAppend(&Test_store,10 * r,data,TEST_LENGTH) != SDCARD_ERRORS_OK)
+        {
+            Test_check(FALSE,"append");
+            return;
+        }
+    }
+}
+
+/**
+ * The function reads from the cursor until the end of the log, and checks
+ * that the records are first, first + 1... up to last and that they are
+ * right.
+ *
+ * @return The number of records read
+ */
+static uint32_t Test_readFrom (SDCard_StoreCursor* cursor,
+                               const char* name,
+                               uint32_t first,
+                               uint32_t last)
+{
+    uint8_t data[SDCARD_STORE_MAX_LENGTH];
+    SDCard_Errors error;
+    uint32_t time, count = 0;
+    uint32_t r = first;
+    uint16_t length;
+    bool isRight = TRUE;
+
+    while ((error = SDCard_storeRead(&Test_store,cursor,&time,data,&length)) == SDCARD_ERRORS_OK)
+    {
+        if ((time != 10 * r) ||
+            (length != TEST_LENGTH) ||
+            (data[0] != (uint8_t)r) ||
+            (data[TEST_LENGTH - 1] != (uint8_t)r))
+            isRight = FALSE;
+        r++;
+        count++;
+    }
+
+    printf("%-28s %4u records from %u\n",name,count,(count > 0) ? first : 0);
+    Test_check(error == SDCARD_ERRORS_END,name);
+    Test_check(isRight == TRUE,name);
+    if (first == TEST_END)
+        Test_check(count == 0,name);
+    else
+        Test_check(count == last - first + 1,name);
+    return count;
+}
+
+/**
+ * The function seeks the time and reads from there.
+ */
+static void Test_seek (const char* name,
+                       uint32_t time,
+                       uint32_t first,
+                       uint32_t last)
+{
+    SDCard_StoreCursor cursor;
+
+    Test_check(SDCard_storeSeek(&Test_store,time,&cursor) == SDCARD_ERRORS_OK,name);
+    Test_readFrom(&cursor,name,first,last);
+}
+
+static void Test_appendSync (void)
+{
+    SDCard_StoreCursor cursor;
+    SDCard_StoreStats stats;
+    uint32_t time;
+    uint16_t length;
+
+    Test_check(SDCard_storeFormat(&Test_store) == SDCARD_ERRORS_OK,"format");
+    Test_check(Test_store.segment == TEST_SEGMENT,"segment of one AU");
+    Test_seek("empty",0,TEST_END,0);
+
+    Test_append(0,51);
+    Test_check(SDCard_storeSync(&Test_store) == SDCARD_ERRORS_OK,"sync");
+    Test_check(SDCard_storeSeek(&Test_store,0,&cursor) == SDCARD_ERRORS_OK,"seek");
+    Test_readFrom(&cursor,"append and sync",0,51);
+
+    // The cursor at the end reads the records appended later
+    Test_append(52,52);
+    Test_check(SDCard_storeRead(&Test_store,&cursor,&time,0,&length) == SDCARD_ERRORS_OK,
+               "record appended after the end");
+    Test_check(time == 520,"record appended after the end");
+    Test_check(SDCard_storeSync(&Test_store) == SDCARD_ERRORS_OK,"sync");
+
+    SDCard_getStoreStats(&Test_store,&stats);
+    Test_check((stats.records == 53) && (stats.sectors == 12),"statistics");
+
+    Test_check(Test_remount() == SDCARD_ERRORS_OK,"mount");
+    Test_seek("mount after sync",0,0,52);
+}
+
+static void Test_tornWrite (void)
+{
+    uint8_t* storage = SDCardEmu_cards[0].storage;
+    uint32_t buffered, torn, block;
+
+    // From sector 13 on the records are only into the CMD25 left open
+    Test_append(53,129);
+    buffered = Test_store.used / (SDCARD_STORE_RECORD + TEST_LENGTH);
+
+    // The power goes down while the last sector is programmed
+    block = TEST_START + TEST_SEGMENT + Test_store.sequence - 2;
+    torn  = (storage[block * 512 + 8] | (storage[block * 512 + 9] << 8)) /
+            (SDCARD_STORE_RECORD + TEST_LENGTH);
+    memset(&storage[block * 512 + 256],0xA5,256);
+
+    Test_check(Test_remount() == SDCARD_ERRORS_OK,"mount after a torn CMD25");
+    Test_seek("mount after a torn CMD25",0,0,129 - buffered - torn);
+
+    // The log goes on from the last sector found
+    Test_append(130 - buffered - torn,140);
+    Test_check(SDCard_storeSync(&Test_store) == SDCARD_ERRORS_OK,"sync");
+    Test_check(Test_remount() == SDCARD_ERRORS_OK,"mount");
+    Test_seek("append after the torn sector",0,0,140);
+}
+
+static void Test_wrap (void)
+{
+    SDCard_StoreCursor cursor;
+    SDCard_StoreStats stats;
+
+    // 180 sectors into a ring of 128: the first two segments are dropped
+    Test_check(SDCard_storeFormat(&Test_store) == SDCARD_ERRORS_OK,"format");
+    Test_append(0,899);
+    Test_check(SDCard_storeSync(&Test_store) == SDCARD_ERRORS_OK,"sync");
+    SDCard_getStoreStats(&Test_store,&stats);
+    Test_check(stats.dropped == 2,"two segments dropped");
+    Test_check(Test_store.head == 2 * TEST_SEGMENT + 1,"head after the wrap");
+
+    Test_seek("wrap, from the start",0,320,899);
+    Test_seek("head segment",3200,320,899);
+    Test_seek("segment boundary",4800,480,899);
+    Test_seek("before a segment boundary",4795,480,899);
+    Test_seek("last of a segment",4790,479,899);
+    Test_seek("sector boundary",4950,495,899);
+    Test_seek("before a sector boundary",4941,495,899);
+    Test_seek("middle of a sector",4970,497,899);
+    Test_seek("last record",8990,899,899);
+    Test_seek("after the last record",9000,TEST_END,0);
+
+    Test_check(Test_remount() == SDCARD_ERRORS_OK,"mount after the wrap");
+    Test_seek("mount after the wrap",0,320,899);
+    Test_seek("segment boundary",4800,480,899);
+
+    // A cursor into a segment dropped later goes on from the oldest record
+    Test_check(SDCard_storeSeek(&Test_store,3200,&cursor) == SDCARD_ERRORS_OK,"seek");
+    Test_append(900,979);
+    Test_check(Test_store.head == 3 * TEST_SEGMENT + 1,"head after the next drop");
+    Test_readFrom(&cursor,"cursor into a dropped segment",480,979);
+}
+
+int main (void)
+{
+    SDCardEmu_reset(SDCARD_EMU_SECTORS);
+    SDCardEmu_cards[0].auSize = TEST_AU_SIZE;
+    SDCardEmu_setup(&Test_device,0);
+    if (SDCard_init(&Test_device) != SDCARD_ERRORS_OK)
+    {
+        printf("init failed\n");
+        return 1;
+    }
+
+    Test_store.dev   = &Test_device;
+    Test_store.start = TEST_START;
+    Test_store.count = (WARCOMEB_SDCARD_STORE_SEGMENTS + 1) * TEST_SEGMENT;
+
+    Test_appendSync();
+    Test_tornWrite();
+    Test_wrap();
+
+    printf(Test_failures == 0 ? "OK\n" : "%d failures\n",Test_failures);
+    return Test_failures;
+}
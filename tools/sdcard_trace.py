@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+#
+# Decoder of the events recorded with WARCOMEB_SDCARD_TRACE_EVENTS.
+#
+# The input is the raw dump of the SDCard_TraceEvent read with
+# SDCard_traceRead, 8 bytes for each event in the byte order of the board:
+# time (uint32), type (uint8), code (uint8), value (uint16).
+#
+# Usage:
+#   sdcard_trace.py dump.bin                  per-operation timeline
+#   sdcard_trace.py --summary dump.bin        time by operation and phase
+#   sdcard_trace.py --folded dump.bin         folded stacks for flamegraph.pl
+#
+# Copyright (C) 2017-2018 Marco Giammarini, MIT license (see LICENSE).
+
+import argparse
+import struct
+import sys
+from collections import defaultdict
+
+TYPES = ["START", "END", "COMMAND", "RESPONSE", "TOKEN", "DATA_START",
+         "DATA_END", "BUSY_START", "BUSY_END", "DESELECT"]
+
+(START, END, COMMAND, RESPONSE, TOKEN, DATA_START,
+ DATA_END, BUSY_START, BUSY_END, DESELECT) = range(len(TYPES))
+
+# The data command names the operation
+OPERATIONS = {17: "read", 18: "read_multiple", 24: "write",
+              25: "write_multiple", 38: "erase", 0: "init", 9: "read_csd"}
+
+# The time after an event, until the next one, belongs to this phase
+PHASES = {COMMAND: "command", TOKEN: "data", DATA_START: "data",
+          BUSY_START: "busy"}
+
+ERRORS = ["OK", "CARD_NOT_PRESENT", "CARD_NOT_DETECTED", "COMMAND_TIMEOUT",
+          "COMMAND_FAILED", "TIMEOUT", "INIT_FAILED", "WRITE_BLOCK_FAILED",
+          "READ_BLOCK_FAILED", "WRITE_BLOCKS_FAILED", "READ_BLOCKS_FAILED",
+          "ERASE_BLOCKS_FAILED", "BUSY"]
+
+
+def read_events(path, endian):
+    with open(path, "rb") as f:
+        data = f.read()
+    size = struct.calcsize(endian + "IBBH")
+    for offset in range(0, len(data) - size + 1, size):
+        yield struct.unpack_from(endian + "IBBH", data, offset)
+
+
+def describe(event):
+    time, kind, code, value = event
+    if kind == COMMAND:
+        return "CMD%d arg 0x....%04X" % (code, value)
+    if kind == RESPONSE:
+        return "R1 0x%02X after %d bytes" % (code, value)
+    if kind == TOKEN:
+        return "token 0x%02X" % code
+    if kind == DATA_START:
+        return "data %d bytes" % value
+    if kind == DATA_END:
+        return "data end" + (" response 0x%02X" % code if code else "")
+    if kind == START:
+        return "start (state %d)" % code
+    if kind == END:
+        return "end " + (ERRORS[code] if code < len(ERRORS) else str(code))
+    return TYPES[kind].lower() if kind < len(TYPES) else "type %d" % kind
+
+
+def split_operations(events):
+    """Groups the events from START to END, the others go alone."""
+    operation = []
+    for event in events:
+        if event[1] == START and operation:
+            yield operation
+            operation = []
+        operation.append(event)
+        if event[1] == END:
+            yield operation
+            operation = []
+    if operation:
+        yield operation
+
+
+def name_of(operation):
+    for event in operation:
+        if event[1] == COMMAND and event[2] in OPERATIONS:
+            return OPERATIONS[event[2]]
+    if operation[0][1] != START:
+        return "out_of_operation"
+    return "other"
+
+
+def phases_of(operation):
+    """Returns the time of each phase of an operation."""
+    result = defaultdict(int)
+    phase = "host"
+    # The operation can wait the programming left by the previous one
+    for event in operation:
+        if event[1] in (BUSY_START, BUSY_END):
+            if event[1] == BUSY_END:
+                phase = "busy"
+            break
+    read_command = False
+    for event, following in zip(operation, operation[1:]):
+        kind = event[1]
+        if kind == COMMAND:
+            read_command = event[2] in (17, 18)
+        if kind == RESPONSE:
+            phase = "token_wait" if read_command else "host"
+        elif kind == DATA_END:
+            phase = "token_wait" if read_command else "host"
+        elif kind in (BUSY_END, DESELECT):
+            phase = "host"
+        elif kind in PHASES:
+            phase = PHASES[kind]
+        result[phase] += (following[0] - event[0]) & 0xFFFFFFFF
+    return result
+
+
+def timeline(operations, out):
+    for index, operation in enumerate(operations):
+        first = operation[0][0]
+        last = operation[-1][0]
+        out.write("#%d %s at %d, %d units\n" %
+                  (index, name_of(operation), first,
+                   (last - first) & 0xFFFFFFFF))
+        for event in operation:
+            if event[1] == DESELECT:
+                continue
+            out.write("  +%-8d %s\n" % ((event[0] - first) & 0xFFFFFFFF,
+                                        describe(event)))
+
+
+def summary(operations, out, folded):
+    total = defaultdict(int)
+    count = defaultdict(int)
+    for operation in operations:
+        name = name_of(operation)
+        count[name] += 1
+        for phase, time in phases_of(operation).items():
+            total[(name, phase)] += time
+
+    if folded:
+        for (name, phase), time in sorted(total.items()):
+            out.write("%s;%s %d\n" % (name, phase, time))
+        return
+
+    grand = sum(total.values()) or 1
+    for name in sorted(count):
+        time = sum(t for (n, p), t in total.items() if n == name)
+        out.write("%-16s %6d ops %10d units %5.1f%%\n" %
+                  (name, count[name], time, 100.0 * time / grand))
+        for (n, phase), t in sorted(total.items()):
+            if n == name and t:
+                out.write("  %-14s %10d units %5.1f%%  %s\n" %
+                          (phase, t, 100.0 * t / grand,
+                           "#" * int(40 * t / grand)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a dump of the SDCard trace events.")
+    parser.add_argument("dump")
+    parser.add_argument("--big-endian", action="store_true")
+    group = parser.add_mutually_exclusive_group()
+    group.add_argument("--summary", action="store_true")
+    group.add_argument("--folded", action="store_true")
+    args = parser.parse_args()
+
+    events = read_events(args.dump, ">" if args.big_endian else "<")
+    operations = list(split_operations(events))
+    if args.summary or args.folded:
+        summary(operations, sys.stdout, args.folded)
+    else:
+        timeline(operations, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()